@@ -0,0 +1,233 @@
+require 'menoh'
+require 'etc'
+require 'fileutils'
+require 'json'
+require 'rbconfig'
+require 'time'
+require 'tmpdir'
+require_relative 'onnx_writer'
+
+module Menoh
+  module Bench
+    # Benchmarks MenohModel on synthetic models generated by OnnxWriter and
+    # writes the results as JSON. Every case is a model, an input/output path,
+    # a batch size and a number of threads running models of their own.
+    #
+    # Paths:
+    #   array    - run with an Array, nested Arrays out
+    #   tensor   - run with an Array, Menoh::Tensor out
+    #   string   - run_raw with a binary String, Strings out
+    #   slots    - run with an Array, outputs into reused Strings
+    #   external - caller-owned external buffers, nothing copied
+    #
+    # Configured with environment variables, see DEFAULTS.
+    class Runner
+      DEFAULTS = {
+        models: 'mlp,cnn',
+        paths: 'array,tensor,string,slots,external',
+        batches: '1,8,32',
+        threads: '1,2,4',
+        iterations: '100', # per thread
+        warmup: '5',
+        layers: '2',
+        hidden: '256', # width of the MLP layers
+        filters: '16', # channels of the CNN layers
+        image_size: '32',
+        backend: 'mkldnn'
+      }.freeze
+
+      LIST_KEYS = %i[models paths batches threads].freeze
+      INTEGER_KEYS = %i[batches threads iterations warmup layers hidden filters image_size].freeze
+
+      def self.config_from_env(env = ENV)
+        DEFAULTS.to_h { |key, default| [key, parse(key, env.fetch("BENCH_#{key.upcase}", default))] }
+      end
+
+      def self.parse(key, value)
+        value = value.split(',').map(&:strip) if LIST_KEYS.include?(key)
+        return value unless INTEGER_KEYS.include?(key)
+
+        value.is_a?(Array) ? value.map { |v| Integer(v) } : Integer(value)
+      end
+
+      attr_reader :config, :results
+
+      def initialize(config)
+        @config = config
+        @results = []
+      end
+
+      def run(dir)
+        config[:models].each do |name|
+          spec = model_spec(name)
+          path = File.join(dir, "#{name}.onnx")
+          File.binwrite(path, spec[:onnx])
+          onnx = ::Menoh::Menoh.new(path)
+          config[:paths].each do |io_path|
+            config[:batches].each do |batch|
+              config[:threads].each do |threads|
+                result = measure(onnx, spec, io_path, batch, threads)
+                report(result)
+                @results << result
+              end
+            end
+          end
+        end
+        self
+      end
+
+      def to_h
+        {
+          menoh_ruby: ::Menoh::VERSION,
+          ruby: RUBY_DESCRIPTION,
+          platform: RbConfig::CONFIG['host'],
+          processors: Etc.nprocessors,
+          time: Time.now.utc.iso8601,
+          config: config,
+          results: results
+        }
+      end
+
+      private
+
+      def model_spec(name)
+        case name
+        when 'mlp'
+          onnx = OnnxWriter.mlp(inputs: 784, hidden: config[:hidden],
+                                layers: config[:layers], classes: 10)
+          { name: name, onnx: onnx, input: [784] }
+        when 'cnn'
+          size = config[:image_size]
+          onnx = OnnxWriter.cnn(channels: 3, filters: config[:filters],
+                                layers: config[:layers], size: size)
+          { name: name, onnx: onnx, input: [3, size, size] }
+        else
+          raise "Unknown model : #{name}"
+        end
+      end
+
+      def model_option(spec, batch)
+        {
+          backend: config[:backend],
+          input_layers: [{ name: 'input', dims: [batch] + spec[:input] }],
+          output_layers: ['output']
+        }
+      end
+
+      # A callable doing one inference on the path with a model of its own
+      def prepare(onnx, spec, io_path, batch)
+        option = model_option(spec, batch)
+        random = Random.new(0)
+        data = Array.new(batch * spec[:input].inject(:*)) { random.rand }
+        dataset = [{ name: 'input', data: data }]
+
+        case io_path
+        when 'array'
+          model = onnx.make_model(option)
+          -> { model.run(dataset) }
+        when 'tensor'
+          model = onnx.make_model(option)
+          -> { model.run(dataset, tensors: true) }
+        when 'string'
+          model = onnx.make_model(option)
+          inputs = { 'input' => data.pack('f*') }
+          -> { model.run_raw(inputs) }
+        when 'slots'
+          model = onnx.make_model(option)
+          slots = model.output_slots
+          -> { model.run(dataset, into: slots) }
+        when 'external'
+          output_size = onnx.make_model(option).get_data_str('output').bytesize
+          model = onnx.make_model(option.merge(external_buffers: {
+                                                 'input' => data.pack('f*'),
+                                                 'output' => "\0".b * output_size
+                                               }))
+          # the inputs stay in place, only the run itself is left
+          run = model.method(:native_run)
+          -> { run.call }
+        else
+          raise "Unknown path : #{io_path}"
+        end
+      end
+
+      def measure(onnx, spec, io_path, batch, threads)
+        calls = Array.new(threads) { prepare(onnx, spec, io_path, batch) }
+        calls.each { |call| config[:warmup].times { call.call } }
+
+        GC.start
+        allocated = GC.stat(:total_allocated_objects)
+        started = now
+        latencies = if threads == 1
+                      [timed_loop(calls.first)]
+                    else
+                      calls.map { |call| Thread.new { timed_loop(call) } }.map(&:value)
+                    end
+        elapsed = now - started
+        allocated = GC.stat(:total_allocated_objects) - allocated
+
+        latencies = latencies.flatten.sort!
+        {
+          model: spec[:name],
+          path: io_path,
+          batch: batch,
+          threads: threads,
+          calls: latencies.length,
+          latency_ms: latency_summary(latencies),
+          calls_per_second: latencies.length / elapsed,
+          samples_per_second: latencies.length * batch / elapsed,
+          allocations_per_call: allocated.fdiv(latencies.length)
+        }
+      end
+
+      def timed_loop(call)
+        latencies = Array.new(config[:iterations])
+        config[:iterations].times do |i|
+          started = now
+          call.call
+          latencies[i] = now - started
+        end
+        latencies
+      end
+
+      def latency_summary(sorted)
+        ms = ->(seconds) { (seconds * 1000).round(4) }
+        {
+          mean: ms.call(sorted.sum / sorted.length),
+          p50: ms.call(percentile(sorted, 50)),
+          p90: ms.call(percentile(sorted, 90)),
+          p99: ms.call(percentile(sorted, 99)),
+          max: ms.call(sorted.last)
+        }
+      end
+
+      # nearest rank
+      def percentile(sorted, p)
+        sorted[[(sorted.length * p / 100.0).ceil - 1, 0].max]
+      end
+
+      def now
+        Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      end
+
+      def report(result)
+        latency = result[:latency_ms]
+        puts format('%-4s %-9s batch=%-4d threads=%-3d p50=%.3fms p90=%.3fms p99=%.3fms ' \
+                    '%.1f samples/s %.1f allocs/call',
+                    result[:model], result[:path], result[:batch], result[:threads],
+                    latency[:p50], latency[:p90], latency[:p99],
+                    result[:samples_per_second], result[:allocations_per_call])
+      end
+    end
+  end
+end
+
+if $PROGRAM_NAME == __FILE__
+  runner = Menoh::Bench::Runner.new(Menoh::Bench::Runner.config_from_env)
+  Dir.mktmpdir('menoh-bench') { |dir| runner.run(dir) }
+
+  output = ENV['BENCH_OUTPUT'] ||
+           File.join(__dir__, 'results', "menoh-#{Menoh::VERSION}-#{Time.now.strftime('%Y%m%d%H%M%S')}.json")
+  FileUtils.mkdir_p(File.dirname(output))
+  File.write(output, JSON.pretty_generate(runner.to_h))
+  puts "Wrote #{output}"
+end
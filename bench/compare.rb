@@ -0,0 +1,24 @@
+require 'json'
+
+# Compares two result files of bench/bench.rb case by case:
+#   ruby bench/compare.rb base.json new.json
+# Ratios above 1 mean the new version is slower (latency) or faster
+# (throughput).
+base, current = ARGV.map { |file| JSON.parse(File.read(file), symbolize_names: true) }
+abort 'usage: compare.rb BASE.json NEW.json' if current.nil?
+
+key = ->(r) { r.values_at(:model, :path, :batch, :threads) }
+base_results = base[:results].to_h { |r| [key.call(r), r] }
+
+puts "#{base[:menoh_ruby]} -> #{current[:menoh_ruby]}"
+current[:results].each do |result|
+  before = base_results[key.call(result)]
+  next if before.nil?
+
+  puts format('%-4s %-9s batch=%-4d threads=%-3d p50 x%.2f p99 x%.2f samples/s x%.2f allocs/call %+.1f',
+              *key.call(result),
+              result[:latency_ms][:p50] / before[:latency_ms][:p50],
+              result[:latency_ms][:p99] / before[:latency_ms][:p99],
+              result[:samples_per_second] / before[:samples_per_second],
+              result[:allocations_per_call] - before[:allocations_per_call])
+end
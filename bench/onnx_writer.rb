@@ -0,0 +1,175 @@
+module Menoh
+  module Bench
+    # Writes small ONNX models without the onnx or protobuf gems, so that the
+    # benchmarks need neither the network nor a Python toolchain. Only the
+    # parts of onnx.proto used by Gemm/Conv/Relu/Softmax stacks are encoded.
+    module OnnxWriter
+      IR_VERSION = 3
+      OPSET_VERSION = 8
+      FLOAT = 1 # TensorProto::DataType
+      ATTRIBUTE_TYPES = { int: 2, ints: 7 }.freeze
+
+      module_function
+
+      # An MLP: (Gemm, Relu) x layers, then Gemm to `classes` and Softmax.
+      # The input is [batch, inputs].
+      def mlp(inputs:, hidden:, layers:, classes:, seed: 0)
+        graph = Graph.new('mlp', Random.new(seed))
+        x = graph.input('input', [inputs])
+        width = inputs
+        layers.times do |i|
+          x = graph.gemm(x, width, hidden, "fc#{i}")
+          x = graph.node('Relu', [x], "relu#{i}")
+          width = hidden
+        end
+        x = graph.gemm(x, width, classes, 'fc_out')
+        graph.output(graph.node('Softmax', [x], 'output'), [classes])
+        graph.to_model
+      end
+
+      # A CNN: (3x3 Conv, Relu) x layers keeping the spatial size. The input
+      # is [batch, channels, size, size].
+      def cnn(channels:, filters:, layers:, size:, seed: 0)
+        graph = Graph.new('cnn', Random.new(seed))
+        x = graph.input('input', [channels, size, size])
+        width = channels
+        layers.times do |i|
+          x = graph.conv(x, width, filters, "conv#{i}")
+          x = graph.node('Relu', [x], i == layers - 1 ? 'output' : "relu#{i}")
+          width = filters
+        end
+        graph.output(x, [filters, size, size])
+        graph.to_model
+      end
+
+      class Graph
+        def initialize(name, random)
+          @name = name
+          @random = random
+          @nodes = []
+          @initializers = []
+          @inputs = []
+          @outputs = []
+        end
+
+        # The batch dimension is symbolic, Menoh takes it from the option.
+        def input(name, dims)
+          @inputs << value_info(name, dims)
+          name
+        end
+
+        def output(name, dims)
+          @outputs << value_info(name, dims)
+          name
+        end
+
+        def node(op_type, inputs, output, attributes = {})
+          body = ''.b
+          inputs.each { |i| body << Proto.string(1, i) }
+          body << Proto.string(2, output)
+          body << Proto.string(3, output)
+          body << Proto.string(4, op_type)
+          attributes.each { |name, (type, value)| body << Proto.message(5, attribute(name, type, value)) }
+          @nodes << body
+          output
+        end
+
+        # Fully connected layer with weights laid out [out, in] as exported
+        # by Chainer and PyTorch.
+        def gemm(x, inputs, outputs, name)
+          w = weight("#{name}_W", [outputs, inputs], inputs)
+          b = weight("#{name}_b", [outputs], inputs)
+          node('Gemm', [x, w, b], name, transB: [:int, 1])
+        end
+
+        def conv(x, inputs, outputs, name)
+          w = weight("#{name}_W", [outputs, inputs, 3, 3], inputs * 9)
+          b = weight("#{name}_b", [outputs], inputs * 9)
+          node('Conv', [x, w, b], name,
+               kernel_shape: [:ints, [3, 3]], pads: [:ints, [1, 1, 1, 1]], strides: [:ints, [1, 1]])
+        end
+
+        def to_model
+          graph = ''.b
+          graph << @nodes.map { |n| Proto.message(1, n) }.join
+          graph << Proto.string(2, @name)
+          graph << @initializers.map { |t| Proto.message(5, t) }.join
+          graph << @inputs.map { |v| Proto.message(11, v) }.join
+          graph << @outputs.map { |v| Proto.message(12, v) }.join
+
+          opset = Proto.string(1, '') + Proto.varint_field(2, OPSET_VERSION)
+          model = Proto.varint_field(1, IR_VERSION)
+          model << Proto.string(2, 'menoh-ruby-bench')
+          model << Proto.message(7, graph)
+          model << Proto.message(8, opset)
+          model
+        end
+
+        private
+
+        # He-initialized weights, deterministic for a seed
+        def weight(name, dims, fan_in)
+          scale = Math.sqrt(2.0 / fan_in)
+          values = Array.new(dims.inject(:*)) { (@random.rand * 2 - 1) * scale }
+          tensor = ''.b
+          dims.each { |d| tensor << Proto.varint_field(1, d) }
+          tensor << Proto.varint_field(2, FLOAT)
+          tensor << Proto.string(8, name)
+          tensor << Proto.string(9, values.pack('e*'))
+          @initializers << tensor
+          # IR version 3 lists initializers among the graph inputs
+          @inputs << value_info(name, dims, batch: false)
+          name
+        end
+
+        def value_info(name, dims, batch: true)
+          dim = batch ? Proto.message(1, Proto.string(2, 'batch')) : ''.b
+          dims.each { |d| dim << Proto.message(1, Proto.varint_field(1, d)) }
+          tensor_type = Proto.varint_field(1, FLOAT) + Proto.message(2, dim)
+          Proto.string(1, name) + Proto.message(2, Proto.message(1, tensor_type))
+        end
+
+        def attribute(name, type, value)
+          body = Proto.string(1, name.to_s)
+          case type
+          when :int then body << Proto.varint_field(3, value)
+          when :ints then value.each { |v| body << Proto.varint_field(8, v) }
+          end
+          body << Proto.varint_field(20, ATTRIBUTE_TYPES.fetch(type))
+        end
+      end
+
+      # Protocol Buffers wire format
+      module Proto
+        module_function
+
+        def varint(n)
+          n &= 0xffff_ffff_ffff_ffff # negative int64 as two's complement
+          bytes = []
+          loop do
+            byte = n & 0x7f
+            n >>= 7
+            return (bytes << byte).pack('C*') if n.zero?
+
+            bytes << (byte | 0x80)
+          end
+        end
+
+        def tag(field, wire_type)
+          varint(field << 3 | wire_type)
+        end
+
+        def varint_field(field, n)
+          tag(field, 0) + varint(n)
+        end
+
+        def string(field, bytes)
+          bytes = bytes.b
+          tag(field, 2) + varint(bytes.bytesize) + bytes
+        end
+        alias message string
+        module_function :message
+      end
+    end
+  end
+end
@@ -78,20 +78,17 @@ image_set = [
 ]
 
 # execute inference
-inference_results = model.run image_set
+inference_results = model.run image_set, tensors: true
 
 # load category definition
 categories = File.read('./data/synset_words.txt').split("\n")
 TOP_K = 5
 layer_result = inference_results.find { |x| x[:name] == SOFTMAX_OUT_NAME }
-layer_result[:data].zip(image_list).each do |image_result, image_filepath|
+layer_result[:data].topk(TOP_K).zip(image_list).each do |top_k, image_filepath|
   puts "=== Result for #{image_filepath} ==="
 
-  # sort by score
-  sorted_result = image_result.zip(categories).sort_by { |x| -x[0] }
-
   # display result
-  sorted_result[0, TOP_K].each do |score, category|
-    puts "#{category} : #{score}"
+  top_k.each do |index, score|
+    puts "#{categories[index]} : #{score}"
   end
 end
@@ -0,0 +1,339 @@
+#include "menoh_ruby.h"
+#include <ruby/thread.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+// Menoh::AdmissionQueue bounds the number of inferences running at once and
+// the number waiting for their turn. Each request may carry a deadline on
+// the CLOCK_MONOTONIC clock of Process.clock_gettime. A request is shed with
+// Menoh::DeadlineExceeded before anything is copied into the model when
+//   - its deadline has already passed (expired),
+//   - the queue is full (full), or
+//   - the average service time says it cannot start before its deadline
+//     (late).
+// A request whose deadline passes while it waits leaves the queue and is
+// counted as expired. Waiting releases the GVL, and slots are handed to the
+// waiters in arrival order.
+
+// A waiter lives on the stack of the waiting thread until it leaves the queue.
+typedef struct admission_waiter {
+  struct admission_waiter *next;
+  struct admission_waiter *prev;
+  uint64_t deadline_ns; // 0 without a deadline
+  pthread_cond_t cond;
+  bool granted;  // a slot was handed over
+  bool expired;  // shed by release_slot, already off the queue
+  bool timed_out;
+  bool interrupted;
+} admission_waiter;
+
+typedef struct admission {
+  pthread_mutex_t lock;
+  bool initialized;
+  int concurrency;
+  long capacity; // negative when unbounded
+  int running;
+  long depth;
+  admission_waiter *head, *tail;
+  uint64_t service_ns; // moving average of the time a slot is held
+  uint64_t admitted;
+  uint64_t max_depth;
+  uint64_t expired;
+  uint64_t late;
+  uint64_t full;
+} admission;
+
+static VALUE eDeadlineExceeded;
+static ID id_concurrency, id_capacity, id_running, id_depth, id_max_depth,
+  id_admitted, id_shed, id_expired, id_late, id_full, id_service_time;
+
+static void wrap_admission_free(admission *p) {
+  if (p->initialized) pthread_mutex_destroy(&p->lock);
+  ruby_xfree(p);
+}
+
+static const rb_data_type_t admission_data_type = {
+  "Menoh::AdmissionQueue",
+  {NULL, (void(*)(void*))wrap_admission_free, NULL,},
+  0, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static admission *getAdmission(VALUE self) {
+  admission *p;
+  TypedData_Get_Struct(self, admission, &admission_data_type, p);
+  if (!p->initialized) rb_raise(rb_eRuntimeError, "uninitialized admission queue");
+  return p;
+}
+
+static VALUE wrap_admission_alloc(VALUE klass) {
+  admission *p = ruby_xmalloc(sizeof(admission));
+  memset(p, 0, sizeof(admission));
+  return TypedData_Wrap_Struct(klass, &admission_data_type, p);
+}
+
+static VALUE wrap_admission_init(VALUE self, VALUE vconcurrency, VALUE vcapacity) {
+  admission *p;
+  TypedData_Get_Struct(self, admission, &admission_data_type, p);
+  if (p->initialized) rb_raise(rb_eRuntimeError, "already initialized");
+
+  int concurrency = NUM2INT(vconcurrency);
+  if (concurrency <= 0) rb_raise(rb_eArgError, "non-positive concurrency: %d", concurrency);
+  long capacity = NIL_P(vcapacity) ? -1 : NUM2LONG(vcapacity);
+  if (!NIL_P(vcapacity) && capacity < 0)
+    rb_raise(rb_eArgError, "negative capacity: %ld", capacity);
+
+  p->concurrency = concurrency;
+  p->capacity = capacity;
+  pthread_mutex_init(&p->lock, NULL);
+  p->initialized = true;
+  return Qnil;
+}
+
+// Called with the lock held.
+static void unlink_waiter(admission *p, admission_waiter *w) {
+  if (w->prev) w->prev->next = w->next; else p->head = w->next;
+  if (w->next) w->next->prev = w->prev; else p->tail = w->prev;
+  w->next = w->prev = NULL;
+  p->depth--;
+}
+
+// Frees a slot and hands it to the oldest waiter that can still make its
+// deadline. Called with the lock held.
+static void release_slot(admission *p) {
+  p->running--;
+  uint64_t now = stats_now();
+  while (p->head != NULL && p->running < p->concurrency) {
+    admission_waiter *w = p->head;
+    unlink_waiter(p, w);
+    if (w->deadline_ns != 0 && now >= w->deadline_ns) {
+      w->expired = true;
+      p->expired++;
+    } else {
+      w->granted = true;
+      p->running++;
+      p->admitted++;
+    }
+    pthread_cond_signal(&w->cond);
+  }
+}
+
+struct admission_wait_arg {
+  admission *admission;
+  admission_waiter *waiter;
+};
+
+static void *wait_for_slot(void *arg) {
+  struct admission_wait_arg *arg2 = (struct admission_wait_arg *)arg;
+  admission *p = arg2->admission;
+  admission_waiter *w = arg2->waiter;
+
+  pthread_mutex_lock(&p->lock);
+  while (!w->granted && !w->expired && !w->interrupted) {
+    if (w->deadline_ns == 0) {
+      pthread_cond_wait(&w->cond, &p->lock);
+      continue;
+    }
+    uint64_t now = stats_now();
+    if (now >= w->deadline_ns) {
+      w->timed_out = true;
+      break;
+    }
+    struct timespec deadline = cond_deadline(w->deadline_ns);
+    pthread_cond_timedwait(&w->cond, &p->lock, &deadline);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+static void wake_waiter(void *arg) {
+  struct admission_wait_arg *arg2 = (struct admission_wait_arg *)arg;
+  pthread_mutex_lock(&arg2->admission->lock);
+  arg2->waiter->interrupted = true;
+  pthread_cond_signal(&arg2->waiter->cond);
+  pthread_mutex_unlock(&arg2->admission->lock);
+}
+
+static VALUE check_ints(VALUE arg) {
+  rb_thread_check_ints();
+  return Qnil;
+}
+
+// Waits in the queue until a slot is handed over and destroys the waiter.
+// Returns false when the request is shed, and jumps out when the thread is
+// interrupted.
+static bool wait_in_queue(admission *p, admission_waiter *w) {
+  struct admission_wait_arg arg = { .admission = p, .waiter = w };
+  for (;;) {
+    // the gvl2 variant leaves pending interrupts to check_ints below
+    rb_thread_call_without_gvl2(wait_for_slot, &arg, wake_waiter, &arg);
+
+    pthread_mutex_lock(&p->lock);
+    if (w->granted || w->expired) {
+      pthread_mutex_unlock(&p->lock);
+      pthread_cond_destroy(&w->cond);
+      return w->granted;
+    }
+    if (w->timed_out) {
+      unlink_waiter(p, w);
+      p->expired++;
+      pthread_mutex_unlock(&p->lock);
+      pthread_cond_destroy(&w->cond);
+      return false;
+    }
+    w->interrupted = false;
+    pthread_mutex_unlock(&p->lock);
+
+    // Thread#raise, Thread#kill and signal handlers run here
+    int state;
+    rb_protect(check_ints, Qnil, &state);
+    if (state) {
+      pthread_mutex_lock(&p->lock);
+      if (w->granted)
+        release_slot(p);
+      else if (!w->expired)
+        unlink_waiter(p, w);
+      pthread_mutex_unlock(&p->lock);
+      pthread_cond_destroy(&w->cond);
+      rb_jump_tag(state);
+    }
+  }
+}
+
+struct admission_enter_arg {
+  admission *admission;
+  uint64_t started;
+};
+
+static VALUE admission_leave(VALUE arg) {
+  struct admission_enter_arg *arg2 = (struct admission_enter_arg *)arg;
+  admission *p = arg2->admission;
+  uint64_t held_ns = stats_now() - arg2->started;
+  pthread_mutex_lock(&p->lock);
+  // exponential moving average with a weight of 1/8
+  p->service_ns = p->service_ns == 0 ? held_ns : p->service_ns - p->service_ns / 8 + held_ns / 8;
+  release_slot(p);
+  pthread_mutex_unlock(&p->lock);
+  return Qnil;
+}
+
+// Runs the block once the request is admitted and returns its value.
+// `deadline` is a Float of Process.clock_gettime(Process::CLOCK_MONOTONIC)
+// or nil to wait for as long as it takes.
+static VALUE wrap_admission_enter(int argc, VALUE *argv, VALUE self) {
+  admission *p = getAdmission(self);
+  VALUE vdeadline;
+  rb_scan_args(argc, argv, "01", &vdeadline);
+  rb_need_block();
+
+  uint64_t deadline_ns = 0;
+  if (!NIL_P(vdeadline)) {
+    double deadline = NUM2DBL(vdeadline);
+    // 1 keeps deadlines in the past apart from "no deadline"
+    deadline_ns = deadline * 1e9 < 1.0 ? 1 : (uint64_t)(deadline * 1e9);
+  }
+
+  uint64_t now = stats_now();
+  const char *shed = NULL;
+  bool queued = false;
+  admission_waiter w;
+  memset(&w, 0, sizeof(w));
+  w.deadline_ns = deadline_ns;
+
+  pthread_mutex_lock(&p->lock);
+  if (deadline_ns != 0 && now >= deadline_ns) {
+    p->expired++;
+    shed = "the deadline has already passed";
+  } else if (p->head == NULL && p->running < p->concurrency) {
+    p->running++;
+    p->admitted++;
+  } else if (p->capacity >= 0 && p->depth >= p->capacity) {
+    p->full++;
+    shed = "the admission queue is full";
+  } else if (deadline_ns != 0 &&
+             now + p->service_ns * (uint64_t)(p->depth + 1) / (uint64_t)p->concurrency > deadline_ns) {
+    // every waiter ahead and this one take a slot for the average time
+    p->late++;
+    shed = "the request cannot start before its deadline";
+  } else {
+    cond_init_monotonic(&w.cond);
+    w.prev = p->tail;
+    if (p->tail) p->tail->next = &w; else p->head = &w;
+    p->tail = &w;
+    p->depth++;
+    if ((uint64_t)p->depth > p->max_depth) p->max_depth = p->depth;
+    queued = true;
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  if (queued && !wait_in_queue(p, &w))
+    shed = "the deadline passed in the admission queue";
+  if (shed != NULL) rb_raise(eDeadlineExceeded, "%s", shed);
+
+  struct admission_enter_arg arg = { .admission = p, .started = stats_now() };
+  return rb_ensure(rb_yield, Qnil, admission_leave, (VALUE)&arg);
+}
+
+static VALUE wrap_admission_stats(VALUE self) {
+  admission *p = getAdmission(self);
+  pthread_mutex_lock(&p->lock);
+  admission snapshot = *p;
+  pthread_mutex_unlock(&p->lock);
+
+  VALUE vshed = rb_hash_new();
+  rb_hash_aset(vshed, ID2SYM(id_expired), ULL2NUM(snapshot.expired));
+  rb_hash_aset(vshed, ID2SYM(id_late), ULL2NUM(snapshot.late));
+  rb_hash_aset(vshed, ID2SYM(id_full), ULL2NUM(snapshot.full));
+
+  VALUE vhash = rb_hash_new();
+  rb_hash_aset(vhash, ID2SYM(id_concurrency), INT2NUM(snapshot.concurrency));
+  rb_hash_aset(vhash, ID2SYM(id_capacity), snapshot.capacity < 0 ? Qnil : LONG2NUM(snapshot.capacity));
+  rb_hash_aset(vhash, ID2SYM(id_running), INT2NUM(snapshot.running));
+  rb_hash_aset(vhash, ID2SYM(id_depth), LONG2NUM(snapshot.depth));
+  rb_hash_aset(vhash, ID2SYM(id_max_depth), ULL2NUM(snapshot.max_depth));
+  rb_hash_aset(vhash, ID2SYM(id_admitted), ULL2NUM(snapshot.admitted));
+  rb_hash_aset(vhash, ID2SYM(id_shed), vshed);
+  rb_hash_aset(vhash, ID2SYM(id_service_time), DBL2NUM(snapshot.service_ns / 1e9));
+  return vhash;
+}
+
+static VALUE wrap_admission_depth(VALUE self) {
+  admission *p = getAdmission(self);
+  pthread_mutex_lock(&p->lock);
+  long depth = p->depth;
+  pthread_mutex_unlock(&p->lock);
+  return LONG2NUM(depth);
+}
+
+static VALUE wrap_admission_concurrency(VALUE self) {
+  return INT2NUM(getAdmission(self)->concurrency);
+}
+
+static VALUE wrap_admission_capacity(VALUE self) {
+  admission *p = getAdmission(self);
+  return p->capacity < 0 ? Qnil : LONG2NUM(p->capacity);
+}
+
+void Init_menoh_admission(VALUE mMenoh) {
+  id_concurrency = rb_intern("concurrency");
+  id_capacity = rb_intern("capacity");
+  id_running = rb_intern("running");
+  id_depth = rb_intern("depth");
+  id_max_depth = rb_intern("max_depth");
+  id_admitted = rb_intern("admitted");
+  id_shed = rb_intern("shed");
+  id_expired = rb_intern("expired");
+  id_late = rb_intern("late");
+  id_full = rb_intern("full");
+  id_service_time = rb_intern("service_time");
+
+  eDeadlineExceeded = rb_define_class_under(mMenoh, "DeadlineExceeded", eError);
+
+  VALUE queue = rb_define_class_under(mMenoh, "AdmissionQueue", rb_cObject);
+  rb_define_alloc_func(queue, wrap_admission_alloc);
+  rb_define_private_method(queue, "native_init", RUBY_METHOD_FUNC(wrap_admission_init), 2);
+  rb_define_method(queue, "enter", RUBY_METHOD_FUNC(wrap_admission_enter), -1);
+  rb_define_method(queue, "stats", RUBY_METHOD_FUNC(wrap_admission_stats), 0);
+  rb_define_method(queue, "depth", RUBY_METHOD_FUNC(wrap_admission_depth), 0);
+  rb_define_method(queue, "concurrency", RUBY_METHOD_FUNC(wrap_admission_concurrency), 0);
+  rb_define_method(queue, "capacity", RUBY_METHOD_FUNC(wrap_admission_capacity), 0);
+}
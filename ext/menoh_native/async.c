@@ -0,0 +1,489 @@
+#include "menoh_ruby.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Native worker pool behind MenohModel#run_async. Workers never touch Ruby
+// objects: a job runs the model, copies the outputs into Strings allocated
+// at submission and writes one byte to a pipe. Menoh::Future waits on the
+// other end of that pipe, which works with threads and Fiber.scheduler alike.
+// Menoh::AsyncJob is the native half of a Menoh::Future.
+//
+// A job may carry staged inputs, which the worker copies into the variable
+// buffers right before the run. Jobs of one model run one at a time in
+// submission order, so staged jobs can be queued while the model is busy.
+
+typedef struct async_copy {
+  void *dst;
+  const void *src;
+  size_t size;
+} async_copy;
+
+typedef struct async_job {
+  struct async_job *next;
+  menohModel *owner;
+  async_copy *inputs;  // staged inputs, input_num is 0 without them
+  int32_t input_num;
+  async_copy *outputs;
+  int32_t output_num;
+  int notify_fd;
+  bool done;
+  int refcount; // the queue (until done) and the AsyncJob
+  menoh_error_code err;
+  char err_msg[256];
+  uint64_t stage_ns[3]; // input, run and output of a successful run
+  size_t stage_bytes[3];
+} async_job;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static async_job *queue_head, *queue_tail;
+static async_job *running_jobs;
+static int worker_num;  // 0 means the number of online processors
+static int started_worker_num;
+
+// AsyncJob objects of unfinished jobs are kept reachable here, so that the Strings
+// the workers write into stay alive. Each Ractor has its own registry.
+#ifdef HAVE_RUBY_RACTOR_H
+static rb_ractor_local_key_t pending_jobs_key;
+
+static VALUE get_pending_jobs(void) {
+  VALUE jobs;
+  if (!rb_ractor_local_storage_value_lookup(pending_jobs_key, &jobs)) {
+    jobs = rb_ary_new();
+    rb_ractor_local_storage_value_set(pending_jobs_key, jobs);
+  }
+  return jobs;
+}
+#else
+static VALUE pending_jobs;
+
+static VALUE get_pending_jobs(void) {
+  return pending_jobs;
+}
+#endif
+
+static void release_job(async_job *job) {
+  if (--job->refcount > 0) return;
+  free(job->inputs);
+  free(job->outputs);
+  free(job);
+}
+
+static void finish_job(async_job *job) {
+  char c = 0;
+  job->done = true;
+  job->owner->async_pending--;
+  if (write(job->notify_fd, &c, 1) < 0) {
+    // the reader only needs readability; nothing else can be done here
+  }
+  release_job(job);
+}
+
+// Takes the oldest queued job whose model is idle and marks it running.
+// Called with pool_lock held.
+static async_job *take_job(void) {
+  async_job *prev = NULL;
+  for (async_job *job = queue_head; job != NULL; prev = job, job = job->next) {
+    if (job->owner->async_running) continue;
+    if (prev == NULL)
+      queue_head = job->next;
+    else
+      prev->next = job->next;
+    if (queue_tail == job) queue_tail = prev;
+    job->owner->async_running = 1;
+    job->next = running_jobs;
+    running_jobs = job;
+    return job;
+  }
+  return NULL;
+}
+
+// Called with pool_lock held.
+static void end_running_job(async_job *job) {
+  async_job **link = &running_jobs;
+  while (*link != job) link = &(*link)->next;
+  *link = job->next;
+  job->next = NULL;
+  job->owner->async_running = 0;
+}
+
+static void *async_worker(void *arg) {
+  pthread_mutex_lock(&pool_lock);
+  for (;;) {
+    async_job *job;
+    while ((job = take_job()) == NULL)
+      pthread_cond_wait(&pool_cond, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+
+    uint64_t t0 = stats_now();
+    for (int32_t i = 0; i < job->input_num; i++)
+      memcpy(job->inputs[i].dst, job->inputs[i].src, job->inputs[i].size);
+    uint64_t t1 = stats_now();
+    void *saved = placement_enter(job->owner->placement);
+    job->err = menoh_model_run(job->owner->model);
+    placement_leave(saved);
+    if (job->err == menoh_error_code_success) {
+      uint64_t t2 = stats_now();
+      for (int32_t i = 0; i < job->output_num; i++)
+        memcpy(job->outputs[i].dst, job->outputs[i].src, job->outputs[i].size);
+      job->stage_ns[0] = t1 - t0;
+      job->stage_ns[1] = t2 - t1;
+      job->stage_ns[2] = stats_now() - t2;
+      for (int32_t i = 0; i < job->input_num; i++) job->stage_bytes[0] += job->inputs[i].size;
+      for (int32_t i = 0; i < job->output_num; i++) job->stage_bytes[2] += job->outputs[i].size;
+      // staged inputs only; inputs set before run_async were counted then
+      if (job->input_num > 0)
+        stats_add(job->owner, stats_stage_input, job->stage_ns[0], job->stage_bytes[0]);
+      stats_add(job->owner, stats_stage_run, job->stage_ns[1], 0);
+      stats_add(job->owner, stats_stage_output, job->stage_ns[2], job->stage_bytes[2]);
+    } else {
+      snprintf(job->err_msg, sizeof(job->err_msg), "%s",
+               menoh_get_last_error_message());
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    end_running_job(job);
+    finish_job(job);
+    // the next job of the model may be waiting for it
+    pthread_cond_broadcast(&pool_cond);
+  }
+  return NULL;
+}
+
+static void atfork_prepare(void) {
+  pthread_mutex_lock(&pool_lock);
+}
+
+static void atfork_parent(void) {
+  pthread_mutex_unlock(&pool_lock);
+}
+
+static void fail_job(async_job *job, const char *msg) {
+  job->err = menoh_error_code_backend_error;
+  snprintf(job->err_msg, sizeof(job->err_msg), "%s", msg);
+  finish_job(job);
+}
+
+// Worker threads do not survive fork. Fail the unfinished jobs and let the
+// child start its own workers on demand.
+static void atfork_child(void) {
+  while (running_jobs != NULL) {
+    async_job *job = running_jobs;
+    end_running_job(job);
+    fail_job(job, "the process was forked while the job was running");
+  }
+  while (queue_head != NULL) {
+    async_job *job = queue_head;
+    queue_head = job->next;
+    job->next = NULL;
+    fail_job(job, "the process was forked before the job started");
+  }
+  queue_tail = NULL;
+  started_worker_num = 0;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+// called with pool_lock held
+static void start_workers(void) {
+  int num = worker_num;
+  if (num <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+    num = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (num <= 0) num = 4;
+  }
+  while (started_worker_num < num) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int ret = pthread_create(&thread, &attr, async_worker, NULL);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+      if (started_worker_num > 0) break;
+      pthread_mutex_unlock(&pool_lock);
+      rb_raise(eError, "failed to start async worker thread");
+    }
+    started_worker_num++;
+  }
+}
+
+typedef struct async_job_obj {
+  async_job *job;
+  VALUE vmodel;
+  VALUE voutputs;
+  VALUE vlocked; // staged input Strings, locked until the job is finished
+  bool externals_locked; // so are the external buffers of the model
+  bool notified; // the stats subscriber has seen the job
+} async_job_obj;
+
+static void wrap_async_job_free(async_job_obj *);
+static void wrap_async_job_mark(async_job_obj *);
+
+static const rb_data_type_t async_job_data_type = {
+  "Menoh::AsyncJob",
+  {(void(*)(void*))wrap_async_job_mark, (void(*)(void*))wrap_async_job_free, NULL,},
+  0, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static async_job_obj *getAsyncJob(VALUE self) {
+  async_job_obj *p;
+  TypedData_Get_Struct(self, async_job_obj, &async_job_data_type, p);
+  if (p->job == NULL) rb_raise(rb_eRuntimeError, "uninitialized job");
+  return p;
+}
+
+static void wrap_async_job_free(async_job_obj *p) {
+  if (p->job != NULL) {
+    pthread_mutex_lock(&pool_lock);
+    release_job(p->job);
+    pthread_mutex_unlock(&pool_lock);
+  }
+  ruby_xfree(p);
+}
+
+// Workers write into the output Strings and read the staged input Strings
+// without the GVL, so each of them is pinned with rb_gc_mark: compaction
+// must not move an embedded String away from the pointer the job holds.
+static void mark_pinned_elements(VALUE vary) {
+  if (NIL_P(vary)) return;
+  rb_gc_mark(vary);
+  for (long i = 0; i < RARRAY_LEN(vary); i++)
+    rb_gc_mark(RARRAY_AREF(vary, i));
+}
+
+static void wrap_async_job_mark(async_job_obj *p) {
+  rb_gc_mark(p->vmodel);
+  mark_pinned_elements(p->voutputs);
+  mark_pinned_elements(p->vlocked);
+}
+
+static VALUE cAsyncJob;
+
+static bool async_job_done_p(async_job_obj *p) {
+  pthread_mutex_lock(&pool_lock);
+  bool done = p->job->done;
+  pthread_mutex_unlock(&pool_lock);
+  return done;
+}
+
+// Hands the staged inputs and the external buffers of a finished job back
+// to Ruby.
+static void unlock_inputs(async_job_obj *p) {
+  if (p->externals_locked) {
+    unlock_external_buffers(p->job->owner);
+    p->externals_locked = false;
+  }
+  if (NIL_P(p->vlocked)) return;
+  for (long i = 0; i < RARRAY_LEN(p->vlocked); i++)
+    rb_str_unlocktmp(RARRAY_AREF(p->vlocked, i));
+  p->vlocked = Qnil;
+}
+
+// Drops finished jobs from the registry.
+static void sweep_pending_jobs(void) {
+  VALUE pending_jobs = get_pending_jobs();
+  long j = 0;
+  for (long i = 0; i < RARRAY_LEN(pending_jobs); i++) {
+    VALUE vjob = RARRAY_AREF(pending_jobs, i);
+    async_job_obj *p = getAsyncJob(vjob);
+    if (async_job_done_p(p))
+      unlock_inputs(p);
+    else
+      rb_ary_store(pending_jobs, j++, vjob);
+  }
+  rb_ary_resize(pending_jobs, j);
+}
+
+// Checks the staged inputs, one binary String per input variable.
+static void check_staged_inputs(menohModel *m, VALUE vinputs) {
+  Check_Type(vinputs, T_ARRAY);
+  if (RARRAY_LEN(vinputs) != m->input_layer_num)
+    rb_raise(rb_eArgError, "wrong number of staged inputs (expected %d, was %ld)",
+             (int)m->input_layer_num, RARRAY_LEN(vinputs));
+  for (int32_t i = 0; i < m->input_layer_num; i++) {
+    model_variable *var = &m->variables[i];
+    VALUE vdata = RARRAY_AREF(vinputs, i);
+    Check_Type(vdata, T_STRING);
+    if ((size_t)RSTRING_LEN(vdata) != var->size)
+      rb_raise(rb_eArgError, "wrong string length for '%s' (expected %zu, was %zu)",
+               RSTRING_PTR(var->vname), var->size, (size_t)RSTRING_LEN(vdata));
+  }
+}
+
+// Submits a run of the model. Without staged inputs the run reads the
+// current input buffers, and the caller must not touch the model until the
+// returned job is done. Staged input Strings are locked until then instead.
+static VALUE wrap_model_run_async(VALUE self, VALUE vnotify_fd, VALUE vinputs) {
+  menohModel *m = getModel(self);
+  int notify_fd = NUM2INT(vnotify_fd);
+  check_external_buffers(m);
+  if (!NIL_P(vinputs)) check_staged_inputs(m, vinputs);
+
+  int32_t input_num = NIL_P(vinputs) ? 0 : m->input_layer_num;
+  int32_t output_num = m->variable_num - m->input_layer_num;
+  VALUE vjob = TypedData_Wrap_Struct(cAsyncJob, &async_job_data_type, NULL);
+  async_job_obj *p = ruby_xmalloc(sizeof(async_job_obj));
+  p->job = NULL;
+  p->vmodel = self;
+  p->voutputs = rb_ary_new2(output_num);
+  p->vlocked = Qnil;
+  p->externals_locked = false;
+  p->notified = false;
+  RTYPEDDATA_DATA(vjob) = p;
+
+  async_job *job = calloc(1, sizeof(async_job));
+  if (job == NULL) rb_memerror();
+  job->inputs = calloc(input_num > 0 ? input_num : 1, sizeof(async_copy));
+  job->outputs = calloc(output_num > 0 ? output_num : 1, sizeof(async_copy));
+  if (job->inputs == NULL || job->outputs == NULL) {
+    free(job->inputs);
+    free(job->outputs);
+    free(job);
+    rb_memerror();
+  }
+  job->owner = m;
+  job->input_num = input_num;
+  job->output_num = output_num;
+  job->notify_fd = notify_fd;
+  job->refcount = 2;
+  job->err = menoh_error_code_success;
+  p->job = job;
+  for (int32_t i = 0; i < output_num; i++) {
+    model_variable *var = &m->variables[m->input_layer_num + i];
+    rb_ary_push(p->voutputs, rb_str_new(NULL, var->size));
+  }
+  if (input_num > 0) {
+    p->vlocked = rb_ary_new2(input_num);
+    for (int32_t i = 0; i < input_num; i++) {
+      VALUE vdata = RARRAY_AREF(vinputs, i);
+      // the same String may feed several inputs
+      if (ary_includes_object(p->vlocked, vdata) || external_string_p(m, vdata))
+        continue;
+      rb_str_locktmp(vdata);
+      rb_ary_push(p->vlocked, vdata);
+    }
+  }
+  // the worker reads and writes caller-attached Strings as well
+  lock_external_buffers(m);
+  p->externals_locked = true;
+
+  // the Strings are pinned through vjob from here on, so their pointers
+  // stay valid until the job is finished
+  for (int32_t i = 0; i < input_num; i++) {
+    job->inputs[i].dst = m->variables[i].buf;
+    job->inputs[i].src = RSTRING_PTR(RARRAY_AREF(vinputs, i));
+    job->inputs[i].size = m->variables[i].size;
+  }
+  for (int32_t i = 0; i < output_num; i++) {
+    model_variable *var = &m->variables[m->input_layer_num + i];
+    job->outputs[i].dst = RSTRING_PTR(RARRAY_AREF(p->voutputs, i));
+    job->outputs[i].src = var->buf;
+    job->outputs[i].size = var->size;
+  }
+
+  sweep_pending_jobs();
+  rb_ary_push(get_pending_jobs(), vjob);
+
+  pthread_mutex_lock(&pool_lock);
+  start_workers();
+  if (queue_tail == NULL)
+    queue_head = job;
+  else
+    queue_tail->next = job;
+  queue_tail = job;
+  m->async_pending++;
+  pthread_cond_signal(&pool_cond);
+  pthread_mutex_unlock(&pool_lock);
+
+  return vjob;
+}
+
+// Whether a run_async of the model is queued or running. The model must not
+// be run from Ruby meanwhile, since the worker uses the same buffers.
+bool async_pending_p(menohModel *m) {
+  pthread_mutex_lock(&pool_lock);
+  bool pending = m->async_pending > 0;
+  pthread_mutex_unlock(&pool_lock);
+  return pending;
+}
+
+static VALUE async_job_done(VALUE self) {
+  return async_job_done_p(getAsyncJob(self)) ? Qtrue : Qfalse;
+}
+
+// Output Strings of the finished run in the order of output_layers.
+static VALUE async_job_result(VALUE self) {
+  async_job_obj *p = getAsyncJob(self);
+  if (!async_job_done_p(p))
+    rb_raise(rb_eRuntimeError, "the job is not done yet");
+  if (p->job->err != menoh_error_code_success)
+    rb_raise(menoh_error_class(p->job->err), "%s", p->job->err_msg);
+  return p->voutputs;
+}
+
+// Unlocks the staged inputs once the job is done and reports the stages of
+// the run to the stats subscriber. Returns whether the job is done.
+static VALUE async_job_finish(VALUE self) {
+  async_job_obj *p = getAsyncJob(self);
+  if (!async_job_done_p(p)) return Qfalse;
+  unlock_inputs(p);
+  if (!p->notified && p->job->err == menoh_error_code_success) {
+    async_job *job = p->job;
+    p->notified = true;
+    if (job->input_num > 0)
+      stats_notify(p->vmodel, stats_stage_input, job->stage_ns[0], job->stage_bytes[0]);
+    stats_notify(p->vmodel, stats_stage_run, job->stage_ns[1], 0);
+    stats_notify(p->vmodel, stats_stage_output, job->stage_ns[2], job->stage_bytes[2]);
+  }
+  return Qtrue;
+}
+
+static VALUE async_job_model(VALUE self) {
+  return getAsyncJob(self)->vmodel;
+}
+
+static VALUE get_async_worker_threads(VALUE self) {
+  return INT2FIX(worker_num);
+}
+
+static VALUE set_async_worker_threads(VALUE self, VALUE vnum) {
+  int num = NUM2INT(vnum);
+  if (num < 0) rb_raise(rb_eArgError, "negative number of threads: %d", num);
+  pthread_mutex_lock(&pool_lock);
+  worker_num = num;
+  bool started = started_worker_num > 0;
+  pthread_mutex_unlock(&pool_lock);
+  if (started)
+    rb_warn("Menoh.async_worker_threads takes effect when more workers are needed");
+  return vnum;
+}
+
+void Init_menoh_async(VALUE mMenoh) {
+#ifdef HAVE_RUBY_RACTOR_H
+  pending_jobs_key = rb_ractor_local_storage_value_newkey();
+#else
+  pending_jobs = rb_ary_new();
+  rb_gc_register_mark_object(pending_jobs);
+#endif
+  pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+
+  cAsyncJob = rb_define_class_under(mMenoh, "AsyncJob", rb_cObject);
+  rb_undef_alloc_func(cAsyncJob);
+  rb_define_method(cAsyncJob, "done?", RUBY_METHOD_FUNC(async_job_done), 0);
+  rb_define_method(cAsyncJob, "finish", RUBY_METHOD_FUNC(async_job_finish), 0);
+  rb_define_method(cAsyncJob, "model", RUBY_METHOD_FUNC(async_job_model), 0);
+  rb_define_method(cAsyncJob, "result", RUBY_METHOD_FUNC(async_job_result), 0);
+
+  VALUE model = rb_const_get(mMenoh, rb_intern("MenohModel"));
+  rb_define_private_method(model, "native_run_async",
+                           RUBY_METHOD_FUNC(wrap_model_run_async), 2);
+
+  rb_define_module_function(mMenoh, "async_worker_threads",
+                            RUBY_METHOD_FUNC(get_async_worker_threads), 0);
+  rb_define_module_function(mMenoh, "async_worker_threads=",
+                            RUBY_METHOD_FUNC(set_async_worker_threads), 1);
+}
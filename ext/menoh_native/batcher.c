@@ -0,0 +1,330 @@
+#include "menoh_ruby.h"
+#include <ruby/thread.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+// Menoh::Batcher packs single-sample requests from many threads into the
+// batch dimension (dims[0]) of one model. A batch is run when it is full or
+// when its first request has waited for max_latency_us.
+
+// A request lives on the stack of the calling thread until it is done.
+typedef struct batch_request {
+  const void **inputs;  // one sample per input variable
+  void **outputs;       // one sample per output variable
+  bool queued;          // its inputs are in a slot of the batch
+  bool done;
+  bool interrupted;     // set by the unblocking function
+  menoh_error_code err;
+  char err_msg[256];
+} batch_request;
+
+typedef struct batcher {
+  VALUE vmodel;
+  menohModel *model;  // the model is used without the GVL
+  int32_t max_batch;
+  long max_latency_us;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool initialized;
+  bool running;
+  int32_t filled;
+  uint64_t deadline_ns;      // stats_now time to run the batch being filled
+  batch_request **requests;  // max_batch slots of the batch being filled
+} batcher;
+
+static void wrap_batcher_free(batcher *);
+static void wrap_batcher_mark(batcher *);
+
+static const rb_data_type_t batcher_data_type = {
+  "Menoh::Batcher",
+  {(void(*)(void*))wrap_batcher_mark, (void(*)(void*))wrap_batcher_free, NULL,},
+  0, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static batcher *getBatcher(VALUE self) {
+  batcher *p;
+  TypedData_Get_Struct(self, batcher, &batcher_data_type, p);
+  if (!p->initialized) rb_raise(rb_eRuntimeError, "uninitialized batcher");
+  return p;
+}
+
+static void wrap_batcher_free(batcher *p) {
+  if (p->initialized) {
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+  }
+  ruby_xfree(p->requests);
+  ruby_xfree(p);
+}
+
+static void wrap_batcher_mark(batcher *p) {
+  rb_gc_mark(p->vmodel);
+}
+
+static VALUE wrap_batcher_alloc(VALUE klass) {
+  batcher *p = ruby_xmalloc(sizeof(batcher));
+  memset(p, 0, sizeof(batcher));
+  p->vmodel = Qnil;
+  return TypedData_Wrap_Struct(klass, &batcher_data_type, p);
+}
+
+static VALUE wrap_batcher_init(VALUE self, VALUE vmodel, VALUE vmax_latency_us) {
+  batcher *p;
+  TypedData_Get_Struct(self, batcher, &batcher_data_type, p);
+  if (p->initialized) rb_raise(rb_eRuntimeError, "already initialized");
+
+  menohModel *m = getModel(vmodel);
+  if (m->variable_num == 0) rb_raise(rb_eArgError, "the model is not built");
+
+  // every input and output must be batched along dims[0]
+  int32_t max_batch = m->variables[0].dims[0];
+  for (int32_t i = 0; i < m->variable_num; i++) {
+    model_variable *var = &m->variables[i];
+    if (var->dims_length == 0 || var->dims[0] != max_batch)
+      rb_raise(rb_eArgError, "dims[0] of '%s' is not the batch size %d",
+               RSTRING_PTR(var->vname), (int)max_batch);
+  }
+
+  long max_latency_us = NUM2LONG(vmax_latency_us);
+  if (max_latency_us < 0)
+    rb_raise(rb_eArgError, "negative max_latency_us: %ld", max_latency_us);
+
+  p->vmodel = vmodel;
+  p->model = m;
+  p->max_batch = max_batch;
+  p->max_latency_us = max_latency_us;
+  p->requests = ruby_xcalloc(max_batch, sizeof(batch_request *));
+  pthread_mutex_init(&p->lock, NULL);
+  cond_init_monotonic(&p->cond);
+  p->initialized = true;
+
+  return Qnil;
+}
+
+// Runs the batch being filled. Called with the lock held; the lock is
+// released while the model runs, and `running` keeps new requests out of
+// the variable buffers meanwhile.
+static void flush_batch(batcher *p) {
+  menohModel *m = p->model;
+  int32_t input_num = m->input_layer_num;
+  int32_t output_num = m->variable_num - input_num;
+  int32_t filled = p->filled;
+
+  p->running = true;
+  pthread_mutex_unlock(&p->lock);
+  uint64_t started = stats_now();
+  void *saved = placement_enter(m->placement);
+  menoh_error_code err = menoh_model_run(m->model);
+  placement_leave(saved);
+  if (err == menoh_error_code_success)
+    stats_add(m, stats_stage_run, stats_now() - started, 0);
+  pthread_mutex_lock(&p->lock);
+
+  for (int32_t slot = 0; slot < filled; slot++) {
+    batch_request *req = p->requests[slot];
+    if (err == menoh_error_code_success) {
+      for (int32_t i = 0; i < output_num; i++) {
+        model_variable *var = &m->variables[input_num + i];
+        size_t sample_size = var->size / p->max_batch;
+        memcpy(req->outputs[i], (char *)var->buf + sample_size * slot, sample_size);
+      }
+    } else {
+      snprintf(req->err_msg, sizeof(req->err_msg), "%s",
+               menoh_get_last_error_message());
+    }
+    req->err = err;
+    req->done = true;
+    p->requests[slot] = NULL;
+  }
+  p->filled = 0;
+  p->running = false;
+  pthread_cond_broadcast(&p->cond);
+}
+
+struct batcher_run_arg {
+  batcher *batcher;
+  batch_request *req;
+  VALUE *vpinned;
+  VALUE vlocked;
+  long locked_num;
+};
+
+// Queues the request and waits until its batch is done. A request that is
+// interrupted before it is queued leaves right away. Once queued, its slot
+// cannot be taken back, so an interrupted request runs its batch now instead
+// of waiting for it to fill up, and leaves when the batch is done. Every
+// request of a batch waits until the deadline of the batch, so a request
+// that comes back after an interrupt keeps its latency bound.
+static void *batcher_run(void *arg) {
+  struct batcher_run_arg *arg2 = (struct batcher_run_arg *)arg;
+  batcher *p = arg2->batcher;
+  batch_request *req = arg2->req;
+  menohModel *m = p->model;
+
+  pthread_mutex_lock(&p->lock);
+
+  if (!req->queued) {
+    // wait for a free slot
+    while ((p->running || p->filled == p->max_batch) && !req->interrupted)
+      pthread_cond_wait(&p->cond, &p->lock);
+    if (req->interrupted) {
+      pthread_mutex_unlock(&p->lock);
+      return NULL;
+    }
+
+    int32_t slot = p->filled++;
+    p->requests[slot] = req;
+    req->queued = true;
+    for (int32_t i = 0; i < m->input_layer_num; i++) {
+      model_variable *var = &m->variables[i];
+      size_t sample_size = var->size / p->max_batch;
+      memcpy((char *)var->buf + sample_size * slot, req->inputs[i], sample_size);
+    }
+
+    // the first request of a batch bounds its latency
+    if (slot == 0) p->deadline_ns = stats_now() + (uint64_t)p->max_latency_us * 1000;
+    if (p->filled == p->max_batch) flush_batch(p);
+  }
+
+  struct timespec deadline = cond_deadline(p->deadline_ns);
+  while (!req->done) {
+    // the batch of a queued request is the one filling or running
+    if (p->running) {
+      pthread_cond_wait(&p->cond, &p->lock);
+    } else if (req->interrupted ||
+               pthread_cond_timedwait(&p->cond, &p->lock, &deadline) == ETIMEDOUT) {
+      if (!req->done && !p->running) flush_batch(p);
+    }
+  }
+
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+static void wake_request(void *arg) {
+  struct batcher_run_arg *arg2 = (struct batcher_run_arg *)arg;
+  pthread_mutex_lock(&arg2->batcher->lock);
+  arg2->req->interrupted = true;
+  pthread_cond_broadcast(&arg2->batcher->cond);
+  pthread_mutex_unlock(&arg2->batcher->lock);
+}
+
+static VALUE batcher_run_body(VALUE arg) {
+  struct batcher_run_arg *arg2 = (struct batcher_run_arg *)arg;
+  for (long i = 0; i < RARRAY_LEN(arg2->vlocked); i++) {
+    rb_str_locktmp(RARRAY_AREF(arg2->vlocked, i));
+    arg2->locked_num = i + 1;
+  }
+  // Thread#raise, Thread#kill and Timeout jump out of the call once
+  // batcher_run has returned; interrupts that do not raise, such as signal
+  // handlers, come back here
+  while (!arg2->req->done) {
+    rb_thread_call_without_gvl(batcher_run, arg2, wake_request, arg2);
+    arg2->req->interrupted = false;
+  }
+  return Qnil;
+}
+
+static VALUE batcher_run_unlock(VALUE arg) {
+  struct batcher_run_arg *arg2 = (struct batcher_run_arg *)arg;
+  for (long i = 0; i < arg2->locked_num; i++)
+    rb_str_unlocktmp(RARRAY_AREF(arg2->vlocked, i));
+  unlock_external_buffers(arg2->batcher->model);
+  return Qnil;
+}
+
+// Takes a Hash of input names to one binary sample each and returns a frozen
+// Hash of output names to the binary sample computed for it.
+static VALUE wrap_batcher_run(VALUE self, VALUE vinputs) {
+  batcher *p = getBatcher(self);
+  menohModel *m = p->model;
+  int32_t input_num = m->input_layer_num;
+  int32_t output_num = m->variable_num - input_num;
+  Check_Type(vinputs, T_HASH);
+  check_external_buffers(m);
+
+  const void **inputs = ALLOCA_N(const void *, input_num);
+  void **outputs = ALLOCA_N(void *, output_num);
+  // Strings held in this stack array are pinned by the conservative stack
+  // scan, so compaction cannot move them while their pointers are in use
+  VALUE *vpinned = ALLOCA_N(VALUE, input_num + output_num);
+  VALUE vlocked = rb_ary_new2(input_num);
+
+  if (RHASH_SIZE(vinputs) != (size_t)input_num)
+    rb_raise(rb_eArgError, "wrong number of inputs (expected %d, was %d)",
+             (int)input_num, (int)RHASH_SIZE(vinputs));
+  for (int32_t i = 0; i < input_num; i++) {
+    model_variable *var = &m->variables[i];
+    VALUE vdata = rb_hash_lookup2(vinputs, var->vname, Qundef);
+    if (vdata == Qundef)
+      rb_raise(rb_eArgError, "missing input: %s", RSTRING_PTR(var->vname));
+    StringValue(vdata);
+    size_t sample_size = var->size / p->max_batch;
+    if ((size_t)RSTRING_LEN(vdata) != sample_size)
+      rb_raise(rb_eArgError, "wrong string length for '%s' (expected %zu, was %zu)",
+               RSTRING_PTR(var->vname), sample_size, (size_t)RSTRING_LEN(vdata));
+    vpinned[i] = vdata;
+    inputs[i] = RSTRING_PTR(vdata);
+    if (!ary_includes_object(vlocked, vdata))
+      rb_ary_push(vlocked, vdata);
+  }
+
+  VALUE vresults = rb_hash_new();
+  for (int32_t i = 0; i < output_num; i++) {
+    model_variable *var = &m->variables[input_num + i];
+    VALUE vresult = rb_str_new(NULL, var->size / p->max_batch);
+    vpinned[input_num + i] = vresult;
+    rb_hash_aset(vresults, var->vname, vresult);
+    outputs[i] = RSTRING_PTR(vresult);
+  }
+
+  batch_request req = {
+    .inputs = inputs,
+    .outputs = outputs,
+    .queued = false,
+    .done = false,
+    .interrupted = false,
+    .err = menoh_error_code_success,
+  };
+  struct batcher_run_arg batcher_run_arg = {
+    .batcher = p,
+    .req = &req,
+    .vpinned = vpinned,
+    .vlocked = vlocked,
+    .locked_num = 0,
+  };
+  // a batch may run from the thread of any of its requests
+  lock_external_buffers(m);
+  rb_ensure(batcher_run_body, (VALUE)&batcher_run_arg,
+            batcher_run_unlock, (VALUE)&batcher_run_arg);
+
+  if (req.err != menoh_error_code_success)
+    rb_raise(menoh_error_class(req.err), "%s", req.err_msg);
+
+  return rb_obj_freeze(vresults);
+}
+
+static VALUE batcher_max_batch(VALUE self) {
+  return INT2FIX(getBatcher(self)->max_batch);
+}
+
+static VALUE batcher_max_latency_us(VALUE self) {
+  return LONG2NUM(getBatcher(self)->max_latency_us);
+}
+
+static VALUE batcher_model(VALUE self) {
+  return getBatcher(self)->vmodel;
+}
+
+void Init_menoh_batcher(VALUE mMenoh) {
+  VALUE batcher = rb_define_class_under(mMenoh, "Batcher", rb_cObject);
+
+  rb_define_alloc_func(batcher, wrap_batcher_alloc);
+  rb_define_private_method(batcher, "native_init",
+                           RUBY_METHOD_FUNC(wrap_batcher_init), 2);
+  rb_define_method(batcher, "run", RUBY_METHOD_FUNC(wrap_batcher_run), 1);
+  rb_define_method(batcher, "max_batch", RUBY_METHOD_FUNC(batcher_max_batch), 0);
+  rb_define_method(batcher, "max_latency_us", RUBY_METHOD_FUNC(batcher_max_latency_us), 0);
+  rb_define_method(batcher, "model", RUBY_METHOD_FUNC(batcher_model), 0);
+}
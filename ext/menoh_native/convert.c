@@ -0,0 +1,249 @@
+#include "menoh_ruby.h"
+#include <stdbool.h>
+#include <string.h>
+
+// Element conversion between variable buffers and foreign buffers. Each
+// (dst, src) pair expands into its own loop so that the compiler can
+// vectorize it. float16 goes through float32 in blocks, using F16C on x86
+// CPUs that have it.
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define USE_F16C 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+size_t elem_size(elem_type type) {
+  switch (type) {
+  case elem_type_uint8:   return sizeof(uint8_t);
+  case elem_type_int8:    return sizeof(int8_t);
+  case elem_type_int16:   return sizeof(int16_t);
+  case elem_type_int32:   return sizeof(int32_t);
+  case elem_type_int64:   return sizeof(int64_t);
+  case elem_type_float16: return sizeof(uint16_t);
+  case elem_type_float32: return sizeof(float);
+  case elem_type_float64: return sizeof(double);
+  default:                return 0;
+  }
+}
+
+float half_to_float(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t bits;
+
+  if (exp == 0x1f) {
+    bits = sign | 0x7f800000 | (mant << 13);  // inf or nan
+  } else if (exp != 0) {
+    bits = sign | ((exp + 112) << 23) | (mant << 13);
+  } else if (mant == 0) {
+    bits = sign;
+  } else {
+    // subnormal half is a normal float
+    exp = 113;
+    while (!(mant & 0x400)) {
+      mant <<= 1;
+      exp--;
+    }
+    bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+  }
+
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// rounds to nearest even like F16C
+uint16_t float_to_half(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000;
+  uint32_t exp = (x >> 23) & 0xff;
+  uint32_t mant = x & 0x7fffff;
+
+  if (exp == 0xff)
+    return (uint16_t)(sign | 0x7c00 | (mant ? 0x200 | (mant >> 13) : 0));
+
+  int32_t e = (int32_t)exp - 127 + 15;
+  if (e >= 0x1f) return (uint16_t)(sign | 0x7c00);
+
+  uint32_t half, rem, mid;
+  if (e <= 0) {
+    if (e < -10) return (uint16_t)sign;
+    mant |= 0x800000;
+    uint32_t shift = (uint32_t)(14 - e);
+    half = mant >> shift;
+    rem = mant & ((1u << shift) - 1);
+    mid = 1u << (shift - 1);
+  } else {
+    half = ((uint32_t)e << 10) | (mant >> 13);
+    rem = mant & 0x1fff;
+    mid = 0x1000;
+  }
+  // a carry into the exponent is still the right result
+  if (rem > mid || (rem == mid && (half & 1))) half++;
+  return (uint16_t)(sign | half);
+}
+
+#ifdef USE_F16C
+static bool f16c_available(void) {
+  static int available = -1;
+  if (available < 0) {
+    unsigned int eax, ebx, ecx, edx;
+    // F16C needs AVX state enabled by the OS
+    available = __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+                (ecx & bit_F16C) && (ecx & bit_AVX) && (ecx & bit_OSXSAVE);
+  }
+  return available;
+}
+
+__attribute__((target("avx,f16c")))
+static void halves_to_floats_f16c(float *d, const uint16_t *s, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(d + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(s + i))));
+  for (; i < n; i++) d[i] = half_to_float(s[i]);
+}
+
+__attribute__((target("avx,f16c")))
+static void floats_to_halves_f16c(uint16_t *d, const float *s, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm_storeu_si128((__m128i *)(d + i),
+                     _mm256_cvtps_ph(_mm256_loadu_ps(s + i), _MM_FROUND_TO_NEAREST_INT));
+  for (; i < n; i++) d[i] = float_to_half(s[i]);
+}
+#endif
+
+static void halves_to_floats(float *d, const uint16_t *s, size_t n) {
+#ifdef USE_F16C
+  if (f16c_available()) {
+    halves_to_floats_f16c(d, s, n);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < n; i++) d[i] = half_to_float(s[i]);
+}
+
+static void floats_to_halves(uint16_t *d, const float *s, size_t n) {
+#ifdef USE_F16C
+  if (f16c_available()) {
+    floats_to_halves_f16c(d, s, n);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < n; i++) d[i] = float_to_half(s[i]);
+}
+
+#define CONVERT_LOOP(dst_t, src_t) do {                 \
+    dst_t *restrict d = (dst_t *)dst;                   \
+    const src_t *restrict s = (const src_t *)src;       \
+    for (size_t i = 0; i < n; i++) d[i] = (dst_t)s[i];  \
+  } while (0)
+
+// Conversions to integer types saturate: values are clamped to the
+// destination range first and NaN becomes 0. Float to integer casts are
+// undefined out of range, and narrowing integer casts would wrap.
+#define CLAMP_LOOP(dst_t, src_t, lo, hi) do {                   \
+    dst_t *restrict d = (dst_t *)dst;                           \
+    const src_t *restrict s = (const src_t *)src;               \
+    for (size_t i = 0; i < n; i++) {                            \
+      src_t v = s[i];                                           \
+      d[i] = v != v ? 0 : v <= (src_t)(lo) ? (lo) :             \
+             v >= (src_t)(hi) ? (hi) : (dst_t)v;                \
+    }                                                           \
+  } while (0)
+
+// Every integer source and destination range fits in int64_t, so the
+// comparisons are made there; the compiler drops those that cannot be true.
+#define INT_CLAMP_LOOP(dst_t, src_t, lo, hi) do {               \
+    dst_t *restrict d = (dst_t *)dst;                           \
+    const src_t *restrict s = (const src_t *)src;               \
+    for (size_t i = 0; i < n; i++) {                            \
+      int64_t v = (int64_t)s[i];                                \
+      d[i] = v < (int64_t)(lo) ? (lo) :                         \
+             v > (int64_t)(hi) ? (hi) : (dst_t)v;               \
+    }                                                           \
+  } while (0)
+
+#define CONVERT_FROM(dst_t) do {                                  \
+    switch (src_type) {                                           \
+    case elem_type_uint8:   CONVERT_LOOP(dst_t, uint8_t); break;  \
+    case elem_type_int8:    CONVERT_LOOP(dst_t, int8_t);  break;  \
+    case elem_type_int16:   CONVERT_LOOP(dst_t, int16_t); break;  \
+    case elem_type_int32:   CONVERT_LOOP(dst_t, int32_t); break;  \
+    case elem_type_int64:   CONVERT_LOOP(dst_t, int64_t); break;  \
+    case elem_type_float32: CONVERT_LOOP(dst_t, float);   break;  \
+    case elem_type_float64: CONVERT_LOOP(dst_t, double);  break;  \
+    default: break;                                               \
+    }                                                             \
+  } while (0)
+
+#define CONVERT_TO_INT(dst_t, lo, hi) do {                                 \
+    switch (src_type) {                                                    \
+    case elem_type_uint8:   INT_CLAMP_LOOP(dst_t, uint8_t, lo, hi); break; \
+    case elem_type_int8:    INT_CLAMP_LOOP(dst_t, int8_t, lo, hi);  break; \
+    case elem_type_int16:   INT_CLAMP_LOOP(dst_t, int16_t, lo, hi); break; \
+    case elem_type_int32:   INT_CLAMP_LOOP(dst_t, int32_t, lo, hi); break; \
+    case elem_type_int64:   INT_CLAMP_LOOP(dst_t, int64_t, lo, hi); break; \
+    case elem_type_float32: CLAMP_LOOP(dst_t, float, lo, hi);       break; \
+    case elem_type_float64: CLAMP_LOOP(dst_t, double, lo, hi);      break; \
+    default: break;                                                        \
+    }                                                                      \
+  } while (0)
+
+// float16 to or from anything goes through a float32 block on the stack
+#define HALF_BLOCK 1024
+
+static void convert_half_elements(void *dst, elem_type dst_type,
+                                  const void *src, elem_type src_type, size_t n) {
+  float block[HALF_BLOCK];
+  size_t dst_size = elem_size(dst_type);
+  size_t src_size = elem_size(src_type);
+
+  for (size_t off = 0; off < n; off += HALF_BLOCK) {
+    size_t m = n - off < HALF_BLOCK ? n - off : HALF_BLOCK;
+    const char *s = (const char *)src + off * src_size;
+    char *d = (char *)dst + off * dst_size;
+
+    if (src_type == elem_type_float16)
+      halves_to_floats(block, (const uint16_t *)s, m);
+    else
+      convert_elements(block, elem_type_float32, s, src_type, m);
+
+    if (dst_type == elem_type_float16)
+      floats_to_halves((uint16_t *)d, block, m);
+    else
+      convert_elements(d, dst_type, block, elem_type_float32, m);
+  }
+}
+
+void convert_elements(void *dst, elem_type dst_type,
+                      const void *src, elem_type src_type, size_t n) {
+  if (dst_type == src_type) {
+    memcpy(dst, src, n * elem_size(src_type));
+    return;
+  }
+  if (dst_type == elem_type_float16 || src_type == elem_type_float16) {
+    convert_half_elements(dst, dst_type, src, src_type, n);
+    return;
+  }
+
+  switch (dst_type) {
+  case elem_type_uint8:   CONVERT_TO_INT(uint8_t, 0, UINT8_MAX);          break;
+  case elem_type_int8:    CONVERT_TO_INT(int8_t, INT8_MIN, INT8_MAX);    break;
+  case elem_type_int16:   CONVERT_TO_INT(int16_t, INT16_MIN, INT16_MAX); break;
+  case elem_type_int32:   CONVERT_TO_INT(int32_t, INT32_MIN, INT32_MAX); break;
+  case elem_type_int64:   CONVERT_TO_INT(int64_t, INT64_MIN, INT64_MAX); break;
+  case elem_type_float32: CONVERT_FROM(float);   break;
+  case elem_type_float64: CONVERT_FROM(double);  break;
+  default: break;
+  }
+}
+
+#undef CONVERT_TO_INT
+#undef CONVERT_FROM
+#undef INT_CLAMP_LOOP
+#undef CLAMP_LOOP
+#undef CONVERT_LOOP
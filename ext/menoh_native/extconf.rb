@@ -10,8 +10,20 @@ elsif try_cflags '-std=c99'
   $CFLAGS += " -std=c99"
 end
 
+have_header('ruby/memory_view.h')
+have_header('ruby/ractor.h')
+have_func('rb_ext_ractor_safe', 'ruby.h')
+have_func('rb_gc_adjust_memory_usage', 'ruby.h')
+have_func('rb_arithmetic_sequence_beg_len_step', 'ruby.h')
+have_header('sys/mman.h')
+have_library('pthread', 'pthread_create')
+have_func('pthread_condattr_setclock', 'pthread.h')
+# glibc declares it with _GNU_SOURCE, which placement.c defines
+have_func('pthread_setaffinity_np', 'pthread.h') { |src| "#define _GNU_SOURCE 1\n#{src}" }
+
 if pkg_config("menoh")
   have_const('menoh_dtype_float64', 'menoh/menoh.h')
   have_func('menoh_dtype_size', 'menoh/menoh.h')
+  have_func('menoh_make_model_data_from_onnx_data_on_memory', 'menoh/menoh.h')
   create_makefile('menoh/menoh_native')
 end
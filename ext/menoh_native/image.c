@@ -0,0 +1,168 @@
+#include "menoh_ruby.h"
+#include <ruby/thread.h>
+#include <stdbool.h>
+#include <string.h>
+
+// MenohModel#set_image_data: packed HWC uint8 images into an NCHW or NHWC
+// input variable in one pass. Scaling and per-channel normalization of a
+// uint8 pixel only depend on its value and channel, so they are folded into
+// a 256-entry lookup table per channel, and the pass is a table lookup plus
+// the transpose, done one image row at a time.
+
+#define IMAGE_MAX_CHANNELS 4
+
+// conversions of more bytes than this release the GVL
+#define IMAGE_WITHOUT_GVL_MIN_SIZE (64 * 1024)
+
+struct image_arg {
+  const uint8_t *src;
+  void *dst;
+  elem_type dst_type;
+  bool nchw;
+  int32_t n, c, h, w;
+  float lut[IMAGE_MAX_CHANNELS][256];
+  float *tmp;  // one row for dtypes other than float32
+  VALUE vsrc;
+};
+
+// Writes `len` floats of a row into the variable at element offset `off`.
+static void store_row(const struct image_arg *arg, size_t off, const float *row, size_t len) {
+  convert_elements((char *)arg->dst + off * elem_size(arg->dst_type), arg->dst_type,
+                   row, elem_type_float32, len);
+}
+
+static void *set_image_without_gvl(void *p) {
+  const struct image_arg *arg = (const struct image_arg *)p;
+  const int32_t c = arg->c, h = arg->h, w = arg->w;
+  const size_t plane = (size_t)h * w;
+  const size_t image = plane * c;
+  const bool direct = arg->dst_type == elem_type_float32;
+  float *tmp = arg->tmp;
+
+  for (int32_t b = 0; b < arg->n; b++) {
+    for (int32_t y = 0; y < h; y++) {
+      // the source and an NHWC destination share the element offset
+      size_t row_off = b * image + (size_t)y * w * c;
+      const uint8_t *s = arg->src + row_off;
+
+      if (!arg->nchw) {
+        // NHWC keeps the order, one row of w * c values
+        float *d = direct ? (float *)arg->dst + row_off : tmp;
+        size_t len = (size_t)w * c;
+        if (c == 3) {
+          for (int32_t x = 0; x < w; x++) {
+            d[x * 3 + 0] = arg->lut[0][s[x * 3 + 0]];
+            d[x * 3 + 1] = arg->lut[1][s[x * 3 + 1]];
+            d[x * 3 + 2] = arg->lut[2][s[x * 3 + 2]];
+          }
+        } else {
+          for (size_t i = 0; i < len; i++)
+            d[i] = arg->lut[i % c][s[i]];
+        }
+        if (!direct) store_row(arg, row_off, tmp, len);
+        continue;
+      }
+
+      // NCHW splits the row into one row per channel plane
+      if (c == 3 && direct) {
+        float *d0 = (float *)arg->dst + b * image + (size_t)y * w;
+        float *d1 = d0 + plane;
+        float *d2 = d1 + plane;
+        for (int32_t x = 0; x < w; x++) {
+          d0[x] = arg->lut[0][s[x * 3 + 0]];
+          d1[x] = arg->lut[1][s[x * 3 + 1]];
+          d2[x] = arg->lut[2][s[x * 3 + 2]];
+        }
+        continue;
+      }
+      for (int32_t k = 0; k < c; k++) {
+        size_t off = b * image + k * plane + (size_t)y * w;
+        float *d = direct ? (float *)arg->dst + off : tmp;
+        for (int32_t x = 0; x < w; x++)
+          d[x] = arg->lut[k][s[x * c + k]];
+        if (!direct) store_row(arg, off, tmp, w);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static VALUE set_image_body(VALUE arg) {
+  rb_thread_call_without_gvl(set_image_without_gvl, (void *)arg, NULL, NULL);
+  return Qnil;
+}
+
+static VALUE set_image_unlock(VALUE arg) {
+  rb_str_unlocktmp(((struct image_arg *)arg)->vsrc);
+  return Qnil;
+}
+
+static float channel_param(VALUE vparams, int32_t k, const char *name) {
+  Check_Type(vparams, T_ARRAY);
+  long len = RARRAY_LEN(vparams);
+  if (len != 1 && len <= k)
+    rb_raise(rb_eArgError, "%s needs 1 or as many values as channels", name);
+  return (float)NUM2DBL(RARRAY_AREF(vparams, len == 1 ? 0 : k));
+}
+
+// Takes N packed H x W x C uint8 images. Each channel value v becomes
+// (v * scale - mean[k]) / std[k].
+static VALUE wrap_model_set_image_data(VALUE self, VALUE vname, VALUE vdata,
+                                       VALUE vnchw, VALUE vmean, VALUE vstd, VALUE vscale) {
+  uint64_t started = stats_now();
+  model_variable *var = get_variable(self, vname);
+  StringValue(vdata);
+  bool nchw = RTEST(vnchw);
+
+  if (var->dims_length != 4)
+    rb_raise(rb_eArgError, "'%s' is not a batch of images", RSTRING_PTR(var->vname));
+  struct image_arg *arg = ALLOCA_N(struct image_arg, 1);
+  arg->n = var->dims[0];
+  arg->c = nchw ? var->dims[1] : var->dims[3];
+  arg->h = nchw ? var->dims[2] : var->dims[1];
+  arg->w = nchw ? var->dims[3] : var->dims[2];
+  if (arg->c < 1 || arg->c > IMAGE_MAX_CHANNELS)
+    rb_raise(rb_eArgError, "unsupported number of channels: %d", (int)arg->c);
+
+  size_t size = (size_t)arg->n * arg->c * arg->h * arg->w;
+  if ((size_t)RSTRING_LEN(vdata) != size)
+    rb_raise(rb_eArgError, "wrong string length at (expected %zu, was %zu)",
+             size, (size_t)RSTRING_LEN(vdata));
+
+  arg->dst_type = dtype_elem_type(var->dtype);
+  if (arg->dst_type == elem_type_unknown)
+    rb_raise(rb_eArgError, "unsupported dtype for images: %d", (int)var->dtype);
+
+  float scale = (float)NUM2DBL(vscale);
+  for (int32_t k = 0; k < arg->c; k++) {
+    float mean = channel_param(vmean, k, "mean");
+    float std = channel_param(vstd, k, "std");
+    if (std == 0.0f) rb_raise(rb_eArgError, "std must not be 0");
+    for (int v = 0; v < 256; v++)
+      arg->lut[k][v] = ((float)v * scale - mean) / std;
+  }
+
+  arg->src = (const uint8_t *)RSTRING_PTR(vdata);
+  arg->dst = var->buf;
+  arg->nchw = nchw;
+  arg->vsrc = vdata;
+  VALUE vtmp = 0;
+  arg->tmp = ALLOCV_N(float, vtmp, (size_t)arg->w * arg->c);
+  if (size < IMAGE_WITHOUT_GVL_MIN_SIZE) {
+    set_image_without_gvl(arg);
+  } else {
+    rb_str_locktmp(vdata);
+    rb_ensure(set_image_body, (VALUE)arg, set_image_unlock, (VALUE)arg);
+  }
+  ALLOCV_END(vtmp);
+
+  stats_record(self, stats_stage_input, stats_now() - started, var->size);
+  return Qnil;
+}
+
+void Init_menoh_image(VALUE mMenoh) {
+  VALUE model = rb_const_get(mMenoh, rb_intern("MenohModel"));
+  rb_define_private_method(model, "native_set_image_data",
+                           RUBY_METHOD_FUNC(wrap_model_set_image_data), 6);
+}
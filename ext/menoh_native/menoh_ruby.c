@@ -1,7 +1,19 @@
 #include "menoh_ruby.h"
 #include <ruby/thread.h>
+#include <ruby/util.h>
+#ifdef HAVE_RUBY_MEMORY_VIEW_H
+#include <ruby/memory_view.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <sys/stat.h>
 
-static VALUE eError;
+VALUE eError;
 static VALUE eStdError;
 static VALUE eUnknownError;
 static VALUE eInvalidFilename;
@@ -26,12 +38,12 @@ static VALUE eInvalidBackendConfigError;
 static VALUE eInputNotFoundError;
 static VALUE eOutputNotFoundError;
 
-static void error_check(menoh_error_code ec) {
+VALUE menoh_error_class(menoh_error_code ec) {
   VALUE e = eError; // eUnknownError might be better?
 
   switch (ec) {
   case menoh_error_code_success:
-    return;
+    return Qnil;
   case menoh_error_code_std_error:
     e = eStdError;
     break;
@@ -103,16 +115,30 @@ static void error_check(menoh_error_code ec) {
     break;
   }
 
-  rb_raise(e, "%s", menoh_get_last_error_message());
+  return e;
+}
+
+static void error_check(menoh_error_code ec) {
+  if (ec == menoh_error_code_success) return;
+  rb_raise(menoh_error_class(ec), "%s", menoh_get_last_error_message());
 }
 
 #define ERROR_CHECK(statement) error_check(statement)
 
+// Tells the GC about native memory allocated outside of ruby_xmalloc, so
+// that large models count towards the next GC like the Ruby heap does.
+static void adjust_memory_usage(ssize_t diff) {
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+  rb_gc_adjust_memory_usage(diff);
+#endif
+}
+
 static ID id_float;
 static ID id_float16, id_float32, id_float64;
 static ID id_int8, id_int16, id_int32, id_int64;
+static ID id_uint8;
 
-static menoh_dtype
+menoh_dtype
 get_dtype(VALUE val) {
   if (NIL_P(val)) return menoh_dtype_float;
 
@@ -162,20 +188,119 @@ static int32_t dtype_size(menoh_dtype dtype) {
 }
 
 
+elem_type dtype_elem_type(menoh_dtype dtype) {
+  switch (dtype) {
+  case menoh_dtype_float:
+    return elem_type_float32;
+#ifdef HAVE_CONST_MENOH_DTYPE_FLOAT64
+  case menoh_dtype_float16:
+    return elem_type_float16;
+  case menoh_dtype_float64:
+    return elem_type_float64;
+  case menoh_dtype_int8:
+    return elem_type_int8;
+  case menoh_dtype_int16:
+    return elem_type_int16;
+  case menoh_dtype_int32:
+    return elem_type_int32;
+  case menoh_dtype_int64:
+    return elem_type_int64;
+#endif
+  default:
+    return elem_type_unknown;
+  }
+}
+
+// element type of a binary String given by a dtype Symbol, which may also be
+// :uint8 unlike menoh dtypes
+elem_type get_elem_type(VALUE val) {
+  if (val == ID2SYM(id_uint8))   return elem_type_uint8;
+  if (val == ID2SYM(id_int8))    return elem_type_int8;
+  if (val == ID2SYM(id_int16))   return elem_type_int16;
+  if (val == ID2SYM(id_int32))   return elem_type_int32;
+  if (val == ID2SYM(id_int64))   return elem_type_int64;
+  if (val == ID2SYM(id_float16)) return elem_type_float16;
+  if (val == ID2SYM(id_float) || val == ID2SYM(id_float32)) return elem_type_float32;
+  if (val == ID2SYM(id_float64)) return elem_type_float64;
+
+  VALUE s = rb_inspect(val);
+  rb_raise(eInvalidDType, "unknown dtype: %s", StringValueCStr(s));
+}
+
+// conversions of more bytes than this release the GVL
+#define CONVERT_WITHOUT_GVL_MIN_SIZE (64 * 1024)
+
+struct convert_arg {
+  void *dst;
+  elem_type dst_type;
+  const void *src;
+  elem_type src_type;
+  size_t n;
+  VALUE vsrc; // locked while the GVL is released
+};
+
+static void *convert_without_gvl(void *arg) {
+  struct convert_arg *arg2 = (struct convert_arg *)arg;
+  convert_elements(arg2->dst, arg2->dst_type, arg2->src, arg2->src_type, arg2->n);
+  return NULL;
+}
+
+static VALUE convert_body(VALUE arg) {
+  rb_thread_call_without_gvl(convert_without_gvl, (void *)arg, NULL, NULL);
+  return Qnil;
+}
+
+static VALUE convert_unlock(VALUE arg) {
+  rb_str_unlocktmp(((struct convert_arg *)arg)->vsrc);
+  return Qnil;
+}
+
+// Converts n elements of the String vsrc into dst, without the GVL for
+// large buffers.
+static void convert_string(void *dst, elem_type dst_type,
+                           VALUE vsrc, elem_type src_type, size_t n) {
+  struct convert_arg arg = {
+    .dst = dst,
+    .dst_type = dst_type,
+    .src = RSTRING_PTR(vsrc),
+    .src_type = src_type,
+    .n = n,
+    .vsrc = vsrc,
+  };
+  if (n * elem_size(src_type) < CONVERT_WITHOUT_GVL_MIN_SIZE) {
+    convert_without_gvl(&arg);
+    return;
+  }
+  rb_str_locktmp(vsrc);
+  rb_ensure(convert_body, (VALUE)&arg, convert_unlock, (VALUE)&arg);
+}
+
+
 typedef struct menoh_ruby {
-  menoh_model_data_handle model_data;
+  menoh_model_data_handle model_data; // NULL once released
+  // Menoh cannot tell the memory of model_data, so the size of the
+  // serialized model (mostly weights) is used as an estimate of it
+  size_t model_data_size;
+  pthread_mutex_t lock; // serializes the model builds reading model_data
 } menoh_ruby;
 
 static void wrap_menoh_free(menoh_ruby *);
+static size_t wrap_menoh_memsize(const menoh_ruby *);
 
+// A frozen Menoh::Menoh is shareable between Ractors, which then build
+// their models from the same parsed weights.
 static const rb_data_type_t menoh_ruby_data_type = {
   "Menoh::Menoh",
-  {NULL, (void(*)(void*))wrap_menoh_free, NULL,},
+  {NULL, (void(*)(void*))wrap_menoh_free, (size_t(*)(const void*))wrap_menoh_memsize,},
   0, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+#ifdef HAVE_RUBY_RACTOR_H
+  | RUBY_TYPED_FROZEN_SHAREABLE
+#endif
 };
 
 static ID id_backend, id_backend_config, id_input_layers, id_output_layers;
-static ID id_data, id_dims, id_dtype, id_length, id_name, id_shape;
+static ID id_external_buffers, id_placement;
+static ID id_data, id_dims, id_dtype, id_length, id_name, id_shape, id_to_a;
 
 static menoh_ruby *getONNX(VALUE self) {
   menoh_ruby *p;
@@ -183,63 +308,328 @@ static menoh_ruby *getONNX(VALUE self) {
   return p;
 }
 
-static void wrap_menoh_free(menoh_ruby *p) {
+static void delete_model_data(menoh_ruby *p) {
+  if (p->model_data == NULL) return;
   menoh_delete_model_data(p->model_data);
+  p->model_data = NULL;
+  adjust_memory_usage(-(ssize_t)p->model_data_size);
+}
+
+static void set_model_data(menoh_ruby *p, menoh_model_data_handle model_data, size_t size) {
+  delete_model_data(p);
+  p->model_data = model_data;
+  p->model_data_size = size;
+  adjust_memory_usage((ssize_t)size);
+}
+
+static void wrap_menoh_free(menoh_ruby *p) {
+  delete_model_data(p);
+  pthread_mutex_destroy(&p->lock);
   ruby_xfree(p);
 }
 
+// The parsed model is not measurable through the Menoh API, so its
+// serialized size stands in for it.
+static size_t wrap_menoh_memsize(const menoh_ruby *p) {
+  return sizeof(menoh_ruby) + (p->model_data != NULL ? p->model_data_size : 0);
+}
+
 static VALUE wrap_menoh_alloc(VALUE klass) {
-  void *p = ruby_xmalloc(sizeof(menoh_ruby));
+  menoh_ruby *p = ruby_xmalloc(sizeof(menoh_ruby));
   memset(p, 0, sizeof(menoh_ruby));
+  pthread_mutex_init(&p->lock, NULL);
   return TypedData_Wrap_Struct(klass, &menoh_ruby_data_type, p);
 }
 
+static void *lock_model_data_without_gvl(void *lock) {
+  pthread_mutex_lock((pthread_mutex_t *)lock);
+  return NULL;
+}
+
+// Waits for the lock without the GVL, so the holder can always finish.
+static void lock_model_data(menoh_ruby *p) {
+  if (pthread_mutex_trylock(&p->lock) == 0) return;
+  rb_thread_call_without_gvl(lock_model_data_without_gvl, &p->lock, NULL, NULL);
+}
+
+static VALUE unlock_model_data(VALUE arg) {
+  pthread_mutex_unlock(&((menoh_ruby *)arg)->lock);
+  return Qnil;
+}
+
+// Parsing an ONNX model runs without the GVL. The source is a file name or
+// bytes no other thread can modify meanwhile.
+struct load_arg {
+  VALUE self;
+  const char *filename;
+  const void *data;
+  size_t size;
+  menoh_model_data_handle model_data;
+  menoh_error_code err;
+};
+
+static void *load_model_data(void *arg) {
+  struct load_arg *arg2 = (struct load_arg *)arg;
+#ifdef HAVE_MENOH_MAKE_MODEL_DATA_FROM_ONNX_DATA_ON_MEMORY
+  if (arg2->filename == NULL) {
+    arg2->err = menoh_make_model_data_from_onnx_data_on_memory(
+        (const uint8_t *)arg2->data, (int32_t)arg2->size, &arg2->model_data);
+    return NULL;
+  }
+#endif
+  arg2->err = menoh_make_model_data_from_onnx(arg2->filename, &arg2->model_data);
+  struct stat st;
+  if (arg2->err == menoh_error_code_success && stat(arg2->filename, &st) == 0)
+    arg2->size = (size_t)st.st_size;
+  return NULL;
+}
+
+static VALUE load_body(VALUE arg) {
+  struct load_arg *arg2 = (struct load_arg *)arg;
+  rb_thread_call_without_gvl(load_model_data, arg2, NULL, NULL);
+  ERROR_CHECK(arg2->err);
+  set_model_data(getONNX(arg2->self), arg2->model_data, arg2->size);
+  arg2->model_data = NULL;
+  return Qnil;
+}
+
+// the model is parsed but an interrupt came before it was set
+static VALUE load_cleanup(VALUE arg) {
+  struct load_arg *arg2 = (struct load_arg *)arg;
+  if (arg2->model_data != NULL) menoh_delete_model_data(arg2->model_data);
+  return Qnil;
+}
+
+static void load(struct load_arg *arg) {
+  rb_ensure(load_body, (VALUE)arg, load_cleanup, (VALUE)arg);
+}
+
 static VALUE wrap_menoh_init(VALUE self, VALUE vfilename) {
   FilePathValue(vfilename);
-  char *filename = StringValueCStr(vfilename);
+  vfilename = rb_str_new_frozen(vfilename);
 
   // Load ONNX model
-  menoh_model_data_handle model_data;
-  ERROR_CHECK(menoh_make_model_data_from_onnx(filename, &model_data));
-  getONNX(self)->model_data = model_data;
+  struct load_arg arg = {
+    .self = self,
+    .filename = StringValueCStr(vfilename),
+  };
+  load(&arg);
+  RB_GC_GUARD(vfilename);
 
   return Qnil;
 }
 
-typedef struct menohModel {
-  void **input_buffs;
-  void **output_buffs;
-  menoh_model_handle model;
-  VALUE vinput_layers;
-  VALUE voutput_layers;
-  int32_t input_layer_num;
-} menohModel;
+#ifdef HAVE_MENOH_MAKE_MODEL_DATA_FROM_ONNX_DATA_ON_MEMORY
+static void load_onnx_data(VALUE self, const void *data, size_t size) {
+  if (size > INT32_MAX)
+    rb_raise(rb_eArgError, "too large ONNX data: %zu bytes", size);
+  struct load_arg arg = {
+    .self = self,
+    .data = data,
+    .size = size,
+  };
+  load(&arg);
+}
+
+static VALUE wrap_menoh_init_from_memory(VALUE self, VALUE vdata) {
+  StringValue(vdata);
+  // the frozen copy keeps the bytes even if the caller modifies vdata
+  vdata = rb_str_new_frozen(vdata);
+  load_onnx_data(self, RSTRING_PTR(vdata), RSTRING_LEN(vdata));
+  RB_GC_GUARD(vdata);
+  return Qnil;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+struct mmap_load_arg {
+  VALUE self;
+  void *addr;
+  size_t size;
+};
+
+static VALUE mmap_load_body(VALUE arg) {
+  struct mmap_load_arg *arg2 = (struct mmap_load_arg *)arg;
+  load_onnx_data(arg2->self, arg2->addr, arg2->size);
+  return Qnil;
+}
+
+static VALUE mmap_load_unmap(VALUE arg) {
+  struct mmap_load_arg *arg2 = (struct mmap_load_arg *)arg;
+  munmap(arg2->addr, arg2->size);
+  return Qnil;
+}
+
+// Parses the ONNX file straight from its page cache mapping, so that no copy
+// of the serialized model lands on the Ruby heap.
+static VALUE wrap_menoh_init_from_mmap(VALUE self, VALUE vfilename) {
+  FilePathValue(vfilename);
+  const char *filename = StringValueCStr(vfilename);
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) rb_sys_fail(filename);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int e = errno;
+    close(fd);
+    rb_syserr_fail(e, filename);
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    rb_raise(eONNXParseError, "empty ONNX file: %s", filename);
+  }
+  void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  int e = errno;
+  close(fd);
+  if (addr == MAP_FAILED) rb_syserr_fail(e, filename);
+#ifdef MADV_SEQUENTIAL
+  madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+
+  struct mmap_load_arg arg = {
+    .self = self,
+    .addr = addr,
+    .size = (size_t)st.st_size,
+  };
+  rb_ensure(mmap_load_body, (VALUE)&arg, mmap_load_unmap, (VALUE)&arg);
+
+  return Qnil;
+}
+#endif
+#endif
+
+// Frees the parsed model. The models built from it have their own copy of
+// the weights in the backend, so only further builds need it.
+static VALUE wrap_menoh_release(VALUE self) {
+  menoh_ruby *p = getONNX(self);
+  lock_model_data(p);
+  delete_model_data(p);
+  unlock_model_data((VALUE)p);
+  return Qnil;
+}
+
+static VALUE wrap_menoh_released_p(VALUE self) {
+  return getONNX(self)->model_data == NULL ? Qtrue : Qfalse;
+}
 
 static void wrap_model_free(menohModel *);
 static void wrap_model_mark(menohModel *);
+static size_t wrap_model_memsize(const menohModel *);
 
 static const rb_data_type_t menohModel_data_type = {
   "Menoh::MenohModel",
-  {(void(*)(void*))wrap_model_mark, (void(*)(void*))wrap_model_free, NULL,},
+  {(void(*)(void*))wrap_model_mark, (void(*)(void*))wrap_model_free,
+   (size_t(*)(const void*))wrap_model_memsize,},
   0, NULL, RUBY_TYPED_FREE_IMMEDIATELY
 };
 
-static menohModel *getModel(VALUE self) {
+menohModel *getModel(VALUE self) {
   menohModel *p;
   TypedData_Get_Struct(self, menohModel, &menohModel_data_type, p);
   return p;
 }
 
+#define EXTERNAL_BUFFER_ALIGNMENT 64
+
+static void *aligned_alloc_buffer(size_t size) {
+  void *ptr;
+#ifdef _WIN32
+  ptr = _aligned_malloc(size, EXTERNAL_BUFFER_ALIGNMENT);
+  if (ptr == NULL) rb_memerror();
+#else
+  if (posix_memalign(&ptr, EXTERNAL_BUFFER_ALIGNMENT, size) != 0) rb_memerror();
+#endif
+  return ptr;
+}
+
+static void aligned_free_buffer(void *ptr) {
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
 static void wrap_model_free(menohModel *p) {
+  adjust_memory_usage(-(ssize_t)p->reported_memsize);
+  // the model may still refer to external buffers, so delete it first
   menoh_delete_model(p->model);
-  ruby_xfree(p->input_buffs);
-  ruby_xfree(p->output_buffs);
+  for (int32_t i = 0; i < p->external_buffer_num; i++) {
+    if (NIL_P(p->external_buffers[i].vstr))
+      aligned_free_buffer(p->external_buffers[i].ptr);
+  }
+  ruby_xfree(p->external_buffers);
+  for (int32_t i = 0; i < p->variable_num; i++)
+    ruby_xfree(p->variables[i].dims);
+  ruby_xfree(p->variables);
+  ruby_xfree(p->placement);
   ruby_xfree(p);
 }
 
 static void wrap_model_mark(menohModel *p) {
   rb_gc_mark(p->vinput_layers);
   rb_gc_mark(p->voutput_layers);
+  // rb_gc_mark (not rb_gc_mark_movable) also pins the Strings so that
+  // compaction never moves the memory attached to the model
+  for (int32_t i = 0; i < p->external_buffer_num; i++) {
+    rb_gc_mark(p->external_buffers[i].vname);
+    rb_gc_mark(p->external_buffers[i].vstr);
+  }
+  for (int32_t i = 0; i < p->variable_num; i++)
+    rb_gc_mark(p->variables[i].vname);
+}
+
+// Native memory of a model by kind. The variable buffers Menoh allocates
+// are counted from their shapes. The weights held by the backend cannot be
+// measured, so they are estimated by the size of the serialized model it
+// was built from. Caller-owned external Strings are reported apart, Ruby
+// accounts for them already.
+typedef struct model_memory {
+  size_t weights;
+  size_t buffers;   // variable buffers allocated by Menoh
+  size_t arenas;    // external buffers owned by the model
+  size_t external;  // caller-owned external buffers
+  size_t bookkeeping;
+} model_memory;
+
+static model_memory model_memory_usage(const menohModel *p) {
+  model_memory m = {
+    .weights = p->weights_size,
+    .bookkeeping = sizeof(menohModel) +
+      sizeof(model_variable) * p->variable_num +
+      sizeof(external_buffer) * p->external_buffer_num,
+  };
+  for (int32_t i = 0; i < p->variable_num; i++) {
+    const model_variable *var = &p->variables[i];
+    m.bookkeeping += sizeof(int32_t) * var->dims_length;
+    if (var->external == NULL) m.buffers += var->size;
+  }
+  for (int32_t i = 0; i < p->external_buffer_num; i++) {
+    if (NIL_P(p->external_buffers[i].vstr))
+      m.arenas += p->external_buffers[i].size;
+    else
+      m.external += p->external_buffers[i].size;
+  }
+  return m;
+}
+
+static size_t wrap_model_memsize(const menohModel *p) {
+  model_memory m = model_memory_usage(p);
+  return m.weights + m.buffers + m.arenas + m.bookkeeping;
+}
+
+// memory_usage returns the bytes of each kind of model_memory and their
+// total; :weights is the estimate from the serialized model.
+static VALUE wrap_model_memory_usage(VALUE self) {
+  model_memory m = model_memory_usage(getModel(self));
+  VALUE vhash = rb_hash_new();
+  rb_hash_aset(vhash, ID2SYM(rb_intern("weights")), SIZET2NUM(m.weights));
+  rb_hash_aset(vhash, ID2SYM(rb_intern("buffers")), SIZET2NUM(m.buffers));
+  rb_hash_aset(vhash, ID2SYM(rb_intern("arenas")), SIZET2NUM(m.arenas));
+  rb_hash_aset(vhash, ID2SYM(rb_intern("external")), SIZET2NUM(m.external));
+  rb_hash_aset(vhash, ID2SYM(rb_intern("bookkeeping")), SIZET2NUM(m.bookkeeping));
+  rb_hash_aset(vhash, ID2SYM(rb_intern("total")),
+               SIZET2NUM(m.weights + m.buffers + m.arenas + m.bookkeeping));
+  return vhash;
 }
 
 static VALUE wrap_model_alloc(VALUE klass) {
@@ -248,21 +638,26 @@ static VALUE wrap_model_alloc(VALUE klass) {
   return TypedData_Wrap_Struct(klass, &menohModel_data_type, p);
 }
 
-struct build_vpt_arg {
-  VALUE self;
-  VALUE vinput_layers;
-  VALUE voutput_layers;
+// A build takes turns with the GVL: the Ruby option is converted into the
+// Menoh builders and plain C strings while it is held, and the heavy phases
+// (shape inference, optimization and the backend build) run without it.
+// Handles made on the way are kept here so that model_init_ensure deletes
+// them whatever happens in between.
+typedef struct model_build {
   menoh_model_data_handle model_data;
   menoh_variable_profile_table_builder_handle vpt_builder;
-};
+  menoh_variable_profile_table_handle vpt;
+  menoh_model_builder_handle model_builder;
+  char *backend;
+  char *backend_config;
+  menoh_model_handle *model;
+  menoh_error_code err;
+} model_build;
 
-static VALUE build_vpt(VALUE arg) {
-  struct build_vpt_arg *arg2 = (struct build_vpt_arg*)arg;
-  VALUE self = arg2->self;
-  VALUE vinput_layers = arg2->vinput_layers;
-  VALUE voutput_layers = arg2->voutput_layers;
-  menoh_model_data_handle model_data = arg2->model_data;
-  menoh_variable_profile_table_builder_handle vpt_builder = arg2->vpt_builder;
+static void add_profiles(VALUE self, model_build *b) {
+  VALUE vinput_layers = getModel(self)->vinput_layers;
+  VALUE voutput_layers = getModel(self)->voutput_layers;
+  menoh_variable_profile_table_builder_handle vpt_builder = b->vpt_builder;
 
   // set output_layer
   int32_t output_layer_num =
@@ -295,154 +690,284 @@ static VALUE build_vpt(VALUE arg) {
             dims_length,
             dims));
   }
+}
 
-  // build variable profile table
-  menoh_variable_profile_table_handle variable_profile_table;
-  ERROR_CHECK(menoh_build_variable_profile_table(
-                  vpt_builder, model_data,
-                  &variable_profile_table));
+// build variable profile table and optimize model_data for it
+static void *build_vpt(void *arg) {
+  model_build *b = (model_build *)arg;
+  b->err = menoh_build_variable_profile_table(b->vpt_builder, b->model_data, &b->vpt);
+  if (b->err == menoh_error_code_success)
+    b->err = menoh_model_data_optimize(b->model_data, b->vpt);
+  return NULL;
+}
 
-  return (VALUE)variable_profile_table;
+static void *build_backend_model(void *arg) {
+  model_build *b = (model_build *)arg;
+  b->err = menoh_build_model(b->model_builder, b->model_data,
+                             b->backend, b->backend_config, b->model);
+  return NULL;
 }
 
-static VALUE vpt_builder_free(VALUE arg) {
-  menoh_delete_variable_profile_table_builder((menoh_variable_profile_table_builder_handle)arg);
-  return Qnil;
+static size_t get_profile_buffer_size(menoh_variable_profile_table_handle vpt,
+                                      const char *name) {
+  menoh_dtype dtype;
+  int32_t dims_length;
+  size_t buffer_length = 1;
+  ERROR_CHECK(menoh_variable_profile_table_get_dtype(vpt, name, &dtype));
+  ERROR_CHECK(menoh_variable_profile_table_get_dims_size(vpt, name, &dims_length));
+  for (int32_t i = 0; i < dims_length; i++) {
+    int32_t tmp;
+    ERROR_CHECK(menoh_variable_profile_table_get_dims_at(vpt, name, i, &tmp));
+    buffer_length *= tmp;
+  }
+  return buffer_length * dtype_size(dtype);
 }
 
-struct build_model_arg {
-  VALUE self;
-  VALUE option;
-  menoh_model_data_handle model_data;
-  menoh_model_builder_handle model_builder;
-};
+static void prepare_external_buffers(VALUE self, VALUE vexternal_buffers,
+                                     menoh_variable_profile_table_handle variable_profile_table) {
+  menohModel *p = getModel(self);
+
+  int32_t buffer_num = (int32_t)RARRAY_LEN(vexternal_buffers);
+  p->external_buffers =
+      (external_buffer *)ruby_xcalloc(buffer_num, sizeof(external_buffer));
+  for (int32_t i = 0; i < buffer_num; i++) {
+    VALUE ventry = rb_ary_entry(vexternal_buffers, i);
+    VALUE vname = rb_str_new_frozen(rb_ary_entry(ventry, 0));
+    VALUE vbuffer = rb_ary_entry(ventry, 1);
+    size_t size = get_profile_buffer_size(variable_profile_table,
+                                          StringValueCStr(vname));
+    void *ptr;
+
+    if (RB_TYPE_P(vbuffer, T_STRING)) {
+      if ((size_t)RSTRING_LEN(vbuffer) != size)
+        rb_raise(rb_eArgError,
+                 "wrong string length for external buffer '%s' (expected %zu, was %zu)",
+                 StringValueCStr(vname), size, (size_t)RSTRING_LEN(vbuffer));
+      // make sure the String owns a writable, unshared buffer
+      rb_str_modify(vbuffer);
+      ptr = RSTRING_PTR(vbuffer);
+    } else {
+      vbuffer = Qnil;
+      ptr = aligned_alloc_buffer(size);
+      memset(ptr, 0, size);
+    }
 
-static VALUE model_builder_free(VALUE arg) {
-  menoh_delete_model_builder((menoh_model_builder_handle)arg);
-  return Qnil;
+    p->external_buffers[i].vname = vname;
+    p->external_buffers[i].vstr = vbuffer;
+    p->external_buffers[i].ptr = ptr;
+    p->external_buffers[i].size = size;
+    p->external_buffer_num = i + 1;
+  }
 }
 
-static VALUE build_model(VALUE arg) {
-  struct build_model_arg *arg2 = (struct build_model_arg*)arg;
-  VALUE self = arg2->self;
-  VALUE vinput_layers = getModel(self)->vinput_layers;
-  VALUE voutput_layers = getModel(self)->voutput_layers;
-  VALUE option = arg2->option;
-  menoh_model_data_handle model_data = arg2->model_data;
-  menoh_model_builder_handle model_builder = arg2->model_builder;
+// Strings attached as external buffers stay owned by the caller, so make
+// sure they were not resized or replaced before the model touches them.
+void check_external_buffer(external_buffer *buf) {
+  if (buf == NULL || NIL_P(buf->vstr)) return;
+  if (RSTRING_PTR(buf->vstr) != buf->ptr ||
+      (size_t)RSTRING_LEN(buf->vstr) != buf->size)
+    rb_raise(eError, "external buffer for '%s' was reallocated",
+             RSTRING_PTR(buf->vname));
+}
 
-  // build model
-  VALUE vbackend = rb_hash_aref(option, ID2SYM(id_backend));
-  VALUE vbackend_config = rb_hash_aref(option, ID2SYM(id_backend_config));
-  ERROR_CHECK(menoh_build_model(
-                  model_builder, model_data,
-                  StringValueCStr(vbackend),
-                  NIL_P(vbackend_config) ? "" : StringValueCStr(vbackend_config),
-                  &getModel(self)->model));
-  menoh_model_handle model = getModel(self)->model;
-
-  // attach input buffer to model builder
-  int32_t input_layer_num =
-      NUM2INT(rb_funcall(vinput_layers, id_length, 0));
-  getModel(self)->input_buffs =
-      (void **)ruby_xmalloc(sizeof(void *) * input_layer_num);
-  for (int32_t i = 0; i < input_layer_num; i++) {
-    VALUE vinput_layer = rb_ary_entry(vinput_layers, i);
-    VALUE vname =
-        rb_hash_aref(vinput_layer, ID2SYM(id_name));
-    VALUE vdims =
-        rb_hash_aref(vinput_layer, ID2SYM(id_dims));
-    int32_t dims_length =
-        NUM2INT(rb_funcall(vdims, id_length, 0));
+void check_external_buffers(menohModel *p) {
+  for (int32_t i = 0; i < p->external_buffer_num; i++)
+    check_external_buffer(&p->external_buffers[i]);
+}
 
-    // prepare input buffer
-    int32_t buffer_length = 1;
-    for (int32_t j = 0; j < dims_length; j++)
-      buffer_length *= NUM2INT(rb_ary_entry(vdims, j));
+static void unlock_first_external_buffers(menohModel *p, int32_t n) {
+  for (int32_t i = 0; i < n; i++) {
+    external_buffer *buf = &p->external_buffers[i];
+    if (!NIL_P(buf->vstr) && --buf->lock_count == 0)
+      rb_str_unlocktmp(buf->vstr);
+  }
+}
 
-    void *input_buff;
-    ERROR_CHECK(menoh_model_get_variable_buffer_handle(
-                    model, StringValueCStr(vname),
-                    &input_buff));
-    getModel(self)->input_buffs[i] = input_buff;
+// The check cannot stop other threads from resizing or replacing the
+// Strings while a run uses them without the GVL, so they are locked for the
+// run as well. Runs that overlap share the lock of a String.
+void lock_external_buffers(menohModel *p) {
+  int32_t i;
+  int state = 0;
+  for (i = 0; i < p->external_buffer_num; i++) {
+    external_buffer *buf = &p->external_buffers[i];
+    if (NIL_P(buf->vstr)) continue;
+    if (buf->lock_count == 0) {
+      rb_protect(rb_str_locktmp, buf->vstr, &state);
+      if (state) break;
+    }
+    buf->lock_count++;
+  }
+  if (state) {
+    unlock_first_external_buffers(p, i);
+    rb_jump_tag(state);
   }
+}
+
+void unlock_external_buffers(menohModel *p) {
+  unlock_first_external_buffers(p, p->external_buffer_num);
+}
+
+// Whether vstr is attached to the model; such Strings are locked by
+// lock_external_buffers and must not be locked again as inputs.
+bool external_string_p(menohModel *p, VALUE vstr) {
+  for (int32_t i = 0; i < p->external_buffer_num; i++) {
+    if (p->external_buffers[i].vstr == vstr) return true;
+  }
+  return false;
+}
 
-  // attach output buffer to model
+// Runs from Ruby share the variable buffers with run_async, so they are
+// refused while a job of the model is queued or running.
+void check_no_async_run(menohModel *p) {
+  if (async_pending_p(p))
+    rb_raise(eError, "the model has a pending run_async; wait for it first");
+}
+
+// Whether vary holds obj itself. Unlike rb_ary_includes this never compares
+// String contents, which would treat equal but distinct buffers as one.
+bool ary_includes_object(VALUE vary, VALUE obj) {
+  for (long i = 0; i < RARRAY_LEN(vary); i++)
+    if (RARRAY_AREF(vary, i) == obj) return true;
+  return false;
+}
+
+static void build_binding_plan(VALUE self) {
+  menohModel *p = getModel(self);
+  VALUE vinput_layers = p->vinput_layers;
+  VALUE voutput_layers = p->voutput_layers;
+  menoh_model_handle model = p->model;
+
+  int32_t input_layer_num =
+      NUM2INT(rb_funcall(vinput_layers, id_length, 0));
   int32_t output_layer_num =
       NUM2INT(rb_funcall(voutput_layers, id_length, 0));
-  getModel(self)->output_buffs =
-      (void **)ruby_xmalloc(sizeof(void *) * output_layer_num);
-  for (int32_t i = 0; i < output_layer_num; i++) {
-    VALUE voutput_layer = rb_ary_entry(voutput_layers, i);
-    void *output_buff;
-    ERROR_CHECK(menoh_model_get_variable_buffer_handle(
-                    model, StringValueCStr(voutput_layer),
-                    &output_buff));
-    getModel(self)->output_buffs[i] = output_buff;
+  p->variables = (model_variable *)ruby_xcalloc(input_layer_num + output_layer_num,
+                                                sizeof(model_variable));
+  for (int32_t i = 0; i < input_layer_num + output_layer_num; i++) {
+    VALUE vname = i < input_layer_num ?
+      rb_hash_aref(rb_ary_entry(vinput_layers, i), ID2SYM(id_name)) :
+      rb_ary_entry(voutput_layers, i - input_layer_num);
+    vname = rb_str_new_frozen(vname);
+    const char *name = StringValueCStr(vname);
+    model_variable *var = &p->variables[i];
+
+    var->vname = vname;
+    p->variable_num = i + 1;
+    ERROR_CHECK(menoh_model_get_variable_dtype(model, name, &var->dtype));
+    ERROR_CHECK(menoh_model_get_variable_buffer_handle(model, name, &var->buf));
+    ERROR_CHECK(menoh_model_get_variable_dims_size(model, name, &var->dims_length));
+    var->dims = (int32_t *)ruby_xmalloc2(var->dims_length, sizeof(int32_t));
+    var->buffer_length = 1;
+    for (int32_t j = 0; j < var->dims_length; j++) {
+      ERROR_CHECK(menoh_model_get_variable_dims_at(model, name, j, &var->dims[j]));
+      var->buffer_length *= var->dims[j];
+    }
+    var->size = (size_t)var->buffer_length * dtype_size(var->dtype);
+    for (int32_t j = 0; j < p->external_buffer_num; j++) {
+      if (strcmp(RSTRING_PTR(p->external_buffers[j].vname), name) == 0)
+        var->external = &p->external_buffers[j];
+    }
+    // first touch from the placement's CPUs (arenas were zeroed already)
+    if (p->placement != NULL && var->external == NULL)
+      memset(var->buf, 0, var->size);
   }
-
-  return Qnil;
 }
 
-static VALUE wrap_model_init(VALUE self, VALUE vonnx, VALUE option) {
-  // option
-  menoh_model_data_handle model_data = getONNX(vonnx)->model_data;
+struct model_init_arg {
+  VALUE self;
+  VALUE option;
+  menoh_ruby *onnx;
+  void *saved_affinity;
+  model_build build;
+};
+
+static VALUE model_init_body(VALUE arg) {
+  VALUE self = ((struct model_init_arg *)arg)->self;
+  VALUE option = ((struct model_init_arg *)arg)->option;
+  menoh_ruby *onnx = ((struct model_init_arg *)arg)->onnx;
+  model_build *b = &((struct model_init_arg *)arg)->build;
+  menohModel *p = getModel(self);
+  b->model_data = onnx->model_data;
+  if (b->model_data == NULL)
+    rb_raise(eError, "the model data was released");
+  p->weights_size = onnx->model_data_size;
 
   // option
-  VALUE vinput_layers =
-      rb_hash_aref(option, ID2SYM(id_input_layers));
-  VALUE voutput_layers =
-      rb_hash_aref(option, ID2SYM(id_output_layers));
-  getModel(self)->vinput_layers = vinput_layers;
-  getModel(self)->voutput_layers = voutput_layers;
-
-  // get vpt builder
-  menoh_variable_profile_table_builder_handle vpt_builder;
-  ERROR_CHECK(
-      menoh_make_variable_profile_table_builder(&vpt_builder));
+  p->vinput_layers = rb_hash_aref(option, ID2SYM(id_input_layers));
+  p->voutput_layers = rb_hash_aref(option, ID2SYM(id_output_layers));
+  VALUE vbackend = rb_hash_aref(option, ID2SYM(id_backend));
+  VALUE vbackend_config = rb_hash_aref(option, ID2SYM(id_backend_config));
+  b->backend = ruby_strdup(StringValueCStr(vbackend));
+  b->backend_config = ruby_strdup(NIL_P(vbackend_config) ? "" : StringValueCStr(vbackend_config));
+  b->model = &p->model;
 
   // build variable profile table
-  struct build_vpt_arg build_vpt_arg = {
-    .self = self,
-    .vinput_layers = vinput_layers,
-    .voutput_layers = voutput_layers,
-    .model_data = model_data,
-    .vpt_builder = vpt_builder
-  };
-  menoh_variable_profile_table_handle variable_profile_table =
-    (menoh_variable_profile_table_handle)
-    rb_ensure(build_vpt, (VALUE)&build_vpt_arg, vpt_builder_free, (VALUE)vpt_builder);
-
-  // optimize
-  menoh_error_code ec =
-      menoh_model_data_optimize(model_data, variable_profile_table);
-  if (ec != menoh_error_code_success)
-    menoh_delete_variable_profile_table(variable_profile_table);
-  ERROR_CHECK(ec);
-
-  // get model buildler
-  menoh_model_builder_handle model_builder;
-  ec = menoh_make_model_builder(variable_profile_table, &model_builder);
-  menoh_delete_variable_profile_table(variable_profile_table);
-  ERROR_CHECK(ec);
+  ERROR_CHECK(menoh_make_variable_profile_table_builder(&b->vpt_builder));
+  add_profiles(self, b);
+  rb_thread_call_without_gvl(build_vpt, b, NULL, NULL);
+  ERROR_CHECK(b->err);
+
+  // prepare external buffers
+  VALUE vexternal_buffers =
+      rb_hash_aref(option, ID2SYM(id_external_buffers));
+  if (!NIL_P(vexternal_buffers))
+    prepare_external_buffers(self, vexternal_buffers, b->vpt);
+
+  // get model buildler and attach external buffers
+  ERROR_CHECK(menoh_make_model_builder(b->vpt, &b->model_builder));
+  for (int32_t i = 0; i < p->external_buffer_num; i++) {
+    ERROR_CHECK(menoh_model_builder_attach_external_buffer(
+                    b->model_builder, RSTRING_PTR(p->external_buffers[i].vname),
+                    p->external_buffers[i].ptr));
+  }
 
   // build model
-  struct build_model_arg build_model_arg = {
-    .self = self,
-    .option = option,
-    .model_data = model_data,
-    .model_builder = model_builder
-  };
-  rb_ensure(build_model, (VALUE)&build_model_arg, model_builder_free, (VALUE)model_builder);
+  rb_thread_call_without_gvl(build_backend_model, b, NULL, NULL);
+  ERROR_CHECK(b->err);
+  build_binding_plan(self);
+
+  // the rest of the model lives in ruby_xmalloc'ed memory
+  model_memory m = model_memory_usage(p);
+  p->reported_memsize = m.weights + m.buffers + m.arenas;
+  adjust_memory_usage((ssize_t)p->reported_memsize);
 
   return Qnil;
 }
 
+static VALUE model_init_ensure(VALUE arg) {
+  struct model_init_arg *arg2 = (struct model_init_arg *)arg;
+  model_build *b = &arg2->build;
+  if (b->model_builder != NULL) menoh_delete_model_builder(b->model_builder);
+  if (b->vpt != NULL) menoh_delete_variable_profile_table(b->vpt);
+  if (b->vpt_builder != NULL) menoh_delete_variable_profile_table_builder(b->vpt_builder);
+  ruby_xfree(b->backend);
+  ruby_xfree(b->backend_config);
+  placement_leave(arg2->saved_affinity);
+  return unlock_model_data((VALUE)arg2->onnx);
+}
 
-static VALUE get_buffer_dtype(VALUE self, VALUE name) {
-  menoh_dtype dtype;
-  ERROR_CHECK(menoh_model_get_variable_dtype(getModel(self)->model, StringValueCStr(name), &dtype));
+// Building a model optimizes model_data in place, so builds from one
+// Menoh::Menoh take turns, also when they run in different Ractors. A model
+// with a placement is built on its CPUs so that its memory is local to them.
+// Other Ruby threads keep running while the model is optimized and built.
+static VALUE wrap_model_init(VALUE self, VALUE vonnx, VALUE option) {
+  menoh_ruby *onnx = getONNX(vonnx);
+  menohModel *p = getModel(self);
+  p->placement = make_placement(rb_hash_aref(option, ID2SYM(id_placement)));
+  struct model_init_arg arg = {
+    .self = self,
+    .option = option,
+    .onnx = onnx,
+    .saved_affinity = NULL,
+  };
+  lock_model_data(onnx);
+  arg.saved_affinity = placement_enter(p->placement);
+  return rb_ensure(model_init_body, (VALUE)&arg, model_init_ensure, (VALUE)&arg);
+}
 
+
+VALUE dtype_symbol(menoh_dtype dtype) {
   switch (dtype) {
   case menoh_dtype_float:
     return ID2SYM(id_float32);
@@ -466,44 +991,144 @@ static VALUE get_buffer_dtype(VALUE self, VALUE name) {
 }
 
 
-static int32_t get_buffer_length(VALUE self, const char *name) {
-  int32_t dims_length;
-  int32_t buffer_length = 1;
-  ERROR_CHECK(menoh_model_get_variable_dims_size(getModel(self)->model, name, &dims_length));
-  for (int32_t i = 0; i < dims_length; i++) {
-    int32_t tmp;
-    ERROR_CHECK(menoh_model_get_variable_dims_at(getModel(self)->model, name, i, &tmp));
-    buffer_length *= tmp;
+// Variables are addressed by name or by index into the binding plan
+// (inputs first, then outputs; see MenohModel#variable_index).
+model_variable *get_variable(VALUE self, VALUE vname) {
+  menohModel *p = getModel(self);
+  model_variable *var = NULL;
+
+  if (FIXNUM_P(vname)) {
+    long index = FIX2LONG(vname);
+    if (index < 0 || index >= p->variable_num)
+      rb_raise(eIndexOutOfRange, "variable index out of range: %ld", index);
+    var = &p->variables[index];
+  } else {
+    const char *name = StringValueCStr(vname);
+    long name_length = RSTRING_LEN(vname);
+    for (int32_t i = 0; i < p->variable_num; i++) {
+      VALUE vvar_name = p->variables[i].vname;
+      if (RSTRING_LEN(vvar_name) == name_length &&
+          memcmp(RSTRING_PTR(vvar_name), name, name_length) == 0) {
+        var = &p->variables[i];
+        break;
+      }
+    }
+    if (var == NULL)
+      rb_raise(eVariableNotFound, "variable not found: %s", name);
   }
-  return buffer_length;
+
+  check_external_buffer(var->external);
+  return var;
+}
+
+
+static VALUE get_buffer_dtype(VALUE self, VALUE vname) {
+  return dtype_symbol(get_variable(self, vname)->dtype);
 }
 
 
 static VALUE get_shape(VALUE self, VALUE vname) {
-  const char *name = StringValueCStr(vname);
-  int32_t dims_length;
+  model_variable *var = get_variable(self, vname);
 
-  ERROR_CHECK(menoh_model_get_variable_dims_size(getModel(self)->model, name, &dims_length));
-  VALUE shape = rb_ary_new2(dims_length);
-  for (int32_t i = 0; i < dims_length; i++) {
-    int32_t tmp;
-    ERROR_CHECK(menoh_model_get_variable_dims_at(getModel(self)->model, name, i, &tmp));
-    rb_ary_push(shape, INT2FIX(tmp));
-  }
+  VALUE shape = rb_ary_new2(var->dims_length);
+  for (int32_t i = 0; i < var->dims_length; i++)
+    rb_ary_push(shape, INT2FIX(var->dims[i]));
 
   return shape;
 }
 
 
-static VALUE set_data(VALUE self, VALUE vname, VALUE data) {
-  const char *name = StringValueCStr(vname);
-  menoh_dtype dtype;
-  void *buf;
+static VALUE get_variable_index(VALUE self, VALUE vname) {
+  return INT2FIX(get_variable(self, vname) - getModel(self)->variables);
+}
+
+
+#ifdef HAVE_RUBY_MEMORY_VIEW_H
+static elem_type format_elem_type(const char *format, ssize_t item_size) {
+  // NULL format means unsigned bytes
+  if (format == NULL) return elem_type_uint8;
+  // native byte order and alignment prefixes
+  if (*format == '@' || *format == '=' ||
+#ifdef WORDS_BIGENDIAN
+      *format == '>'
+#else
+      *format == '<'
+#endif
+      )
+    format++;
+  if (format[0] == '\0' || format[1] != '\0') return elem_type_unknown;
+
+  elem_type type;
+  ssize_t size;
+  switch (format[0]) {
+  case 'C': type = elem_type_uint8;   size = 1; break;
+  case 'c': type = elem_type_int8;    size = 1; break;
+  case 's': type = elem_type_int16;   size = 2; break;
+  case 'l': type = elem_type_int32;   size = 4; break;
+  case 'q': type = elem_type_int64;   size = 8; break;
+  case 'f': type = elem_type_float32; size = 4; break;
+  case 'd': type = elem_type_float64; size = 8; break;
+  default:  return elem_type_unknown;
+  }
+  return size == item_size ? type : elem_type_unknown;
+}
 
-  ERROR_CHECK(menoh_model_get_variable_dtype(getModel(self)->model, name, &dtype));
-  ERROR_CHECK(menoh_model_get_variable_buffer_handle(getModel(self)->model, name, &buf));
+static VALUE set_data_memory_view(model_variable *var, VALUE data) {
+  menoh_dtype dtype = var->dtype;
+  void *buf = var->buf;
+  int32_t buffer_length = var->buffer_length;
+  elem_type dst_type = dtype_elem_type(dtype);
+  if (dst_type == elem_type_unknown)
+    rb_raise(eInvalidDType, "unsupported dtype for memory view: %d", (int)dtype);
+
+  rb_memory_view_t view;
+  if (!rb_memory_view_get(data, &view, RUBY_MEMORY_VIEW_ROW_MAJOR | RUBY_MEMORY_VIEW_FORMAT))
+    rb_raise(rb_eArgError, "unable to get a row-major contiguous memory view");
+
+  elem_type src_type = format_elem_type(view.format, view.item_size);
+  ssize_t data_length = view.item_size > 0 ? view.byte_size / view.item_size : 0;
+  // strides are only filled for multi-dimensional views
+  bool contiguous = view.strides == NULL || rb_memory_view_is_row_major_contiguous(&view);
+  if (src_type == elem_type_unknown || !contiguous) {
+    VALUE vformat = rb_str_new_cstr(view.format ? view.format : "C");
+    rb_memory_view_release(&view);
+    rb_raise(rb_eArgError, "unsupported memory view format: %s",
+             StringValueCStr(vformat));
+  }
+  if (data_length != buffer_length) {
+    rb_memory_view_release(&view);
+    rb_raise(rb_eArgError, "wrong memory view length at (expected %ld, was %ld)",
+             (long)buffer_length, (long)data_length);
+  }
+
+  if (src_type == dst_type)
+    memcpy(buf, view.data, view.byte_size);
+  else
+    convert_elements(buf, dst_type, view.data, src_type, buffer_length);
+  rb_memory_view_release(&view);
+
+  return Qnil;
+}
+#endif
 
-  int32_t buffer_length = get_buffer_length(self, name);
+
+static VALUE set_data(VALUE self, VALUE vname, VALUE data) {
+  uint64_t started = stats_now();
+  model_variable *var = get_variable(self, vname);
+
+#ifdef HAVE_RUBY_MEMORY_VIEW_H
+  // e.g. Numo::NArray or another model's variable view
+  if (!RB_TYPE_P(data, T_ARRAY) && rb_memory_view_available_p(data)) {
+    set_data_memory_view(var, data);
+    stats_record(self, stats_stage_input, stats_now() - started, var->size);
+    return Qnil;
+  }
+#endif
+  Check_Type(data, T_ARRAY);
+
+  menoh_dtype dtype = var->dtype;
+  void *buf = var->buf;
+  int32_t buffer_length = var->buffer_length;
   int32_t data_length = NUM2INT(rb_funcall(data, id_length, 0));
   if (data_length != buffer_length)
       rb_raise(rb_eArgError, "wrong array length at (expected %ld, was %ld)",
@@ -517,7 +1142,10 @@ static VALUE set_data(VALUE self, VALUE vname, VALUE data) {
     break;
 #ifdef HAVE_CONST_MENOH_DTYPE_FLOAT64
   case menoh_dtype_float16:
-    rb_raise(eInvalidDType, "float16 is not supported yet");
+    for (int32_t j = 0; j < buffer_length; j++) {
+      ((uint16_t*)buf)[j] = float_to_half((float)(NUM2DBL(rb_ary_entry(data, j))));
+    }
+    break;
   case menoh_dtype_float64:
     for (int32_t j = 0; j < buffer_length; j++) {
       ((double*)buf)[j] = (double)(NUM2DBL(rb_ary_entry(data, j)));
@@ -548,136 +1176,757 @@ static VALUE set_data(VALUE self, VALUE vname, VALUE data) {
     rb_raise(eInvalidDType, "unknown dtype: %d", (int)dtype);
   }
 
+  stats_record(self, stats_stage_input, stats_now() - started, var->size);
   return Qnil;
 }
 
 
-static VALUE set_data_str(VALUE self, VALUE vname, VALUE data) {
-  const char *name = StringValueCStr(vname);
-  menoh_dtype dtype;
-  void *buf;
-
-  ERROR_CHECK(menoh_model_get_variable_dtype(getModel(self)->model, name, &dtype));
-  ERROR_CHECK(menoh_model_get_variable_buffer_handle(getModel(self)->model, name, &buf));
-
-  int32_t buffer_length = get_buffer_length(self, name);
-  int32_t elem_size = dtype_size(dtype);
+// set_data_str(name, data, src_dtype = nil) copies binary data in the
+// variable's dtype, or converts it from src_dtype (e.g. :uint8, :float16).
+static VALUE set_data_str(int argc, VALUE *argv, VALUE self) {
+  VALUE vname, data, vsrc_dtype;
+  rb_scan_args(argc, argv, "21", &vname, &data, &vsrc_dtype);
+  uint64_t started = stats_now();
+  model_variable *var = get_variable(self, vname);
 
   StringValue(data);
-  if (RSTRING_LEN(data) != buffer_length * elem_size)
+  if (NIL_P(vsrc_dtype)) {
+    if ((size_t)RSTRING_LEN(data) != var->size)
       rb_raise(rb_eArgError, "wrong string length at (expected %zu, was %zu)",
-               (size_t)(buffer_length * elem_size), RSTRING_LEN(data));
-  memcpy(buf, RSTRING_PTR(data), buffer_length * elem_size);
+               var->size, RSTRING_LEN(data));
+    memcpy(var->buf, RSTRING_PTR(data), var->size);
+    stats_record(self, stats_stage_input, stats_now() - started, var->size);
+    return Qnil;
+  }
 
+  elem_type dst_type = dtype_elem_type(var->dtype);
+  elem_type src_type = get_elem_type(vsrc_dtype);
+  if (dst_type == elem_type_unknown)
+    rb_raise(eInvalidDType, "unknown dtype: %d", (int)var->dtype);
+  size_t size = var->buffer_length * elem_size(src_type);
+  if ((size_t)RSTRING_LEN(data) != size)
+    rb_raise(rb_eArgError, "wrong string length at (expected %zu, was %zu)",
+             size, RSTRING_LEN(data));
+  convert_string(var->buf, dst_type, data, src_type, var->buffer_length);
+
+  stats_record(self, stats_stage_input, stats_now() - started, size);
   return Qnil;
 }
 
 
-static VALUE get_data(VALUE self, VALUE vname) {
-  const char *name = StringValueCStr(vname);
-  menoh_dtype dtype;
-  void *buf;
-
-  ERROR_CHECK(menoh_model_get_variable_dtype(getModel(self)->model, name, &dtype));
-  ERROR_CHECK(menoh_model_get_variable_buffer_handle(getModel(self)->model, name, &buf));
-  int32_t buffer_length = get_buffer_length(self, name);
-
-  // Convert result to Ruby Array
-  VALUE vresult_buffer = rb_ary_new();
+// Stores n elements of buf into vary from index pos on.
+static void store_elements(VALUE vary, long pos, menoh_dtype dtype,
+                           const void *buf, long n) {
   switch (dtype) {
   case menoh_dtype_float:
-    for (int32_t j = 0; j < buffer_length; j++) {
-      rb_ary_push(vresult_buffer, DBL2NUM(((float*)buf)[j]));
+    for (long j = 0; j < n; j++) {
+      rb_ary_store(vary, pos + j, DBL2NUM(((const float*)buf)[j]));
     }
     break;
 #ifdef HAVE_CONST_MENOH_DTYPE_FLOAT64
   case menoh_dtype_float16:
-    rb_raise(eInvalidDType, "float16 is not supported yet");
+    for (long j = 0; j < n; j++) {
+      rb_ary_store(vary, pos + j, DBL2NUM(half_to_float(((const uint16_t*)buf)[j])));
+    }
+    break;
   case menoh_dtype_float64:
-    for (int32_t j = 0; j < buffer_length; j++) {
-      rb_ary_push(vresult_buffer, DBL2NUM(((double*)buf)[j]));
+    for (long j = 0; j < n; j++) {
+      rb_ary_store(vary, pos + j, DBL2NUM(((const double*)buf)[j]));
     }
     break;
   case menoh_dtype_int8:
-    for (int32_t j = 0; j < buffer_length; j++) {
-      rb_ary_push(vresult_buffer, INT2NUM(((int8_t*)buf)[j]));
+    for (long j = 0; j < n; j++) {
+      rb_ary_store(vary, pos + j, INT2NUM(((const int8_t*)buf)[j]));
     }
     break;
   case menoh_dtype_int16:
-    for (int32_t j = 0; j < buffer_length; j++) {
-      rb_ary_push(vresult_buffer, INT2NUM(((int16_t*)buf)[j]));
+    for (long j = 0; j < n; j++) {
+      rb_ary_store(vary, pos + j, INT2NUM(((const int16_t*)buf)[j]));
     }
     break;
   case menoh_dtype_int32:
-    for (int32_t j = 0; j < buffer_length; j++) {
-      rb_ary_push(vresult_buffer, INT2NUM(((int32_t*)buf)[j]));
+    for (long j = 0; j < n; j++) {
+      rb_ary_store(vary, pos + j, INT2NUM(((const int32_t*)buf)[j]));
     }
     break;
   case menoh_dtype_int64:
-    for (int32_t j = 0; j < buffer_length; j++) {
-      rb_ary_push(vresult_buffer, LONG2NUM(((int64_t*)buf)[j]));
+    for (long j = 0; j < n; j++) {
+      rb_ary_store(vary, pos + j, LONG2NUM(((const int64_t*)buf)[j]));
     }
     break;
 #endif
   default:
     rb_raise(eInvalidDType, "unknown dtype: %d", (int)dtype);
   }
+}
 
+// Stores the elements of the variable into vary, reusing its capacity.
+static void fill_array(VALUE vary, const model_variable *var) {
+  if (RARRAY_LEN(vary) > var->buffer_length) rb_ary_resize(vary, var->buffer_length);
+  store_elements(vary, 0, var->dtype, var->buf, var->buffer_length);
+}
+
+static VALUE get_data(VALUE self, VALUE vname) {
+  uint64_t started = stats_now();
+  model_variable *var = get_variable(self, vname);
+
+  // Convert result to Ruby Array
+  VALUE vresult_buffer = rb_ary_new_capa(var->buffer_length);
+  fill_array(vresult_buffer, var);
+
+  stats_record(self, stats_stage_output, stats_now() - started, var->size);
   return vresult_buffer;
 }
 
+// get_data_into(name, buffer) copies the variable into a caller-owned
+// buffer and returns it: the binary data in the variable's dtype for a
+// String, the elements for an Array. The buffer is resized only when its
+// size differs, so a buffer reused across runs allocates nothing.
+static VALUE get_data_into(VALUE self, VALUE vname, VALUE vbuffer) {
+  uint64_t started = stats_now();
+  model_variable *var = get_variable(self, vname);
+
+  if (RB_TYPE_P(vbuffer, T_STRING)) {
+    if ((size_t)RSTRING_LEN(vbuffer) != var->size)
+      rb_str_resize(vbuffer, var->size);
+    rb_str_modify(vbuffer);
+    memcpy(RSTRING_PTR(vbuffer), var->buf, var->size);
+  } else if (RB_TYPE_P(vbuffer, T_ARRAY)) {
+    rb_check_frozen(vbuffer);
+    fill_array(vbuffer, var);
+  } else {
+    rb_raise(rb_eTypeError, "wrong buffer type %s (expected String or Array)",
+             rb_obj_classname(vbuffer));
+  }
 
-static VALUE get_data_str(VALUE self, VALUE vname) {
-  const char *name = StringValueCStr(vname);
-  menoh_dtype dtype;
-  void *buf;
+  stats_record(self, stats_stage_output, stats_now() - started, var->size);
+  return vbuffer;
+}
+
+
+// get_data_str(name, dtype = nil) returns the binary data in the variable's
+// dtype, or converted into dtype.
+static VALUE get_data_str(int argc, VALUE *argv, VALUE self) {
+  VALUE vname, vdtype;
+  rb_scan_args(argc, argv, "11", &vname, &vdtype);
+  uint64_t started = stats_now();
+  model_variable *var = get_variable(self, vname);
+
+  if (NIL_P(vdtype)) {
+    VALUE vresult = rb_str_new(var->buf, var->size);
+    stats_record(self, stats_stage_output, stats_now() - started, var->size);
+    return vresult;
+  }
+
+  elem_type src_type = dtype_elem_type(var->dtype);
+  elem_type dst_type = get_elem_type(vdtype);
+  if (src_type == elem_type_unknown)
+    rb_raise(eInvalidDType, "unknown dtype: %d", (int)var->dtype);
+  VALUE vresult = rb_str_new(NULL, var->buffer_length * elem_size(dst_type));
+  // the new String is not shared yet, so only the size decides the GVL
+  if (var->size < CONVERT_WITHOUT_GVL_MIN_SIZE) {
+    convert_elements(RSTRING_PTR(vresult), dst_type, var->buf, src_type, var->buffer_length);
+  } else {
+    struct convert_arg arg = {
+      .dst = RSTRING_PTR(vresult),
+      .dst_type = dst_type,
+      .src = var->buf,
+      .src_type = src_type,
+      .n = var->buffer_length,
+      .vsrc = Qnil,
+    };
+    rb_thread_call_without_gvl(convert_without_gvl, &arg, NULL, NULL);
+  }
+
+  stats_record(self, stats_stage_output, stats_now() - started, (size_t)RSTRING_LEN(vresult));
+  return vresult;
+}
+
+
+// Indices taken along one dimension of a slice: count of them from start,
+// step apart.
+typedef struct slice_dim {
+  long start;
+  long count;
+  long step;
+} slice_dim;
+
+// Resolves index_ranges against the dims of the variable. Each entry selects
+// along one dimension: an Integer one index, a Range a run of indices, an
+// arithmetic sequence (e.g. (0..).step(4)) every step-th index and nil the
+// whole dimension. Dimensions past the entries are taken whole. Returns the
+// number of elements in the slice.
+static long resolve_slice(const model_variable *var, VALUE vranges, slice_dim *dims) {
+  const char *name = RSTRING_PTR(var->vname);
+  Check_Type(vranges, T_ARRAY);
+  if (RARRAY_LEN(vranges) > var->dims_length)
+    rb_raise(rb_eArgError, "too many index ranges for '%s' (expected at most %d, was %ld)",
+             name, (int)var->dims_length, RARRAY_LEN(vranges));
+
+  long total = 1;
+  for (int32_t i = 0; i < var->dims_length; i++) {
+    long dim = var->dims[i];
+    VALUE vrange = i < RARRAY_LEN(vranges) ? RARRAY_AREF(vranges, i) : Qnil;
+    slice_dim *d = &dims[i];
+    long len;
+    d->step = 1;
+    if (NIL_P(vrange)) {
+      d->start = 0;
+      d->count = dim;
+    } else if (RB_INTEGER_TYPE_P(vrange)) {
+      long index = NUM2LONG(vrange);
+      if (index < 0) index += dim;
+      if (index < 0 || index >= dim)
+        rb_raise(rb_eIndexError, "index %ld out of dimension %d of '%s' (size %ld)",
+                 NUM2LONG(vrange), (int)i, name, dim);
+      d->start = index;
+      d->count = 1;
+    } else {
+      // ends past the dimension are clipped as Array#[] does, nil means the
+      // range starts outside of it
+#ifdef HAVE_RB_ARITHMETIC_SEQUENCE_BEG_LEN_STEP
+      VALUE res = rb_arithmetic_sequence_beg_len_step(vrange, &d->start, &len, &d->step,
+                                                      dim, 0);
+#else
+      VALUE res = rb_range_beg_len(vrange, &d->start, &len, dim, 0);
+#endif
+      if (res == Qfalse)
+        rb_raise(rb_eTypeError, "wrong index range type %s for dimension %d of '%s'",
+                 rb_obj_classname(vrange), (int)i, name);
+      if (NIL_P(res))
+        rb_raise(rb_eRangeError, "%"PRIsVALUE" out of dimension %d of '%s' (size %ld)",
+                 rb_inspect(vrange), (int)i, name, dim);
+      if (d->step < 1)
+        rb_raise(rb_eArgError, "step must be positive for dimension %d of '%s'",
+                 (int)i, name);
+      d->count = (len + d->step - 1) / d->step;
+    }
+    total *= d->count;
+  }
+  return total;
+}
+
+// Calls copy for each contiguous run of elements in the slice, in row-major
+// order, with the element offset of the run in the variable buffer. Trailing
+// dimensions taken whole, and the dimension before them when its step is 1,
+// are merged into a single run.
+static void each_slice_run(const model_variable *var, const slice_dim *dims,
+                           void (*copy)(void *ctx, long offset, long n), void *ctx) {
+  int32_t outer = var->dims_length;
+  long *strides = ALLOCA_N(long, outer + 1);
+  long run = 1;
+  for (int32_t i = outer - 1; i >= 0; i--) {
+    strides[i] = run;
+    run *= var->dims[i];
+    if (dims[i].count == 0) return;
+  }
+
+  run = 1;
+  while (outer > 0 && dims[outer - 1].count == var->dims[outer - 1] &&
+         dims[outer - 1].step == 1)
+    run *= var->dims[--outer];
+  long base = 0;
+  if (outer > 0 && dims[outer - 1].step == 1) {
+    outer--;
+    base = dims[outer].start * strides[outer];
+    run *= dims[outer].count;
+  }
+
+  long *index = ALLOCA_N(long, outer + 1);
+  memset(index, 0, sizeof(long) * (outer + 1));
+  for (;;) {
+    long offset = base;
+    for (int32_t i = 0; i < outer; i++)
+      offset += (dims[i].start + index[i] * dims[i].step) * strides[i];
+    copy(ctx, offset, run);
+
+    int32_t i = outer - 1;
+    while (i >= 0 && ++index[i] == dims[i].count) index[i--] = 0;
+    if (i < 0) break;
+  }
+}
+
+struct slice_array_ctx {
+  VALUE vary;
+  long pos;
+  const model_variable *var;
+};
+
+static void copy_slice_array(void *ctx, long offset, long n) {
+  struct slice_array_ctx *c = ctx;
+  store_elements(c->vary, c->pos, c->var->dtype,
+                 (const char *)c->var->buf + offset * dtype_size(c->var->dtype), n);
+  c->pos += n;
+}
+
+// get_data_slice(name, index_ranges) returns the elements of the region of
+// the variable selected by index_ranges (see resolve_slice), flattened in
+// row-major order. Only the selected elements are converted, e.g.
+// get_data_slice(name, [3]) for the fourth sample of a batch.
+static VALUE get_data_slice(VALUE self, VALUE vname, VALUE vranges) {
+  uint64_t started = stats_now();
+  model_variable *var = get_variable(self, vname);
+  slice_dim *dims = ALLOCA_N(slice_dim, var->dims_length + 1);
+  long total = resolve_slice(var, vranges, dims);
+
+  struct slice_array_ctx ctx = {
+    .vary = rb_ary_new_capa(total),
+    .pos = 0,
+    .var = var,
+  };
+  each_slice_run(var, dims, copy_slice_array, &ctx);
+
+  stats_record(self, stats_stage_output, stats_now() - started,
+               (size_t)total * dtype_size(var->dtype));
+  return ctx.vary;
+}
+
+struct slice_str_ctx {
+  char *dst;
+  elem_type dst_type;
+  const model_variable *var;
+  elem_type src_type;
+};
+
+static void copy_slice_str(void *ctx, long offset, long n) {
+  struct slice_str_ctx *c = ctx;
+  const char *src = (const char *)c->var->buf + offset * dtype_size(c->var->dtype);
+  if (c->dst_type == elem_type_unknown) {
+    size_t size = (size_t)n * dtype_size(c->var->dtype);
+    memcpy(c->dst, src, size);
+    c->dst += size;
+  } else {
+    convert_elements(c->dst, c->dst_type, src, c->src_type, (size_t)n);
+    c->dst += (size_t)n * elem_size(c->dst_type);
+  }
+}
+
+// get_data_slice_str(name, index_ranges, dtype = nil) returns the region
+// selected as by get_data_slice packed into a binary String, in the
+// variable's dtype or converted into dtype.
+static VALUE get_data_slice_str(int argc, VALUE *argv, VALUE self) {
+  VALUE vname, vranges, vdtype;
+  rb_scan_args(argc, argv, "21", &vname, &vranges, &vdtype);
+  uint64_t started = stats_now();
+  model_variable *var = get_variable(self, vname);
+  slice_dim *dims = ALLOCA_N(slice_dim, var->dims_length + 1);
+  long total = resolve_slice(var, vranges, dims);
+
+  struct slice_str_ctx ctx = {
+    .var = var,
+    .dst_type = elem_type_unknown,
+    .src_type = dtype_elem_type(var->dtype),
+  };
+  size_t item_size = dtype_size(var->dtype);
+  if (!NIL_P(vdtype)) {
+    if (ctx.src_type == elem_type_unknown)
+      rb_raise(eInvalidDType, "unknown dtype: %d", (int)var->dtype);
+    ctx.dst_type = get_elem_type(vdtype);
+    item_size = elem_size(ctx.dst_type);
+  }
+  VALUE vresult = rb_str_new(NULL, (size_t)total * item_size);
+  ctx.dst = RSTRING_PTR(vresult);
+  each_slice_run(var, dims, copy_slice_str, &ctx);
+
+  stats_record(self, stats_stage_output, stats_now() - started, (size_t)RSTRING_LEN(vresult));
+  return vresult;
+}
+
+
+
+// Menoh::VariableView exposes a variable buffer without copying it. It keeps
+// the model alive and exports the buffer through the MemoryView protocol.
+typedef struct variable_view {
+  VALUE vmodel;
+  model_variable *var;
+  ssize_t *shape;
+  ssize_t *strides;
+} variable_view;
+
+static void wrap_variable_view_free(variable_view *);
+static void wrap_variable_view_mark(variable_view *);
+
+static const rb_data_type_t variable_view_data_type = {
+  "Menoh::VariableView",
+  {(void(*)(void*))wrap_variable_view_mark, (void(*)(void*))wrap_variable_view_free, NULL,},
+  0, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static variable_view *getVariableView(VALUE self) {
+  variable_view *p;
+  TypedData_Get_Struct(self, variable_view, &variable_view_data_type, p);
+  if (NIL_P(p->vmodel)) rb_raise(rb_eRuntimeError, "uninitialized variable view");
+  check_external_buffer(p->var->external);
+  return p;
+}
+
+static void wrap_variable_view_free(variable_view *p) {
+  ruby_xfree(p->shape);
+  ruby_xfree(p->strides);
+  ruby_xfree(p);
+}
+
+static void wrap_variable_view_mark(variable_view *p) {
+  rb_gc_mark(p->vmodel);
+}
+
+static VALUE wrap_variable_view_alloc(VALUE klass) {
+  variable_view *p = ruby_xmalloc(sizeof(variable_view));
+  memset(p, 0, sizeof(variable_view));
+  p->vmodel = Qnil;
+  return TypedData_Wrap_Struct(klass, &variable_view_data_type, p);
+}
+
+static VALUE cVariableView;
 
-  ERROR_CHECK(menoh_model_get_variable_dtype(getModel(self)->model, name, &dtype));
-  ERROR_CHECK(menoh_model_get_variable_buffer_handle(getModel(self)->model, name, &buf));
-  int32_t buffer_length = get_buffer_length(self, name);
-  int32_t elem_size = dtype_size(dtype);
+static VALUE get_data_view(VALUE self, VALUE vname) {
+  model_variable *var = get_variable(self, vname);
 
-  return rb_str_new(buf, buffer_length * elem_size);  
+  VALUE vview = wrap_variable_view_alloc(cVariableView);
+  variable_view *p = (variable_view *)RTYPEDDATA_DATA(vview);
+  p->shape = ruby_xmalloc2(var->dims_length, sizeof(ssize_t));
+  p->strides = ruby_xmalloc2(var->dims_length, sizeof(ssize_t));
+  ssize_t stride = dtype_size(var->dtype);
+  for (int32_t i = var->dims_length - 1; i >= 0; i--) {
+    p->shape[i] = var->dims[i];
+    p->strides[i] = stride;
+    stride *= var->dims[i];
+  }
+  p->var = var;
+  p->vmodel = self;
+
+  return vview;
+}
+
+static VALUE variable_view_name(VALUE self) {
+  return getVariableView(self)->var->vname;
+}
+
+static VALUE variable_view_dtype(VALUE self) {
+  return dtype_symbol(getVariableView(self)->var->dtype);
+}
+
+static VALUE variable_view_shape(VALUE self) {
+  model_variable *var = getVariableView(self)->var;
+  VALUE shape = rb_ary_new2(var->dims_length);
+  for (int32_t i = 0; i < var->dims_length; i++)
+    rb_ary_push(shape, INT2FIX(var->dims[i]));
+  return shape;
 }
 
+static VALUE variable_view_bytesize(VALUE self) {
+  return SIZET2NUM(getVariableView(self)->var->size);
+}
+
+static VALUE variable_view_to_s(VALUE self) {
+  model_variable *var = getVariableView(self)->var;
+  return rb_str_new(var->buf, var->size);
+}
+
+#ifdef HAVE_RUBY_MEMORY_VIEW_H
+static const char *dtype_format(menoh_dtype dtype) {
+  switch (dtype) {
+  case menoh_dtype_float:
+    return "f";
+#ifdef HAVE_CONST_MENOH_DTYPE_FLOAT64
+  case menoh_dtype_float64:
+    return "d";
+  case menoh_dtype_int8:
+    return "c";
+  case menoh_dtype_int16:
+    return "s";
+  case menoh_dtype_int32:
+    return "l";
+  case menoh_dtype_int64:
+    return "q";
+#endif
+  default:
+    return NULL;
+  }
+}
+
+static bool variable_view_get_memory_view(VALUE self, rb_memory_view_t *view, int flags) {
+  variable_view *p = getVariableView(self);
+  model_variable *var = p->var;
+  const char *format = dtype_format(var->dtype);
+  if (format == NULL) return false;
+
+  view->obj = self;
+  view->data = var->buf;
+  view->byte_size = (ssize_t)var->size;
+  view->readonly = false;
+  view->format = format;
+  view->item_size = dtype_size(var->dtype);
+  view->item_desc.components = NULL;
+  view->item_desc.length = 0;
+  view->ndim = var->dims_length;
+  view->shape = p->shape;
+  view->strides = p->strides;
+  view->sub_offsets = NULL;
+  view->private_data = NULL;
+  return true;
+}
+
+static bool variable_view_release_memory_view(VALUE self, rb_memory_view_t *view) {
+  return true;
+}
+
+static bool variable_view_memory_view_available_p(VALUE self) {
+  return dtype_format(getVariableView(self)->var->dtype) != NULL;
+}
+
+static const rb_memory_view_entry_t variable_view_memory_view_entry = {
+  variable_view_get_memory_view,
+  variable_view_release_memory_view,
+  variable_view_memory_view_available_p,
+};
+#endif
 
 
 struct model_run_arg {
+  menohModel *owner;
   menoh_model_handle model;
+  const model_placement *placement;
   menoh_error_code err;
 };
 
 static void *model_run(void *arg) {
   struct model_run_arg* arg2 = (struct model_run_arg*)arg;
+  void *saved = placement_enter(arg2->placement);
   arg2->err = menoh_model_run(arg2->model);
+  placement_leave(saved);
   return NULL;
 }
 
+static VALUE model_run_body(VALUE arg) {
+  rb_thread_call_without_gvl(model_run, (void *)arg, RUBY_UBF_IO, NULL);
+  return Qnil;
+}
+
+static VALUE model_run_unlock(VALUE arg) {
+  unlock_external_buffers(((struct model_run_arg *)arg)->owner);
+  return Qnil;
+}
+
+// Runs the model without the GVL, with its external Strings locked.
+static void run_model_without_gvl(struct model_run_arg *arg) {
+  lock_external_buffers(arg->owner);
+  rb_ensure(model_run_body, (VALUE)arg, model_run_unlock, (VALUE)arg);
+}
+
 static VALUE wrap_model_run(VALUE self) {
+  check_external_buffers(getModel(self));
+  check_no_async_run(getModel(self));
+
   // run model
   struct model_run_arg model_run_arg = {
+    .owner = getModel(self),
     .model = getModel(self)->model,
+    .placement = getModel(self)->placement,
     .err = menoh_error_code_success,
   };
-  rb_thread_call_without_gvl(model_run, &model_run_arg, RUBY_UBF_IO, NULL);
+  uint64_t started = stats_now();
+  run_model_without_gvl(&model_run_arg);
   ERROR_CHECK(model_run_arg.err);
+  stats_record(self, stats_stage_run, stats_now() - started, 0);
   return Qnil;
 }
 
+// native_warmup(runs) runs the model runs times on zeroed inputs and returns
+// the time of each run in seconds. Backends such as mkldnn create their
+// primitives and touch their memory on the first run, so this moves that
+// cost to build time. Inputs in external buffers are run as they are, and
+// the runs are not counted in the stats.
+static VALUE wrap_model_warmup(VALUE self, VALUE vruns) {
+  menohModel *p = getModel(self);
+  long runs = NUM2LONG(vruns);
+  if (runs < 0) rb_raise(rb_eArgError, "negative warmup runs: %ld", runs);
+  check_external_buffers(p);
+  check_no_async_run(p);
+
+  for (int32_t i = 0; i < p->input_layer_num; i++) {
+    model_variable *var = &p->variables[i];
+    if (var->external == NULL) memset(var->buf, 0, var->size);
+  }
+
+  VALUE vtimes = rb_ary_new_capa(runs);
+  for (long i = 0; i < runs; i++) {
+    struct model_run_arg model_run_arg = {
+      .owner = p,
+      .model = p->model,
+      .placement = p->placement,
+      .err = menoh_error_code_success,
+    };
+    uint64_t started = stats_now();
+    run_model_without_gvl(&model_run_arg);
+    ERROR_CHECK(model_run_arg.err);
+    rb_ary_push(vtimes, DBL2NUM((double)(stats_now() - started) / 1e9));
+  }
+  return vtimes;
+}
+
+struct raw_copy {
+  void *dst;
+  const void *src;
+  size_t size;
+};
+
+struct model_run_raw_arg {
+  menohModel *owner;
+  VALUE *vpinned;
+  VALUE vlocked;
+  long locked_num;
+  menoh_model_handle model;
+  const model_placement *placement;
+  struct raw_copy *inputs;
+  int32_t input_num;
+  struct raw_copy *outputs;
+  int32_t output_num;
+  menoh_error_code err;
+  uint64_t stage_ns[3]; // input, run and output
+};
+
+static void *model_run_raw(void *arg) {
+  struct model_run_raw_arg *arg2 = (struct model_run_raw_arg*)arg;
+  uint64_t t0 = stats_now();
+  for (int32_t i = 0; i < arg2->input_num; i++) {
+    if (arg2->inputs[i].dst != arg2->inputs[i].src)
+      memcpy(arg2->inputs[i].dst, arg2->inputs[i].src, arg2->inputs[i].size);
+  }
+  uint64_t t1 = stats_now();
+  void *saved = placement_enter(arg2->placement);
+  arg2->err = menoh_model_run(arg2->model);
+  placement_leave(saved);
+  if (arg2->err != menoh_error_code_success) return NULL;
+  uint64_t t2 = stats_now();
+  for (int32_t i = 0; i < arg2->output_num; i++)
+    memcpy(arg2->outputs[i].dst, arg2->outputs[i].src, arg2->outputs[i].size);
+  arg2->stage_ns[0] = t1 - t0;
+  arg2->stage_ns[1] = t2 - t1;
+  arg2->stage_ns[2] = stats_now() - t2;
+  return NULL;
+}
+
+static VALUE run_raw_body(VALUE arg) {
+  struct model_run_raw_arg *arg2 = (struct model_run_raw_arg*)arg;
+  for (long i = 0; i < RARRAY_LEN(arg2->vlocked); i++) {
+    rb_str_locktmp(RARRAY_AREF(arg2->vlocked, i));
+    arg2->locked_num = i + 1;
+  }
+  rb_thread_call_without_gvl(model_run_raw, arg2, RUBY_UBF_IO, NULL);
+  return Qnil;
+}
+
+static VALUE run_raw_unlock(VALUE arg) {
+  struct model_run_raw_arg *arg2 = (struct model_run_raw_arg*)arg;
+  for (long i = 0; i < arg2->locked_num; i++)
+    rb_str_unlocktmp(RARRAY_AREF(arg2->vlocked, i));
+  unlock_external_buffers(arg2->owner);
+  return Qnil;
+}
+
+// Copies the input Strings, runs the model and copies the outputs into new
+// Strings without the GVL. The input Strings are locked meanwhile so that
+// other threads cannot modify them.
+static VALUE wrap_model_run_raw(VALUE self, VALUE vinputs) {
+  menohModel *p = getModel(self);
+  Check_Type(vinputs, T_HASH);
+  check_external_buffers(p);
+  check_no_async_run(p);
+
+  VALUE vinput_pairs = rb_funcall(vinputs, id_to_a, 0);
+  int32_t input_num = (int32_t)RARRAY_LEN(vinput_pairs);
+  int32_t output_num = p->variable_num - p->input_layer_num;
+  struct raw_copy *inputs = ALLOCA_N(struct raw_copy, input_num);
+  struct raw_copy *outputs = ALLOCA_N(struct raw_copy, output_num);
+  // Strings held in this stack array are pinned by the conservative stack
+  // scan, so compaction cannot move them while their pointers are in use
+  VALUE *vpinned = ALLOCA_N(VALUE, input_num + output_num);
+  VALUE vlocked = rb_ary_new2(input_num);
+
+  for (int32_t i = 0; i < input_num; i++) {
+    VALUE vpair = RARRAY_AREF(vinput_pairs, i);
+    model_variable *var = get_variable(self, RARRAY_AREF(vpair, 0));
+    if (var - p->variables >= p->input_layer_num)
+      rb_raise(rb_eArgError, "not an input variable: %s", RSTRING_PTR(var->vname));
+    VALUE vdata = RARRAY_AREF(vpair, 1);
+    StringValue(vdata);
+    if ((size_t)RSTRING_LEN(vdata) != var->size)
+      rb_raise(rb_eArgError, "wrong string length for '%s' (expected %zu, was %zu)",
+               RSTRING_PTR(var->vname), var->size, (size_t)RSTRING_LEN(vdata));
+    vpinned[i] = vdata;
+    inputs[i].dst = var->buf;
+    inputs[i].src = RSTRING_PTR(vdata);
+    inputs[i].size = var->size;
+    // the same String may feed several inputs
+    if (!ary_includes_object(vlocked, vdata) && !external_string_p(p, vdata))
+      rb_ary_push(vlocked, vdata);
+  }
+
+  VALUE vresults = rb_hash_new();
+  for (int32_t i = 0; i < output_num; i++) {
+    model_variable *var = &p->variables[p->input_layer_num + i];
+    VALUE vresult = rb_str_new(NULL, var->size);
+    vpinned[input_num + i] = vresult;
+    rb_hash_aset(vresults, var->vname, vresult);
+    outputs[i].dst = RSTRING_PTR(vresult);
+    outputs[i].src = var->buf;
+    outputs[i].size = var->size;
+  }
+
+  struct model_run_raw_arg model_run_raw_arg = {
+    .owner = p,
+    .vpinned = vpinned,
+    .vlocked = vlocked,
+    .locked_num = 0,
+    .model = p->model,
+    .placement = p->placement,
+    .inputs = inputs,
+    .input_num = input_num,
+    .outputs = outputs,
+    .output_num = output_num,
+    .err = menoh_error_code_success,
+  };
+  lock_external_buffers(p);
+  rb_ensure(run_raw_body, (VALUE)&model_run_raw_arg,
+            run_raw_unlock, (VALUE)&model_run_raw_arg);
+  ERROR_CHECK(model_run_raw_arg.err);
+
+  size_t input_bytes = 0, output_bytes = 0;
+  for (int32_t i = 0; i < input_num; i++) input_bytes += inputs[i].size;
+  for (int32_t i = 0; i < output_num; i++) output_bytes += outputs[i].size;
+  stats_record(self, stats_stage_input, model_run_raw_arg.stage_ns[0], input_bytes);
+  stats_record(self, stats_stage_run, model_run_raw_arg.stage_ns[1], 0);
+  stats_record(self, stats_stage_output, model_run_raw_arg.stage_ns[2], output_bytes);
+
+  RB_GC_GUARD(vinput_pairs);
+  return rb_obj_freeze(vresults);
+}
+
 void Init_menoh_native() {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  // Ractor-local state lives in Ractor-local storage, and the rest of the
+  // globals are set once here
+  rb_ext_ractor_safe(true);
+#endif
+
   id_backend = rb_intern("backend");
   id_backend_config = rb_intern("backend_config");
   id_input_layers = rb_intern("input_layers");
   id_output_layers = rb_intern("output_layers");
+  id_external_buffers = rb_intern("external_buffers");
+  id_placement = rb_intern("placement");
   id_data = rb_intern("data");
   id_dims = rb_intern("dims");
   id_dtype = rb_intern("dtype");
   id_length = rb_intern("length");
   id_name = rb_intern("name");
   id_shape = rb_intern("shape");
+  id_to_a = rb_intern("to_a");
 
   id_float   = rb_intern("float");
   id_float16 = rb_intern("float16");
+  id_uint8 = rb_intern("uint8");
   id_float32 = rb_intern("float32");
   id_float64 = rb_intern("float64");
   id_int8    = rb_intern("int8");
@@ -692,6 +1941,16 @@ void Init_menoh_native() {
   rb_define_alloc_func(onnx, wrap_menoh_alloc);
   rb_define_private_method(onnx, "native_init",
                            RUBY_METHOD_FUNC(wrap_menoh_init), 1);
+#ifdef HAVE_MENOH_MAKE_MODEL_DATA_FROM_ONNX_DATA_ON_MEMORY
+  rb_define_private_method(onnx, "native_init_from_memory",
+                           RUBY_METHOD_FUNC(wrap_menoh_init_from_memory), 1);
+#ifdef HAVE_SYS_MMAN_H
+  rb_define_private_method(onnx, "native_init_from_mmap",
+                           RUBY_METHOD_FUNC(wrap_menoh_init_from_mmap), 1);
+#endif
+#endif
+  rb_define_method(onnx, "release", RUBY_METHOD_FUNC(wrap_menoh_release), 0);
+  rb_define_method(onnx, "released?", RUBY_METHOD_FUNC(wrap_menoh_released_p), 0);
 
   VALUE model = rb_define_class_under(mMenoh, "MenohModel", rb_cObject);
 
@@ -701,13 +1960,34 @@ void Init_menoh_native() {
 
   rb_define_private_method(model, "native_run",
                            RUBY_METHOD_FUNC(wrap_model_run), 0);
+  rb_define_private_method(model, "native_run_raw",
+                           RUBY_METHOD_FUNC(wrap_model_run_raw), 1);
+  rb_define_private_method(model, "native_warmup",
+                           RUBY_METHOD_FUNC(wrap_model_warmup), 1);
 
   rb_define_method(model, "set_data", RUBY_METHOD_FUNC(set_data), 2);
-  rb_define_method(model, "set_data_str", RUBY_METHOD_FUNC(set_data_str), 2);
+  rb_define_method(model, "set_data_str", RUBY_METHOD_FUNC(set_data_str), -1);
   rb_define_method(model, "get_data", RUBY_METHOD_FUNC(get_data), 1);
-  rb_define_method(model, "get_data_str", RUBY_METHOD_FUNC(get_data_str), 1);
+  rb_define_method(model, "get_data_str", RUBY_METHOD_FUNC(get_data_str), -1);
+  rb_define_method(model, "get_data_into", RUBY_METHOD_FUNC(get_data_into), 2);
+  rb_define_method(model, "get_data_slice", RUBY_METHOD_FUNC(get_data_slice), 2);
+  rb_define_method(model, "get_data_slice_str", RUBY_METHOD_FUNC(get_data_slice_str), -1);
   rb_define_method(model, "get_shape", RUBY_METHOD_FUNC(get_shape), 1);
   rb_define_method(model, "get_dtype", RUBY_METHOD_FUNC(get_buffer_dtype), 1);
+  rb_define_method(model, "get_data_view", RUBY_METHOD_FUNC(get_data_view), 1);
+  rb_define_method(model, "variable_index", RUBY_METHOD_FUNC(get_variable_index), 1);
+  rb_define_method(model, "memory_usage", RUBY_METHOD_FUNC(wrap_model_memory_usage), 0);
+
+  cVariableView = rb_define_class_under(mMenoh, "VariableView", rb_cObject);
+  rb_undef_alloc_func(cVariableView);
+  rb_define_method(cVariableView, "name", RUBY_METHOD_FUNC(variable_view_name), 0);
+  rb_define_method(cVariableView, "dtype", RUBY_METHOD_FUNC(variable_view_dtype), 0);
+  rb_define_method(cVariableView, "shape", RUBY_METHOD_FUNC(variable_view_shape), 0);
+  rb_define_method(cVariableView, "bytesize", RUBY_METHOD_FUNC(variable_view_bytesize), 0);
+  rb_define_method(cVariableView, "to_s", RUBY_METHOD_FUNC(variable_view_to_s), 0);
+#ifdef HAVE_RUBY_MEMORY_VIEW_H
+  rb_memory_view_register(cVariableView, &variable_view_memory_view_entry);
+#endif
 
   eError                          = rb_define_class_under(mMenoh, "Error", rb_eStandardError);
   eStdError                       = rb_define_class_under(mMenoh, "StdError", eError);
@@ -733,4 +2013,14 @@ void Init_menoh_native() {
   eInvalidBackendConfigError      = rb_define_class_under(mMenoh, "InvalidBackendConfigError", eError);
   eInputNotFoundError             = rb_define_class_under(mMenoh, "InputNotFoundError", eError);
   eOutputNotFoundError            = rb_define_class_under(mMenoh, "OutputNotFoundError", eError);
+
+  Init_menoh_batcher(mMenoh);
+  Init_menoh_async(mMenoh);
+  Init_menoh_image(mMenoh);
+  Init_menoh_tensor(mMenoh);
+  Init_menoh_postprocess(mMenoh);
+  Init_menoh_stats(mMenoh);
+  Init_menoh_placement(mMenoh);
+  Init_menoh_admission(mMenoh);
+  Init_menoh_stream(mMenoh);
 }
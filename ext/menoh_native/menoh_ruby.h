@@ -2,6 +2,155 @@
 #define MENOH_H 1
 
 #include <menoh/menoh.h>
+#include <pthread.h>
 #include <ruby.h>
+#ifdef HAVE_RUBY_RACTOR_H
+#include <ruby/ractor.h>
+#endif
+
+typedef struct external_buffer {
+  VALUE vname;
+  VALUE vstr; // Qnil when the buffer is an arena owned by the model
+  void *ptr;
+  size_t size;
+  int lock_count; // runs using vstr without the GVL, changed with the GVL
+} external_buffer;
+
+// Binding plan entry of an input or output variable. Everything is looked up
+// once when the model is built so that accessors never go through the
+// name-based Menoh API.
+typedef struct model_variable {
+  VALUE vname;
+  menoh_dtype dtype;
+  int32_t dims_length;
+  int32_t *dims;
+  int32_t buffer_length;
+  size_t size;
+  void *buf;
+  external_buffer *external;
+} model_variable;
+
+// stages of an inference counted by MenohModel#stats
+typedef enum stats_stage {
+  stats_stage_input,
+  stats_stage_run,
+  stats_stage_output,
+  stats_stage_reshape,
+  stats_stage_num
+} stats_stage;
+
+#define STATS_BUCKETS 32
+
+typedef struct stage_stats {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t bytes;
+  uint64_t histogram[STATS_BUCKETS]; // log2 buckets of microseconds
+} stage_stats;
+
+typedef struct model_stats {
+  stage_stats stages[stats_stage_num];
+} model_stats;
+
+// CPU set of a model, defined in placement.c
+typedef struct model_placement model_placement;
+
+typedef struct menohModel {
+  model_variable *variables; // input variables followed by output variables
+  int32_t variable_num;
+  menoh_model_handle model;
+  VALUE vinput_layers;
+  VALUE voutput_layers;
+  int32_t input_layer_num;
+  external_buffer *external_buffers;
+  int32_t external_buffer_num;
+  int async_running; // guarded by the lock of the async worker pool
+  int async_pending; // queued or running jobs, guarded likewise
+  model_stats stats;
+  model_placement *placement; // NULL without the placement option
+  size_t weights_size; // estimate: serialized size of the model it was built from
+  size_t reported_memsize; // native memory reported to the GC
+} menohModel;
+
+// element types of foreign buffers (e.g. MemoryView or binary Strings) that
+// can be converted into a variable buffer
+typedef enum elem_type {
+  elem_type_uint8,
+  elem_type_int8,
+  elem_type_int16,
+  elem_type_int32,
+  elem_type_int64,
+  elem_type_float16,
+  elem_type_float32,
+  elem_type_float64,
+  elem_type_unknown
+} elem_type;
+
+// Menoh::Tensor is a shaped view into a frozen binary String. Sub-tensors
+// share the String at an offset.
+typedef struct tensor {
+  VALUE vdata;
+  size_t offset; // in bytes
+  menoh_dtype dtype;
+  elem_type type;
+  int32_t ndim;
+  int32_t *shape;
+  size_t length; // number of elements
+} tensor;
+
+extern VALUE eError;
+
+VALUE menoh_error_class(menoh_error_code ec);
+menohModel *getModel(VALUE self);
+model_variable *get_variable(VALUE self, VALUE vname);
+menoh_dtype get_dtype(VALUE val);
+VALUE dtype_symbol(menoh_dtype dtype);
+tensor *getTensor(VALUE self);
+VALUE make_tensor(VALUE vdata, size_t offset, menoh_dtype dtype,
+                  int32_t ndim, const int32_t *shape);
+void check_external_buffer(external_buffer *buf);
+void check_external_buffers(menohModel *p);
+void lock_external_buffers(menohModel *p);
+void unlock_external_buffers(menohModel *p);
+bool external_string_p(menohModel *p, VALUE vstr);
+void check_no_async_run(menohModel *p);
+bool ary_includes_object(VALUE vary, VALUE obj);
+
+elem_type dtype_elem_type(menoh_dtype dtype);
+elem_type get_elem_type(VALUE val);
+size_t elem_size(elem_type type);
+float half_to_float(uint16_t h);
+uint16_t float_to_half(float f);
+void convert_elements(void *dst, elem_type dst_type,
+                      const void *src, elem_type src_type, size_t n);
+
+uint64_t stats_now(void);
+// condition variables whose timed waits take stats_now deadlines
+void cond_init_monotonic(pthread_cond_t *cond);
+struct timespec cond_deadline(uint64_t deadline_ns);
+// stats_add may be called without the GVL, stats_record also notifies the
+// subscriber and needs it
+void stats_add(menohModel *p, stats_stage stage, uint64_t ns, size_t bytes);
+void stats_notify(VALUE self, stats_stage stage, uint64_t ns, size_t bytes);
+void stats_record(VALUE self, stats_stage stage, uint64_t ns, size_t bytes);
+
+model_placement *make_placement(VALUE vplacement);
+// Pins the calling thread to the placement, returning what placement_leave
+// needs to restore it. Both may be called without the GVL.
+void *placement_enter(const model_placement *pl);
+void placement_leave(void *saved);
+
+bool async_pending_p(menohModel *m);
+
+void Init_menoh_batcher(VALUE mMenoh);
+void Init_menoh_async(VALUE mMenoh);
+void Init_menoh_image(VALUE mMenoh);
+void Init_menoh_tensor(VALUE mMenoh);
+void Init_menoh_postprocess(VALUE mMenoh);
+void Init_menoh_stats(VALUE mMenoh);
+void Init_menoh_placement(VALUE mMenoh);
+void Init_menoh_admission(VALUE mMenoh);
+void Init_menoh_stream(VALUE mMenoh);
 
 #endif /* MENOH_H */
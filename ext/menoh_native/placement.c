@@ -0,0 +1,117 @@
+#define _GNU_SOURCE 1
+#include "menoh_ruby.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+// CPU placement of a model. Only the thread building or running a model
+// with a placement is pinned to its CPUs, for the duration, and restored
+// afterwards. No memory policy is set: memory is placed on first touch under
+// Linux's default policy, so the buffers Menoh and the arenas allocate and
+// touch from the pinned thread usually end up on the node of those CPUs.
+// numa_node only selects the CPUs and is reported back. Backend threads,
+// such as an OpenMP pool shared by the calling thread, are not pinned and
+// may run and allocate elsewhere.
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <pthread.h>
+#include <sched.h>
+
+struct model_placement {
+  cpu_set_t cpus;
+  int numa_node; // -1 when not given
+};
+
+static ID id_cpus, id_numa_node;
+
+model_placement *make_placement(VALUE vplacement) {
+  if (NIL_P(vplacement)) return NULL;
+  Check_Type(vplacement, T_HASH);
+  VALUE vcpus = rb_hash_aref(vplacement, ID2SYM(id_cpus));
+  VALUE vnode = rb_hash_aref(vplacement, ID2SYM(id_numa_node));
+  Check_Type(vcpus, T_ARRAY);
+
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    rb_sys_fail("sched_getaffinity");
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (long i = 0; i < RARRAY_LEN(vcpus); i++) {
+    long cpu = NUM2LONG(RARRAY_AREF(vcpus, i));
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+      rb_raise(rb_eArgError, "invalid CPU number: %ld", cpu);
+    // CPUs the process may not use are dropped
+    if (CPU_ISSET(cpu, &allowed)) CPU_SET(cpu, &cpus);
+  }
+  if (CPU_COUNT(&cpus) == 0)
+    rb_raise(rb_eArgError, "no CPU of the placement is available to the process");
+
+  model_placement *pl = ruby_xmalloc(sizeof(model_placement));
+  pl->cpus = cpus;
+  pl->numa_node = NIL_P(vnode) ? -1 : NUM2INT(vnode);
+  return pl;
+}
+
+void *placement_enter(const model_placement *pl) {
+  if (pl == NULL) return NULL;
+  cpu_set_t *saved = malloc(sizeof(cpu_set_t));
+  if (saved == NULL) return NULL;
+  pthread_t self = pthread_self();
+  if (pthread_getaffinity_np(self, sizeof(cpu_set_t), saved) != 0 ||
+      CPU_EQUAL(saved, &pl->cpus) ||
+      pthread_setaffinity_np(self, sizeof(cpu_set_t), &pl->cpus) != 0) {
+    // already in place, or the placement cannot be applied
+    free(saved);
+    return NULL;
+  }
+  return saved;
+}
+
+void placement_leave(void *saved) {
+  if (saved == NULL) return;
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), (cpu_set_t *)saved);
+  free(saved);
+}
+
+// {cpus: [...], numa_node: n} with the CPUs the model is pinned to, or nil
+static VALUE wrap_model_placement(VALUE self) {
+  model_placement *pl = getModel(self)->placement;
+  if (pl == NULL) return Qnil;
+  VALUE vcpus = rb_ary_new();
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu, &pl->cpus)) rb_ary_push(vcpus, INT2FIX(cpu));
+  VALUE vplacement = rb_hash_new();
+  rb_hash_aset(vplacement, ID2SYM(id_cpus), vcpus);
+  rb_hash_aset(vplacement, ID2SYM(id_numa_node), pl->numa_node < 0 ? Qnil : INT2FIX(pl->numa_node));
+  return vplacement;
+}
+
+#else
+
+model_placement *make_placement(VALUE vplacement) {
+  if (NIL_P(vplacement)) return NULL;
+  rb_raise(rb_eNotImpError, "CPU placement is not supported on this platform");
+}
+
+void *placement_enter(const model_placement *pl) {
+  return NULL;
+}
+
+void placement_leave(void *saved) {
+}
+
+static VALUE wrap_model_placement(VALUE self) {
+  return Qnil;
+}
+
+#endif
+
+void Init_menoh_placement(VALUE mMenoh) {
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+  id_cpus = rb_intern("cpus");
+  id_numa_node = rb_intern("numa_node");
+#endif
+
+  VALUE model = rb_const_get(mMenoh, rb_intern("MenohModel"));
+  rb_define_method(model, "placement", RUBY_METHOD_FUNC(wrap_model_placement), 0);
+}
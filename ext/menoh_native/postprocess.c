@@ -0,0 +1,264 @@
+#include "menoh_ruby.h"
+#include <math.h>
+
+// Row-wise postprocessing of classification outputs. A tensor or output
+// variable is read as rows over its last dimension; the kernels work on
+// float32 rows straight from the buffer and return compact Ruby results.
+
+// The buffer is kept alive by the receiver of the method.
+typedef struct rows_view {
+  const char *data;
+  elem_type type;
+  menoh_dtype dtype;
+  size_t rows;
+  size_t cols;
+  int32_t ndim;
+  const int32_t *shape;
+} rows_view;
+
+static void set_rows(rows_view *v, int32_t ndim, const int32_t *shape) {
+  if (ndim == 0) rb_raise(rb_eArgError, "a scalar has no rows");
+  v->ndim = ndim;
+  v->shape = shape;
+  v->cols = shape[ndim - 1];
+  v->rows = 1;
+  for (int32_t i = 0; i < ndim - 1; i++) v->rows *= shape[i];
+  if (v->cols == 0) rb_raise(rb_eArgError, "empty rows");
+}
+
+static rows_view tensor_rows(VALUE self) {
+  tensor *p = getTensor(self);
+  rows_view v;
+  v.data = RSTRING_PTR(p->vdata) + p->offset;
+  v.type = p->type;
+  v.dtype = p->dtype;
+  set_rows(&v, p->ndim, p->shape);
+  return v;
+}
+
+static rows_view variable_rows(VALUE self, VALUE vname) {
+  model_variable *var = get_variable(self, vname);
+  rows_view v;
+  v.data = var->buf;
+  v.type = dtype_elem_type(var->dtype);
+  v.dtype = var->dtype;
+  if (v.type == elem_type_unknown)
+    rb_raise(rb_eArgError, "unsupported dtype: %d", (int)var->dtype);
+  set_rows(&v, var->dims_length, var->dims);
+  return v;
+}
+
+// Row r as floats, converted into tmp unless it is float32 already.
+static const float *row_floats(const rows_view *v, size_t r, float *tmp) {
+  const char *row = v->data + r * v->cols * elem_size(v->type);
+  if (v->type == elem_type_float32) return (const float *)row;
+  convert_elements(tmp, elem_type_float32, row, v->type, v->cols);
+  return tmp;
+}
+
+// A row result for 1-D input, an Array of row results otherwise.
+static VALUE rows_result(const rows_view *v, VALUE vresults) {
+  return v->ndim == 1 ? RARRAY_AREF(vresults, 0) : vresults;
+}
+
+static size_t argmax_row(const float *x, size_t n) {
+  size_t best = 0;
+  for (size_t i = 1; i < n; i++)
+    if (x[i] > x[best]) best = i;
+  return best;
+}
+
+static VALUE rows_argmax(const rows_view *v) {
+  VALUE vtmp = 0;
+  float *tmp = ALLOCV_N(float, vtmp, v->cols);
+  VALUE vresults = rb_ary_new_capa(v->rows);
+  for (size_t r = 0; r < v->rows; r++)
+    rb_ary_push(vresults, SIZET2NUM(argmax_row(row_floats(v, r, tmp), v->cols)));
+  ALLOCV_END(vtmp);
+  return rows_result(v, vresults);
+}
+
+typedef struct scored {
+  float score;
+  size_t index;
+} scored;
+
+// a ranks below b: a lower score, or the same score at a later index
+static int ranks_below(const scored *a, const scored *b) {
+  return a->score < b->score || (a->score == b->score && a->index > b->index);
+}
+
+static void sift_down(scored *heap, size_t n, size_t i) {
+  for (;;) {
+    size_t l = 2 * i + 1, r = l + 1, m = i;
+    if (l < n && ranks_below(&heap[l], &heap[m])) m = l;
+    if (r < n && ranks_below(&heap[r], &heap[m])) m = r;
+    if (m == i) return;
+    scored t = heap[i];
+    heap[i] = heap[m];
+    heap[m] = t;
+    i = m;
+  }
+}
+
+static int compare_rank(const void *a, const void *b) {
+  const scored *x = a, *y = b;
+  if (ranks_below(y, x)) return -1;
+  if (ranks_below(x, y)) return 1;
+  return 0;
+}
+
+static VALUE scored_pairs(const scored *items, size_t n) {
+  VALUE vpairs = rb_ary_new_capa(n);
+  for (size_t i = 0; i < n; i++)
+    rb_ary_push(vpairs, rb_assoc_new(SIZET2NUM(items[i].index), DBL2NUM(items[i].score)));
+  return vpairs;
+}
+
+// The k best of a row with a min-heap of size k, O(n log k), best first.
+static size_t topk_row(const float *x, size_t n, size_t k, scored *heap) {
+  if (k > n) k = n;
+  for (size_t i = 0; i < k; i++) {
+    heap[i].score = x[i];
+    heap[i].index = i;
+  }
+  for (size_t i = k / 2; i-- > 0;) sift_down(heap, k, i);
+  for (size_t i = k; i < n; i++) {
+    scored s = { x[i], i };
+    if (k > 0 && ranks_below(&heap[0], &s)) {
+      heap[0] = s;
+      sift_down(heap, k, 0);
+    }
+  }
+  qsort(heap, k, sizeof(scored), compare_rank);
+  return k;
+}
+
+static VALUE rows_topk(const rows_view *v, VALUE vk) {
+  long k = NUM2LONG(vk);
+  if (k < 0) rb_raise(rb_eArgError, "negative k: %ld", k);
+  size_t heap_size = (size_t)k < v->cols ? (size_t)k : v->cols;
+
+  VALUE vtmp = 0, vheap = 0;
+  float *tmp = ALLOCV_N(float, vtmp, v->cols);
+  scored *heap = ALLOCV_N(scored, vheap, heap_size > 0 ? heap_size : 1);
+  VALUE vresults = rb_ary_new_capa(v->rows);
+  for (size_t r = 0; r < v->rows; r++) {
+    size_t n = topk_row(row_floats(v, r, tmp), v->cols, heap_size, heap);
+    rb_ary_push(vresults, scored_pairs(heap, n));
+  }
+  ALLOCV_END(vheap);
+  ALLOCV_END(vtmp);
+  return rows_result(v, vresults);
+}
+
+// Pairs of the scores at or above min in a row, best first.
+static VALUE rows_threshold(const rows_view *v, VALUE vmin) {
+  float min = (float)NUM2DBL(vmin);
+  VALUE vtmp = 0, vitems = 0;
+  float *tmp = ALLOCV_N(float, vtmp, v->cols);
+  scored *items = ALLOCV_N(scored, vitems, v->cols);
+  VALUE vresults = rb_ary_new_capa(v->rows);
+  for (size_t r = 0; r < v->rows; r++) {
+    const float *x = row_floats(v, r, tmp);
+    size_t n = 0;
+    for (size_t i = 0; i < v->cols; i++) {
+      if (x[i] >= min) {
+        items[n].score = x[i];
+        items[n].index = i;
+        n++;
+      }
+    }
+    qsort(items, n, sizeof(scored), compare_rank);
+    rb_ary_push(vresults, scored_pairs(items, n));
+  }
+  ALLOCV_END(vitems);
+  ALLOCV_END(vtmp);
+  return rows_result(v, vresults);
+}
+
+// softmax or log_softmax of every row into a new float32 tensor
+static VALUE rows_softmax(const rows_view *v, int log_output) {
+  VALUE vdata = rb_str_new(NULL, v->rows * v->cols * sizeof(float));
+  float *out = (float *)RSTRING_PTR(vdata);
+  for (size_t r = 0; r < v->rows; r++) {
+    float *y = out + r * v->cols;
+    const float *x = row_floats(v, r, y);  // converts in place if needed
+    float max = x[argmax_row(x, v->cols)];
+    double sum = 0.0;
+    for (size_t i = 0; i < v->cols; i++) sum += exp((double)(x[i] - max));
+    if (log_output) {
+      float lse = max + (float)log(sum);
+      for (size_t i = 0; i < v->cols; i++) y[i] = x[i] - lse;
+    } else {
+      for (size_t i = 0; i < v->cols; i++) y[i] = (float)(exp((double)(x[i] - max)) / sum);
+    }
+  }
+  return make_tensor(rb_obj_freeze(vdata), 0, menoh_dtype_float, v->ndim, v->shape);
+}
+
+static VALUE tensor_argmax(VALUE self) {
+  rows_view v = tensor_rows(self);
+  return rows_argmax(&v);
+}
+
+static VALUE tensor_topk(VALUE self, VALUE vk) {
+  rows_view v = tensor_rows(self);
+  return rows_topk(&v, vk);
+}
+
+static VALUE tensor_threshold(VALUE self, VALUE vmin) {
+  rows_view v = tensor_rows(self);
+  return rows_threshold(&v, vmin);
+}
+
+static VALUE tensor_softmax(VALUE self) {
+  rows_view v = tensor_rows(self);
+  return rows_softmax(&v, 0);
+}
+
+static VALUE tensor_log_softmax(VALUE self) {
+  rows_view v = tensor_rows(self);
+  return rows_softmax(&v, 1);
+}
+
+static VALUE model_argmax(VALUE self, VALUE vname) {
+  rows_view v = variable_rows(self, vname);
+  return rows_argmax(&v);
+}
+
+static VALUE model_topk(VALUE self, VALUE vname, VALUE vk) {
+  rows_view v = variable_rows(self, vname);
+  return rows_topk(&v, vk);
+}
+
+static VALUE model_threshold(VALUE self, VALUE vname, VALUE vmin) {
+  rows_view v = variable_rows(self, vname);
+  return rows_threshold(&v, vmin);
+}
+
+static VALUE model_softmax(VALUE self, VALUE vname) {
+  rows_view v = variable_rows(self, vname);
+  return rows_softmax(&v, 0);
+}
+
+static VALUE model_log_softmax(VALUE self, VALUE vname) {
+  rows_view v = variable_rows(self, vname);
+  return rows_softmax(&v, 1);
+}
+
+void Init_menoh_postprocess(VALUE mMenoh) {
+  VALUE tensor = rb_const_get(mMenoh, rb_intern("Tensor"));
+  rb_define_method(tensor, "argmax", RUBY_METHOD_FUNC(tensor_argmax), 0);
+  rb_define_method(tensor, "topk", RUBY_METHOD_FUNC(tensor_topk), 1);
+  rb_define_method(tensor, "threshold", RUBY_METHOD_FUNC(tensor_threshold), 1);
+  rb_define_method(tensor, "softmax", RUBY_METHOD_FUNC(tensor_softmax), 0);
+  rb_define_method(tensor, "log_softmax", RUBY_METHOD_FUNC(tensor_log_softmax), 0);
+
+  VALUE model = rb_const_get(mMenoh, rb_intern("MenohModel"));
+  rb_define_method(model, "argmax", RUBY_METHOD_FUNC(model_argmax), 1);
+  rb_define_method(model, "topk", RUBY_METHOD_FUNC(model_topk), 2);
+  rb_define_method(model, "threshold", RUBY_METHOD_FUNC(model_threshold), 2);
+  rb_define_method(model, "softmax", RUBY_METHOD_FUNC(model_softmax), 1);
+  rb_define_method(model, "log_softmax", RUBY_METHOD_FUNC(model_log_softmax), 1);
+}
@@ -0,0 +1,267 @@
+#include "menoh_ruby.h"
+#include <math.h>
+#include <time.h>
+
+// Per-model and global counters of the stages of an inference: copying
+// inputs in, running the model, copying outputs out and building nested
+// Arrays. The counters are updated with relaxed atomics, so native worker
+// threads record their runs without the GVL, and a subscriber registered
+// with Menoh.stats_subscriber= is called with every stage recorded while
+// the GVL is held. Each Ractor has its own subscriber.
+//
+// MenohModel#stats and Menoh.stats return a Hash of stages, each with the
+// count, total and max time in seconds, bytes copied and a histogram as
+// [upper bound in seconds, count] pairs of the non-empty buckets. The
+// subscriber is called as subscriber.call(model, stage, seconds, bytes).
+// Runs of Menoh::Batcher are counted but not reported to it, and runs of
+// run_async are reported when their future is waited for.
+
+#if defined(__GNUC__) || defined(__clang__)
+#define STATS_ADD(var, v) __atomic_fetch_add(&(var), (v), __ATOMIC_RELAXED)
+#define STATS_LOAD(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#define STATS_STORE(var, v) __atomic_store_n(&(var), (v), __ATOMIC_RELAXED)
+#define STATS_CAS(var, expected, v) \
+  __atomic_compare_exchange_n(&(var), &(expected), (v), 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#else
+#define STATS_ADD(var, v) ((var) += (v))
+#define STATS_LOAD(var) (var)
+#define STATS_STORE(var, v) ((var) = (v))
+#define STATS_CAS(var, expected, v) ((var) = (v), 1)
+#endif
+
+static model_stats global_stats;
+#ifdef HAVE_RUBY_RACTOR_H
+static rb_ractor_local_key_t stats_subscriber_key;
+
+static VALUE get_subscriber(void) {
+  VALUE subscriber;
+  if (!rb_ractor_local_storage_value_lookup(stats_subscriber_key, &subscriber)) return Qnil;
+  return subscriber;
+}
+
+static void set_subscriber(VALUE subscriber) {
+  rb_ractor_local_storage_value_set(stats_subscriber_key, subscriber);
+}
+#else
+static VALUE stats_subscriber = Qnil;
+
+static VALUE get_subscriber(void) {
+  return stats_subscriber;
+}
+
+static void set_subscriber(VALUE subscriber) {
+  stats_subscriber = subscriber;
+}
+#endif
+
+static ID id_call, id_nested_data, id_reshape;
+static VALUE mUtil;
+static VALUE stage_symbols[stats_stage_num];
+
+uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Condition variables wait on the clock of stats_now where the platform
+// allows it, so that steps of the wall clock neither stretch nor cut timed
+// waits. cond_deadline converts a stats_now deadline for pthread_cond_timedwait
+// on such a condition variable.
+void cond_init_monotonic(pthread_cond_t *cond) {
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+#else
+  pthread_cond_init(cond, NULL);
+#endif
+}
+
+struct timespec cond_deadline(uint64_t deadline_ns) {
+  struct timespec ts;
+#ifndef HAVE_PTHREAD_CONDATTR_SETCLOCK
+  // the condition variable waits on the realtime clock
+  uint64_t now = stats_now();
+  clock_gettime(CLOCK_REALTIME, &ts);
+  deadline_ns = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec +
+                (deadline_ns > now ? deadline_ns - now : 0);
+#endif
+  ts.tv_sec = (time_t)(deadline_ns / 1000000000u);
+  ts.tv_nsec = (long)(deadline_ns % 1000000000u);
+  return ts;
+}
+
+// Bucket 0 counts times under 1us, bucket i times in [2^(i-1), 2^i) us
+// and the last bucket everything longer.
+static int histogram_bucket(uint64_t ns) {
+  uint64_t us = ns / 1000;
+  int bucket = 0;
+  while (us > 0 && bucket < STATS_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+static void add_stage(stage_stats *s, uint64_t ns, uint64_t bytes) {
+  STATS_ADD(s->count, 1);
+  STATS_ADD(s->total_ns, ns);
+  STATS_ADD(s->bytes, bytes);
+  STATS_ADD(s->histogram[histogram_bucket(ns)], 1);
+  uint64_t max = STATS_LOAD(s->max_ns);
+  while (ns > max && !STATS_CAS(s->max_ns, max, ns)) {}
+}
+
+void stats_add(menohModel *p, stats_stage stage, uint64_t ns, size_t bytes) {
+  add_stage(&p->stats.stages[stage], ns, bytes);
+  add_stage(&global_stats.stages[stage], ns, bytes);
+}
+
+static VALUE call_subscriber(VALUE args) {
+  return rb_funcallv(RARRAY_AREF(args, 0), id_call, 4, RARRAY_CONST_PTR(args) + 1);
+}
+
+void stats_notify(VALUE self, stats_stage stage, uint64_t ns, size_t bytes) {
+  VALUE subscriber = get_subscriber();
+  if (NIL_P(subscriber)) return;
+  VALUE args = rb_ary_new_from_args(5, subscriber, self, stage_symbols[stage],
+                                    DBL2NUM(ns / 1e9), SIZET2NUM(bytes));
+  // a failing exporter must not fail the inference, but Interrupt,
+  // Thread#kill and throw still leave it
+  int state;
+  rb_protect(call_subscriber, args, &state);
+  if (state) {
+    VALUE err = rb_errinfo();
+    if (!RB_TYPE_P(err, T_OBJECT) || !rb_obj_is_kind_of(err, rb_eStandardError))
+      rb_jump_tag(state);
+    rb_set_errinfo(Qnil);
+    VALUE msg = rb_inspect(err);
+    rb_warn("Menoh stats subscriber failed: %s", StringValueCStr(msg));
+  }
+}
+
+void stats_record(VALUE self, stats_stage stage, uint64_t ns, size_t bytes) {
+  stats_add(getModel(self), stage, ns, bytes);
+  stats_notify(self, stage, ns, bytes);
+}
+
+static VALUE stage_hash(const stage_stats *s) {
+  VALUE vhistogram = rb_ary_new();
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    uint64_t n = STATS_LOAD(s->histogram[i]);
+    if (n == 0) continue;
+    double upper = i == STATS_BUCKETS - 1 ? HUGE_VAL : (double)((uint64_t)1 << i) / 1e6;
+    rb_ary_push(vhistogram, rb_assoc_new(DBL2NUM(upper), ULL2NUM(n)));
+  }
+
+  VALUE vhash = rb_hash_new();
+  rb_hash_aset(vhash, ID2SYM(rb_intern("count")), ULL2NUM(STATS_LOAD(s->count)));
+  rb_hash_aset(vhash, ID2SYM(rb_intern("time")), DBL2NUM(STATS_LOAD(s->total_ns) / 1e9));
+  rb_hash_aset(vhash, ID2SYM(rb_intern("max_time")), DBL2NUM(STATS_LOAD(s->max_ns) / 1e9));
+  rb_hash_aset(vhash, ID2SYM(rb_intern("bytes")), ULL2NUM(STATS_LOAD(s->bytes)));
+  rb_hash_aset(vhash, ID2SYM(rb_intern("histogram")), vhistogram);
+  return vhash;
+}
+
+static VALUE stats_hash(const model_stats *stats) {
+  VALUE vhash = rb_hash_new();
+  for (int i = 0; i < stats_stage_num; i++)
+    rb_hash_aset(vhash, stage_symbols[i], stage_hash(&stats->stages[i]));
+  return vhash;
+}
+
+static void reset_stats(model_stats *stats) {
+  for (int i = 0; i < stats_stage_num; i++) {
+    stage_stats *s = &stats->stages[i];
+    STATS_STORE(s->count, 0);
+    STATS_STORE(s->total_ns, 0);
+    STATS_STORE(s->max_ns, 0);
+    STATS_STORE(s->bytes, 0);
+    for (int j = 0; j < STATS_BUCKETS; j++) STATS_STORE(s->histogram[j], 0);
+  }
+}
+
+static VALUE wrap_model_stats(VALUE self) {
+  return stats_hash(&getModel(self)->stats);
+}
+
+static VALUE wrap_model_reset_stats(VALUE self) {
+  reset_stats(&getModel(self)->stats);
+  return Qnil;
+}
+
+static VALUE global_stats_hash(VALUE self) {
+  return stats_hash(&global_stats);
+}
+
+static VALUE global_reset_stats(VALUE self) {
+  reset_stats(&global_stats);
+  return Qnil;
+}
+
+static VALUE get_stats_subscriber(VALUE self) {
+  return get_subscriber();
+}
+
+static VALUE set_stats_subscriber(VALUE self, VALUE vsubscriber) {
+  if (!NIL_P(vsubscriber) && !rb_respond_to(vsubscriber, id_call))
+    rb_raise(rb_eArgError, "the subscriber must respond to call");
+  set_subscriber(vsubscriber);
+  return vsubscriber;
+}
+
+// Util.nested_data of an output, recorded as the reshape stage
+static VALUE wrap_model_timed_nested_data(VALUE self, VALUE vtensor) {
+  tensor *t = getTensor(vtensor);
+  uint64_t started = stats_now();
+  VALUE vresult = rb_funcall(mUtil, id_nested_data, 1, vtensor);
+  stats_record(self, stats_stage_reshape, stats_now() - started, t->length * elem_size(t->type));
+  return vresult;
+}
+
+// Util.reshape of the Array get_data returned for a variable, recorded as
+// the reshape stage
+static VALUE wrap_model_timed_reshape(VALUE self, VALUE vname, VALUE vbuffer) {
+  model_variable *var = get_variable(self, vname);
+  VALUE vshape = rb_ary_new_capa(var->dims_length);
+  for (int32_t i = 0; i < var->dims_length; i++)
+    rb_ary_push(vshape, INT2NUM(var->dims[i]));
+  uint64_t started = stats_now();
+  VALUE vresult = rb_funcall(mUtil, id_reshape, 2, vbuffer, vshape);
+  stats_record(self, stats_stage_reshape, stats_now() - started, var->size);
+  return vresult;
+}
+
+void Init_menoh_stats(VALUE mMenoh) {
+  id_call = rb_intern("call");
+  id_nested_data = rb_intern("nested_data");
+  id_reshape = rb_intern("reshape");
+  const char *names[stats_stage_num] = { "input", "run", "output", "reshape" };
+  for (int i = 0; i < stats_stage_num; i++) {
+    stage_symbols[i] = ID2SYM(rb_intern(names[i]));
+  }
+#ifdef HAVE_RUBY_RACTOR_H
+  stats_subscriber_key = rb_ractor_local_storage_value_newkey();
+#else
+  rb_gc_register_address(&stats_subscriber);
+#endif
+  mUtil = rb_define_module_under(mMenoh, "Util");
+
+  VALUE model = rb_const_get(mMenoh, rb_intern("MenohModel"));
+  rb_define_method(model, "stats", RUBY_METHOD_FUNC(wrap_model_stats), 0);
+  rb_define_method(model, "reset_stats", RUBY_METHOD_FUNC(wrap_model_reset_stats), 0);
+  rb_define_private_method(model, "timed_nested_data",
+                           RUBY_METHOD_FUNC(wrap_model_timed_nested_data), 1);
+  rb_define_private_method(model, "timed_reshape",
+                           RUBY_METHOD_FUNC(wrap_model_timed_reshape), 2);
+
+  rb_define_module_function(mMenoh, "stats", RUBY_METHOD_FUNC(global_stats_hash), 0);
+  rb_define_module_function(mMenoh, "reset_stats", RUBY_METHOD_FUNC(global_reset_stats), 0);
+  rb_define_module_function(mMenoh, "stats_subscriber",
+                            RUBY_METHOD_FUNC(get_stats_subscriber), 0);
+  rb_define_module_function(mMenoh, "stats_subscriber=",
+                            RUBY_METHOD_FUNC(set_stats_subscriber), 1);
+}
@@ -0,0 +1,288 @@
+#include "menoh_ruby.h"
+#include <ruby/thread.h>
+
+// MenohModel#each_batch runs a model over a file of fixed-size records. The
+// file is mapped read-only and each batch is converted straight from the
+// mapping into the input buffers, so no Ruby object is made per record. While
+// a batch runs, the kernel is asked to read ahead the records of the next one
+// and the pages of the records already used are dropped from the mapping.
+// Outputs can be written to a file descriptor, one row of each output per
+// record in the order of output_layers.
+
+#ifdef HAVE_SYS_MMAN_H
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// one input of a record, fields follow each other in a record
+typedef struct stream_field {
+  model_variable *var;
+  elem_type type;       // element type in the file
+  size_t offset;        // in the record
+  size_t sample_length; // number of elements of one sample
+} stream_field;
+
+typedef struct stream {
+  menohModel *model;
+  int32_t batch_size;
+  stream_field *fields;
+  int32_t field_num;
+  char *map;          // page-aligned mapping of the file
+  size_t map_size;
+  const char *records; // first record in the mapping
+  size_t record_size;
+  size_t record_num;
+  char *dropped;      // pages before this were given back
+  int out_fd;         // -1 without an output file
+  char *out_buf;      // interleaved output rows of a batch
+  size_t out_row_size;
+  size_t next;        // first record of the batch
+  size_t count;       // records in the batch
+  menoh_error_code err;
+  int write_errno;
+  uint64_t stage_ns[3]; // input, run and output of the batch
+  size_t stage_bytes[3];
+} stream;
+
+static size_t page_size(void) {
+  static size_t size;
+  if (size == 0) size = (size_t)sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+static int write_all(int fd, const char *buf, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, buf, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return errno;
+    }
+    buf += written;
+    size -= (size_t)written;
+  }
+  return 0;
+}
+
+static void copy_batch(stream *st) {
+  int32_t batch_size = st->batch_size;
+  const char *first = st->records + st->next * st->record_size;
+
+  for (int32_t i = 0; i < st->field_num; i++) {
+    stream_field *field = &st->fields[i];
+    model_variable *var = field->var;
+    elem_type dst_type = dtype_elem_type(var->dtype);
+    size_t row_size = var->size / batch_size;
+    if (st->field_num == 1) {
+      // the records of the batch are one run of samples
+      convert_elements(var->buf, dst_type, first, field->type,
+                       field->sample_length * st->count);
+    } else {
+      for (size_t r = 0; r < st->count; r++)
+        convert_elements((char *)var->buf + row_size * r, dst_type,
+                         first + st->record_size * r + field->offset, field->type,
+                         field->sample_length);
+    }
+    // a short last batch runs on zeros past its records
+    if (st->count < (size_t)batch_size)
+      memset((char *)var->buf + row_size * st->count, 0,
+             row_size * (batch_size - st->count));
+  }
+}
+
+// Reads ahead the records of the next batch and drops the pages of the
+// records copied so far.
+static void advise_pages(stream *st) {
+  size_t mask = ~(page_size() - 1);
+  const char *end = st->records + (st->next + st->count) * st->record_size;
+  size_t ahead = st->record_size * st->batch_size;
+  const char *map_end = st->map + st->map_size;
+  if (end < map_end) {
+    char *start = (char *)((uintptr_t)end & mask);
+    size_t len = (size_t)((end + ahead < map_end ? end + ahead : map_end) - start);
+#ifdef MADV_WILLNEED
+    madvise(start, len, MADV_WILLNEED);
+#endif
+  }
+  char *done = (char *)((uintptr_t)end & mask);
+  if (done > st->dropped) {
+#ifdef MADV_DONTNEED
+    madvise(st->dropped, (size_t)(done - st->dropped), MADV_DONTNEED);
+#endif
+    st->dropped = done;
+  }
+}
+
+static void write_batch(stream *st) {
+  menohModel *m = st->model;
+  int32_t input_num = m->input_layer_num;
+  int32_t output_num = m->variable_num - input_num;
+
+  if (output_num == 1) {
+    model_variable *var = &m->variables[input_num];
+    st->write_errno = write_all(st->out_fd, var->buf, var->size / st->batch_size * st->count);
+    return;
+  }
+  char *dst = st->out_buf;
+  for (size_t r = 0; r < st->count; r++) {
+    for (int32_t i = 0; i < output_num; i++) {
+      model_variable *var = &m->variables[input_num + i];
+      size_t row_size = var->size / st->batch_size;
+      memcpy(dst, (char *)var->buf + row_size * r, row_size);
+      dst += row_size;
+    }
+  }
+  st->write_errno = write_all(st->out_fd, st->out_buf, st->out_row_size * st->count);
+}
+
+static void *stream_batch(void *arg) {
+  stream *st = (stream *)arg;
+  menohModel *m = st->model;
+  size_t left = st->record_num - st->next;
+  st->count = left < (size_t)st->batch_size ? left : (size_t)st->batch_size;
+
+  uint64_t t0 = stats_now();
+  copy_batch(st);
+  advise_pages(st);
+  uint64_t t1 = stats_now();
+  void *saved = placement_enter(m->placement);
+  st->err = menoh_model_run(m->model);
+  placement_leave(saved);
+  uint64_t t2 = stats_now();
+  if (st->err == menoh_error_code_success && st->out_fd >= 0) write_batch(st);
+  uint64_t t3 = stats_now();
+
+  st->stage_ns[0] = t1 - t0;
+  st->stage_ns[1] = t2 - t1;
+  st->stage_ns[2] = t3 - t2;
+  st->stage_bytes[0] = st->record_size * st->count;
+  st->stage_bytes[2] = st->out_fd >= 0 ? st->out_row_size * st->count : 0;
+  return NULL;
+}
+
+struct stream_arg {
+  VALUE self;
+  stream *st;
+};
+
+static VALUE stream_body(VALUE arg) {
+  VALUE self = ((struct stream_arg *)arg)->self;
+  stream *st = ((struct stream_arg *)arg)->st;
+  bool block_given = rb_block_given_p();
+
+  while (st->next < st->record_num) {
+    rb_thread_call_without_gvl(stream_batch, st, RUBY_UBF_IO, NULL);
+    if (st->err != menoh_error_code_success)
+      rb_raise(menoh_error_class(st->err), "%s", menoh_get_last_error_message());
+    if (st->write_errno != 0) rb_syserr_fail(st->write_errno, "write");
+    stats_record(self, stats_stage_input, st->stage_ns[0], st->stage_bytes[0]);
+    stats_record(self, stats_stage_run, st->stage_ns[1], 0);
+    if (st->out_fd >= 0)
+      stats_record(self, stats_stage_output, st->stage_ns[2], st->stage_bytes[2]);
+    if (block_given)
+      rb_yield_values(2, SIZET2NUM(st->next), SIZET2NUM(st->count));
+    st->next += st->count;
+  }
+  return SIZET2NUM(st->record_num);
+}
+
+static VALUE stream_cleanup(VALUE arg) {
+  stream *st = ((struct stream_arg *)arg)->st;
+  unlock_external_buffers(st->model);
+  if (st->map != NULL) munmap(st->map, st->map_size);
+  ruby_xfree(st->out_buf);
+  return Qnil;
+}
+
+// native_each_batch(fd, offset, fields, out_fd) runs the model over the
+// records of fd from offset on. fields is an Array of [input index, dtype]
+// in the order of the record; out_fd is nil or a descriptor the outputs are
+// written to. Yields the index of the first record and the number of records
+// of each batch, and returns the number of records.
+static VALUE wrap_model_each_batch(VALUE self, VALUE vfd, VALUE voffset,
+                                   VALUE vfields, VALUE vout_fd) {
+  menohModel *m = getModel(self);
+  int fd = NUM2INT(vfd);
+  off_t offset = NUM2OFFT(voffset);
+  Check_Type(vfields, T_ARRAY);
+  check_external_buffers(m);
+  check_no_async_run(m);
+  if (offset < 0) rb_raise(rb_eArgError, "negative offset: %ld", (long)offset);
+
+  int32_t field_num = (int32_t)RARRAY_LEN(vfields);
+  if (field_num != m->input_layer_num)
+    rb_raise(rb_eArgError, "wrong number of record fields (expected %d, was %d)",
+             (int)m->input_layer_num, (int)field_num);
+  stream_field *fields = ALLOCA_N(stream_field, field_num);
+  stream st = {
+    .model = m,
+    .batch_size = m->variables[0].dims[0],
+    .fields = fields,
+    .field_num = field_num,
+    .out_fd = NIL_P(vout_fd) ? -1 : NUM2INT(vout_fd),
+  };
+
+  // every input and output must be batched along dims[0]
+  for (int32_t i = 0; i < m->variable_num; i++) {
+    model_variable *var = &m->variables[i];
+    if (var->dims_length == 0 || var->dims[0] != st.batch_size)
+      rb_raise(rb_eArgError, "dims[0] of '%s' is not the batch size %d",
+               RSTRING_PTR(var->vname), (int)st.batch_size);
+    if (i >= m->input_layer_num) st.out_row_size += var->size / st.batch_size;
+  }
+  for (int32_t i = 0; i < field_num; i++) {
+    VALUE vfield = rb_ary_entry(vfields, i);
+    int index = NUM2INT(rb_ary_entry(vfield, 0));
+    if (index < 0 || index >= m->input_layer_num)
+      rb_raise(rb_eArgError, "not an input variable: %d", index);
+    stream_field *field = &fields[i];
+    field->var = &m->variables[index];
+    field->type = get_elem_type(rb_ary_entry(vfield, 1));
+    if (dtype_elem_type(field->var->dtype) == elem_type_unknown)
+      rb_raise(eError, "unsupported dtype of '%s'", RSTRING_PTR(field->var->vname));
+    field->offset = st.record_size;
+    field->sample_length = field->var->buffer_length / st.batch_size;
+    st.record_size += field->sample_length * elem_size(field->type);
+  }
+  if (st.record_size == 0) rb_raise(rb_eArgError, "empty records");
+
+  struct stat sb;
+  if (fstat(fd, &sb) != 0) rb_sys_fail("fstat");
+  size_t data_size = sb.st_size > offset ? (size_t)(sb.st_size - offset) : 0;
+  if (data_size % st.record_size != 0)
+    rb_raise(rb_eArgError, "the data is not a whole number of %zu-byte records (%zu bytes)",
+             st.record_size, data_size);
+  st.record_num = data_size / st.record_size;
+  if (st.record_num == 0) return INT2FIX(0);
+
+  if (st.out_fd >= 0 && m->variable_num - m->input_layer_num > 1)
+    st.out_buf = ruby_xmalloc2(st.batch_size, st.out_row_size);
+  off_t map_offset = offset & ~(off_t)(page_size() - 1);
+  st.map_size = (size_t)(sb.st_size - map_offset);
+  void *map = mmap(NULL, st.map_size, PROT_READ, MAP_PRIVATE, fd, map_offset);
+  if (map == MAP_FAILED) {
+    int e = errno;
+    ruby_xfree(st.out_buf);
+    rb_syserr_fail(e, "mmap");
+  }
+  st.map = map;
+  st.records = st.map + (offset - map_offset);
+  st.dropped = st.map;
+#ifdef MADV_SEQUENTIAL
+  madvise(st.map, st.map_size, MADV_SEQUENTIAL);
+#endif
+
+  struct stream_arg arg = { .self = self, .st = &st };
+  lock_external_buffers(m);
+  return rb_ensure(stream_body, (VALUE)&arg, stream_cleanup, (VALUE)&arg);
+}
+#endif
+
+void Init_menoh_stream(VALUE mMenoh) {
+#ifdef HAVE_SYS_MMAN_H
+  VALUE model = rb_const_get(mMenoh, rb_intern("MenohModel"));
+  rb_define_private_method(model, "native_each_batch",
+                           RUBY_METHOD_FUNC(wrap_model_each_batch), 4);
+#endif
+}
@@ -0,0 +1,235 @@
+#include "menoh_ruby.h"
+
+// Menoh::Tensor keeps an output as one binary String plus shape and dtype.
+// Elements become Ruby objects only when they are read, and indexing the
+// leading dimensions returns sub-tensors sharing the same String.
+
+static VALUE cTensor;
+
+static void wrap_tensor_free(tensor *);
+static void wrap_tensor_mark(tensor *);
+static size_t wrap_tensor_memsize(const tensor *);
+
+static const rb_data_type_t tensor_data_type = {
+  "Menoh::Tensor",
+  {(void(*)(void*))wrap_tensor_mark, (void(*)(void*))wrap_tensor_free,
+   (size_t(*)(const void*))wrap_tensor_memsize,},
+  0, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+#ifdef HAVE_RUBY_RACTOR_H
+  // the data is a frozen String, so Ractor.make_shareable can pass results on
+  | RUBY_TYPED_FROZEN_SHAREABLE
+#endif
+};
+
+tensor *getTensor(VALUE self) {
+  tensor *p;
+  TypedData_Get_Struct(self, tensor, &tensor_data_type, p);
+  if (NIL_P(p->vdata)) rb_raise(rb_eRuntimeError, "uninitialized tensor");
+  return p;
+}
+
+static void wrap_tensor_free(tensor *p) {
+  ruby_xfree(p->shape);
+  ruby_xfree(p);
+}
+
+static void wrap_tensor_mark(tensor *p) {
+  rb_gc_mark(p->vdata); // pinned, elements are read through RSTRING_PTR
+}
+
+static size_t wrap_tensor_memsize(const tensor *p) {
+  return sizeof(tensor) + sizeof(int32_t) * p->ndim;
+}
+
+static VALUE wrap_tensor_alloc(VALUE klass) {
+  tensor *p = ruby_xmalloc(sizeof(tensor));
+  memset(p, 0, sizeof(tensor));
+  p->vdata = Qnil;
+  return TypedData_Wrap_Struct(klass, &tensor_data_type, p);
+}
+
+static void set_tensor(tensor *p, VALUE vdata, size_t offset, menoh_dtype dtype,
+                       int32_t ndim, const int32_t *shape) {
+  elem_type type = dtype_elem_type(dtype);
+  if (type == elem_type_unknown)
+    rb_raise(rb_eArgError, "unsupported dtype: %d", (int)dtype);
+
+  size_t length = 1;
+  for (int32_t i = 0; i < ndim; i++) {
+    if (shape[i] < 0) rb_raise(rb_eArgError, "negative dimension: %d", (int)shape[i]);
+    length *= shape[i];
+  }
+  if (offset + length * elem_size(type) > (size_t)RSTRING_LEN(vdata))
+    rb_raise(rb_eArgError, "the data is too short for the shape");
+
+  p->shape = ruby_xmalloc2(ndim > 0 ? ndim : 1, sizeof(int32_t));
+  memcpy(p->shape, shape, sizeof(int32_t) * ndim);
+  p->ndim = ndim;
+  p->dtype = dtype;
+  p->type = type;
+  p->offset = offset;
+  p->length = length;
+  p->vdata = vdata;
+}
+
+VALUE make_tensor(VALUE vdata, size_t offset, menoh_dtype dtype,
+                  int32_t ndim, const int32_t *shape) {
+  VALUE self = wrap_tensor_alloc(cTensor);
+  set_tensor(DATA_PTR(self), rb_str_new_frozen(vdata), offset, dtype, ndim, shape);
+  return self;
+}
+
+// Tensor.new(data, shape, dtype = :float32) over a binary String
+static VALUE wrap_tensor_init(int argc, VALUE *argv, VALUE self) {
+  VALUE vdata, vshape, vdtype;
+  rb_scan_args(argc, argv, "21", &vdata, &vshape, &vdtype);
+  StringValue(vdata);
+  Check_Type(vshape, T_ARRAY);
+
+  tensor *p;
+  TypedData_Get_Struct(self, tensor, &tensor_data_type, p);
+  if (!NIL_P(p->vdata)) rb_raise(rb_eRuntimeError, "already initialized");
+
+  int32_t ndim = (int32_t)RARRAY_LEN(vshape);
+  int32_t *shape = ALLOCA_N(int32_t, ndim > 0 ? ndim : 1);
+  for (int32_t i = 0; i < ndim; i++)
+    shape[i] = NUM2INT(RARRAY_AREF(vshape, i));
+  set_tensor(p, rb_str_new_frozen(vdata), 0, get_dtype(vdtype), ndim, shape);
+
+  return Qnil;
+}
+
+static const char *tensor_ptr(tensor *p) {
+  return RSTRING_PTR(p->vdata) + p->offset;
+}
+
+static VALUE elem_value(const char *ptr, elem_type type) {
+  switch (type) {
+  case elem_type_uint8:   return INT2FIX(*(const uint8_t *)ptr);
+  case elem_type_int8:    return INT2FIX(*(const int8_t *)ptr);
+  case elem_type_int16:   return INT2FIX(*(const int16_t *)ptr);
+  case elem_type_int32:   return INT2NUM(*(const int32_t *)ptr);
+  case elem_type_int64:   return LL2NUM(*(const int64_t *)ptr);
+  case elem_type_float16: return DBL2NUM(half_to_float(*(const uint16_t *)ptr));
+  case elem_type_float32: return DBL2NUM(*(const float *)ptr);
+  case elem_type_float64: return DBL2NUM(*(const double *)ptr);
+  default:                return Qnil;
+  }
+}
+
+// Nested Arrays of `shape`, with the String pinned by the tensor.
+static VALUE nested_array(VALUE vdata, size_t offset, elem_type type,
+                          const int32_t *shape, int32_t ndim) {
+  size_t esize = elem_size(type);
+  if (ndim == 0) return elem_value(RSTRING_PTR(vdata) + offset, type);
+
+  VALUE vary = rb_ary_new_capa(shape[0]);
+  if (ndim == 1) {
+    for (int32_t i = 0; i < shape[0]; i++)
+      rb_ary_push(vary, elem_value(RSTRING_PTR(vdata) + offset + esize * i, type));
+    return vary;
+  }
+
+  size_t stride = esize;
+  for (int32_t d = 1; d < ndim; d++) stride *= shape[d];
+  for (int32_t i = 0; i < shape[0]; i++)
+    rb_ary_push(vary, nested_array(vdata, offset + stride * i, type, shape + 1, ndim - 1));
+  return vary;
+}
+
+static VALUE tensor_to_a(VALUE self) {
+  tensor *p = getTensor(self);
+  return nested_array(p->vdata, p->offset, p->type, p->shape, p->ndim);
+}
+
+// Flat Array of all elements
+static VALUE tensor_to_flat_a(VALUE self) {
+  tensor *p = getTensor(self);
+  int32_t length = (int32_t)p->length;
+  return nested_array(p->vdata, p->offset, p->type, &length, 1);
+}
+
+// Binary String of the elements
+static VALUE tensor_to_s(VALUE self) {
+  tensor *p = getTensor(self);
+  return rb_str_new(tensor_ptr(p), p->length * elem_size(p->type));
+}
+
+static VALUE tensor_shape(VALUE self) {
+  tensor *p = getTensor(self);
+  VALUE vshape = rb_ary_new_capa(p->ndim);
+  for (int32_t i = 0; i < p->ndim; i++)
+    rb_ary_push(vshape, INT2FIX(p->shape[i]));
+  return vshape;
+}
+
+static VALUE tensor_dtype(VALUE self) {
+  return dtype_symbol(getTensor(self)->dtype);
+}
+
+static VALUE tensor_ndim(VALUE self) {
+  return INT2FIX(getTensor(self)->ndim);
+}
+
+static VALUE tensor_size(VALUE self) {
+  return SIZET2NUM(getTensor(self)->length);
+}
+
+static VALUE tensor_bytesize(VALUE self) {
+  tensor *p = getTensor(self);
+  return SIZET2NUM(p->length * elem_size(p->type));
+}
+
+// tensor[i, j, ...] indexes the leading dimensions. A full index returns
+// the element, a partial one the sub-tensor sharing this tensor's data.
+static VALUE tensor_aref(int argc, VALUE *argv, VALUE self) {
+  tensor *p = getTensor(self);
+  if (argc == 0 || argc > p->ndim)
+    rb_raise(rb_eArgError, "wrong number of indices (given %d, expected 1..%d)",
+             argc, (int)p->ndim);
+
+  size_t stride = p->length * elem_size(p->type);
+  size_t offset = p->offset;
+  for (int i = 0; i < argc; i++) {
+    long index = NUM2LONG(argv[i]);
+    long dim = p->shape[i];
+    if (index < 0) index += dim;
+    if (index < 0 || index >= dim)
+      rb_raise(rb_eIndexError, "index %ld out of dimension %d of size %ld",
+               NUM2LONG(argv[i]), i, dim);
+    stride /= dim;
+    offset += stride * index;
+  }
+
+  if (argc == p->ndim) return elem_value(RSTRING_PTR(p->vdata) + offset, p->type);
+  VALUE vsub = wrap_tensor_alloc(cTensor);
+  set_tensor(DATA_PTR(vsub), p->vdata, offset, p->dtype, p->ndim - argc, p->shape + argc);
+  return vsub;
+}
+
+// Copies the variable into a new tensor, which is not affected by later runs.
+static VALUE wrap_model_get_tensor(VALUE self, VALUE vname) {
+  uint64_t started = stats_now();
+  model_variable *var = get_variable(self, vname);
+  VALUE vdata = rb_obj_freeze(rb_str_new(var->buf, var->size));
+  stats_record(self, stats_stage_output, stats_now() - started, var->size);
+  return make_tensor(vdata, 0, var->dtype, var->dims_length, var->dims);
+}
+
+void Init_menoh_tensor(VALUE mMenoh) {
+  cTensor = rb_define_class_under(mMenoh, "Tensor", rb_cObject);
+  rb_define_alloc_func(cTensor, wrap_tensor_alloc);
+  rb_define_method(cTensor, "initialize", RUBY_METHOD_FUNC(wrap_tensor_init), -1);
+  rb_define_method(cTensor, "shape", RUBY_METHOD_FUNC(tensor_shape), 0);
+  rb_define_method(cTensor, "dtype", RUBY_METHOD_FUNC(tensor_dtype), 0);
+  rb_define_method(cTensor, "ndim", RUBY_METHOD_FUNC(tensor_ndim), 0);
+  rb_define_method(cTensor, "size", RUBY_METHOD_FUNC(tensor_size), 0);
+  rb_define_method(cTensor, "bytesize", RUBY_METHOD_FUNC(tensor_bytesize), 0);
+  rb_define_method(cTensor, "[]", RUBY_METHOD_FUNC(tensor_aref), -1);
+  rb_define_method(cTensor, "to_a", RUBY_METHOD_FUNC(tensor_to_a), 0);
+  rb_define_method(cTensor, "to_flat_a", RUBY_METHOD_FUNC(tensor_to_flat_a), 0);
+  rb_define_method(cTensor, "to_s", RUBY_METHOD_FUNC(tensor_to_s), 0);
+
+  VALUE model = rb_const_get(mMenoh, rb_intern("MenohModel"));
+  rb_define_method(model, "get_tensor", RUBY_METHOD_FUNC(wrap_model_get_tensor), 1);
+}
@@ -1,22 +1,93 @@
 require 'menoh/version'
 require 'menoh/menoh_native'
+require 'menoh/model_pool'
+require 'menoh/batcher'
+require 'menoh/shape_cache'
+require 'menoh/future'
+require 'menoh/build_future'
+require 'menoh/pipeline'
+require 'menoh/tensor'
+require 'menoh/placement'
+require 'menoh/admission_queue'
 require 'json'
 
 module Menoh
   class Menoh
-    def initialize(file)
-      raise "No such file : #{file}" unless File.exist?(file)
+    # Loads an ONNX model from `file`, or from the serialized model in the
+    # binary String `data`. With `mmap: true` the file is parsed from a
+    # read-only mapping instead of being read into memory first.
+    #
+    # To share weights between forked workers (Unicorn, Puma in cluster
+    # mode), load and make the models in the master before forking and run
+    # them only in the workers: the backend memory holding the weights is
+    # then shared copy-on-write as long as nobody writes to it.
+    #
+    #   onnx = Menoh::Menoh.new('model.onnx', mmap: true)
+    #   pool = onnx.make_model_pool(option, size: 2)
+    #   # fork workers, then use pool in each of them
+    #
+    # The same works across Ractors in one process: a frozen instance is
+    # shareable, and each Ractor makes its own models from it.
+    #
+    #   onnx = Ractor.make_shareable(Menoh::Menoh.new('model.onnx'))
+    #   Ractor.new(onnx) { |onnx| onnx.make_model(option).run(dataset) }
+    #
+    # A built model holds its own copy of the weights, so the parsed model
+    # is only needed for further builds. #release frees it, and with
+    # `release_after_build: true` it is freed by the first make_model or
+    # make_model_pool.
+    def initialize(file = nil, data: nil, mmap: false, release_after_build: false)
+      @release_after_build = release_after_build
+      if data.nil?
+        raise "No such file : #{file}" unless File.exist?(file.to_s)
 
-      native_init file
+        if !mmap
+          native_init file
+        elsif respond_to?(:native_init_from_mmap, true)
+          native_init_from_mmap file
+        else
+          # no mmap(2) on this platform
+          native_init_from_memory File.binread(file)
+        end
+      else
+        raise 'Specify either a file or data' unless file.nil?
+        raise 'Invalid data' unless data.is_a?(String)
+        raise 'Loading from memory is not supported by this Menoh' unless respond_to?(:native_init_from_memory, true)
+
+        native_init_from_memory data
+      end
       yield self if block_given?
     end
 
+    # Loads the model on a background thread and returns a
+    # Menoh::BuildFuture of the Menoh::Menoh. The ONNX file is parsed without
+    # the GVL, so a server can load a new model while it keeps serving.
+    def self.load_async(file = nil, **options)
+      BuildFuture.new { new(file, **options) }
+    end
+
     def make_model(option)
       raise "Required ':backend' : #{option[:backend]}" if option[:backend].nil?
       model = MenohModel.new self, option
+      release if @release_after_build
       yield model if block_given?
       model
     end
+
+    # make_model on a background thread, returning a Menoh::BuildFuture of the
+    # MenohModel. The model is optimized, built and warmed up (see the
+    # ':warmup' option) without holding the GVL.
+    def make_model_async(option)
+      BuildFuture.new { make_model(option) }
+    end
+
+    def make_model_pool(option, size:, capacity: nil)
+      raise "Required ':backend' : #{option[:backend]}" if option[:backend].nil?
+      pool = ModelPool.new self, option, size: size, capacity: capacity
+      release if @release_after_build
+      yield pool if block_given?
+      pool
+    end
   end
 
   class MenohModel
@@ -38,43 +109,351 @@ module Menoh
       if option.has_key?(:backend_config)
         config = option[:backend_config]
         unless config.nil? || config.is_a?(String)
-          option[:backend_config] = JSON.dump(config)
+          # JSON.dump reads module state that non-main Ractors cannot
+          option[:backend_config] = JSON.generate(config)
         end
       end
+      if option.key?(:external_buffers)
+        option[:external_buffers] = external_buffer_list(option)
+      end
+      option[:placement] = Placement.resolve(option[:placement]) unless option[:placement].nil?
 
       native_init menoh, option
       @option = option
+      @admission = admission_queue(option[:admission])
+      warmup(option[:warmup]) unless option[:warmup].nil?
       yield self if block_given?
     end
 
-    def run(dataset)
+    # Menoh::AdmissionQueue of the ':admission' option, or nil
+    attr_reader :admission
+
+    # { runs: n, cold: seconds, warm: seconds } of the last #warmup, or nil
+    attr_reader :warmup_latency
+
+    # Runs the model `runs` times on zeroed inputs of the declared dims and
+    # dtype, so that the backend's lazy setup on the first run is not paid by
+    # the first real request. Built with the ':warmup' option, this is done
+    # before make_model returns. The latency of the first run is recorded as
+    # cold and the median of the others as warm (nil after a single run).
+    # Warmup runs are not counted in #stats.
+    def warmup(runs = 1)
+      raise "Invalid warmup : #{runs}" unless runs.is_a?(Integer) && runs >= 0
+
+      @pending&.wait
+      @pending = nil
+      times = native_warmup(runs)
+      return @warmup_latency if times.empty?
+
+      warm = times.drop(1).sort
+      @warmup_latency = { runs: runs, cold: times.first, warm: warm[warm.length / 2] }
+    end
+
+    # With `tensors: true` the data of each result is a Menoh::Tensor, which
+    # builds Ruby objects only for the elements that are read.
+    #
+    # With a `deadline` (see Menoh::AdmissionQueue) the run raises
+    # Menoh::DeadlineExceeded without touching the model when it cannot start
+    # in time. Built with `admission: { capacity: n }`, concurrent runs of the
+    # model wait in an admission queue of at most n requests.
+    #
+    # With `into: slots` from #output_slots the outputs are copied into the
+    # buffers of the slots, which are returned instead of new results, so a
+    # loop reusing the slots allocates nothing per run.
+    def run(dataset, tensors: false, deadline: nil, into: nil)
+      results = admit(deadline) { run_now(dataset, tensors, into) }
+      yield results if block_given?
+      results
+    end
+
+    # Runs on binary input Strings, a Hash of input names to Strings in the
+    # inputs' dtype, and returns a frozen Hash of output names to binary
+    # Strings. Copies and the run happen without the GVL. Like #run, this
+    # waits for a pending run_async and goes through the admission queue.
+    #
+    #   model.run_raw('input' => data)
+    #   model.run_raw({ 'input' => data }, deadline: deadline)
+    def run_raw(inputs = nil, deadline: nil, **named_inputs)
+      # a braceless Hash of String names arrives as keywords
+      inputs ||= named_inputs
+      results = admit(deadline) do
+        @pending&.wait
+        @pending = nil
+        native_run_raw(inputs)
+      end
+      yield results if block_given?
+      results
+    end
+
+    # Submits the run to the native worker pool and returns a Menoh::Future
+    # right away. A model runs one dataset at a time, so this first waits for
+    # the previous run_async of the same model.
+    def run_async(dataset)
+      set_dataset(dataset)
+      submit_async(nil)
+    end
+
+    # Queues a run on binary input Strings, one per input layer in the order
+    # of input_layers. The Strings are copied into the model right before the
+    # run and stay locked until it is done, so this does not wait for the
+    # previous run of the model.
+    def run_staged_async(inputs)
+      submit_async(inputs)
+    end
+
+    def input_layers
+      @option[:input_layers].map { |l| l[:name] }
+    end
+
+    def output_layers
+      @option[:output_layers]
+    end
+
+    # Returns a Menoh::Pipeline filling `depth` staging sets of this model.
+    def pipeline(depth: 2)
+      pipeline = Pipeline.new self, depth: depth
+      yield pipeline if block_given?
+      pipeline
+    end
+
+    # Sets a batch of images packed as height x width x channels uint8 values
+    # (e.g. RMagick's export_pixels_to_str with CharPixel) into the input
+    # variable, which is laid out as :nchw or :nhwc. Each value v becomes
+    # (v * scale - mean) / std, where mean and std are a Numeric or one value
+    # per channel.
+    def set_image_data(name, data, layout: :nchw, mean: 0.0, std: 1.0, scale: 1.0)
+      raise "Invalid layout : #{layout}" unless %i[nchw nhwc].include?(layout)
+
+      native_set_image_data name, data, layout == :nchw, Array(mean), Array(std), scale
+    end
+
+    # Reusable results for run(dataset, into: slots), in the format of #run
+    # except that the data of each output is flat: a binary String in the
+    # output's dtype with `format: :string`, an Array with `format: :array`.
+    def output_slots(format: :string)
+      raise "Invalid format : #{format}" unless %i[string array].include?(format)
+
+      @option[:output_layers].map do |name|
+        data = format == :string ? get_data_str(name) : get_data(name)
+        { name: name, shape: get_shape(name), data: data }
+      end
+    end
+
+    # Runs the model over a file of fixed-size records, batch_size (dims[0])
+    # records at a time. `source` is a path or a File, whose data from
+    # `offset` on are records of the inputs laid out as in `record_layout`,
+    # a Hash of input names to their dtype in the file (nil for the input's
+    # own dtype) in the order of the fields of a record:
+    #
+    #   model.each_batch('images.bin', record_layout: { 'input' => :uint8 },
+    #                    output: 'scores.bin')
+    #
+    # The file is memory-mapped and copied into the inputs without Ruby
+    # objects per record. Outputs are written to `output` (a path or an IO),
+    # one row of each output per record, and/or yielded per batch as reused
+    # output slots (see #output_slots) with the Range of their records.
+    # Without a block or output this returns an Enumerator. Returns the
+    # number of records.
+    def each_batch(source, record_layout:, output: nil, offset: 0, &block)
+      if block.nil? && output.nil?
+        return enum_for(:each_batch, source, record_layout: record_layout, offset: offset)
+      end
+      raise 'each_batch needs mmap(2), which is not available on this platform' unless respond_to?(:native_each_batch, true)
+
+      fields = record_fields(record_layout)
+      @pending&.wait
+      @pending = nil
+      with_file(source, 'rb') do |input|
+        with_file(output, 'wb') do |out|
+          out&.flush
+          slots = block && output_slots
+          native_each_batch(input.fileno, offset, fields, out&.fileno) do |first, count|
+            yield batch_slots(slots, count), first...(first + count) if block
+          end
+        end
+      end
+    end
+
+    # Returns the variable as Numo::NArray. Numo must be loaded by the caller.
+    def get_narray(name)
+      Util.numo_class(get_dtype(name)).from_binary(get_data_str(name), get_shape(name))
+    end
+
+    private
+
+    def admit(deadline, &block)
+      return @admission.enter(deadline, &block) if @admission
+
+      if deadline && Process.clock_gettime(Process::CLOCK_MONOTONIC) >= deadline
+        raise DeadlineExceeded, 'the deadline has already passed'
+      end
+
+      yield
+    end
+
+    # admission: true or { capacity: n }
+    def admission_queue(admission)
+      case admission
+      when nil, false
+        nil
+      when true
+        AdmissionQueue.new
+      when Hash
+        AdmissionQueue.new(capacity: admission[:capacity])
+      else
+        raise "Invalid admission : #{admission}"
+      end
+    end
+
+    # [input index, dtype] of each field of a record
+    def record_fields(record_layout)
+      raise 'Invalid record_layout' unless record_layout.is_a?(Hash)
+
+      names = input_layers
+      unless record_layout.keys.sort == names.sort
+        raise "Invalid record_layout: expected fields #{names} actual #{record_layout.keys}"
+      end
+
+      record_layout.map do |name, dtype|
+        index = names.index(name)
+        [index, dtype || get_dtype(index)]
+      end
+    end
+
+    def with_file(file, mode, &block)
+      return yield(file) if file.nil? || file.is_a?(IO)
+
+      File.open(file, mode, &block)
+    end
+
+    # The slots filled with the outputs of the current batch, whose rows are
+    # cut down to the records of a short last batch.
+    def batch_slots(slots, count)
+      slots.each do |slot|
+        get_data_into(slot[:name], slot[:data])
+        next if slot[:shape][0] == count
+
+        rows = get_shape(slot[:name])[0]
+        slot[:data] = slot[:data].byteslice(0, slot[:data].bytesize / rows * count)
+        slot[:shape] = [count] + slot[:shape].drop(1)
+      end
+    end
+
+    def run_now(dataset, tensors, slots)
+      set_dataset(dataset)
+
+      # run
+      native_run
+      return slots.each { |slot| get_data_into(slot[:name], slot[:data]) } if slots
+
+      # reshape result
+      # outputs follow the inputs in the binding plan, so address them by index
+      output_offset = @option[:input_layers].length
+      @option[:output_layers].each_with_index.map do |name, i|
+        index = output_offset + i
+        if tensors
+          tensor = get_tensor(index)
+          { name: name, shape: tensor.shape, data: tensor }
+        else
+          # no String copy of the output for plain Arrays
+          { name: name, shape: get_shape(index), data: timed_reshape(index, get_data(index)) }
+        end
+      end
+    end
+
+    def submit_async(staged_inputs)
+      @async_reader, @async_writer = IO.pipe if @async_reader.nil?
+      # finished runs leave the chain of futures instead of piling up
+      if @pending&.done? && @pending.wait(0)
+        @pending = nil
+      else
+        @pending&.release_finished
+      end
+      job = native_run_async(@async_writer.fileno, staged_inputs)
+      # runs of one model finish in submission order
+      @pending = Future.new(job, @async_reader, @option[:output_layers],
+                            @option[:input_layers].length, @pending)
+    end
+
+    def set_dataset(dataset)
       raise 'Invalid dataset' if !dataset.instance_of?(Array) || dataset.empty?
       if dataset.length != @option[:input_layers].length
         raise "Invalid input num: expected==#{@option[:input_layers].length} actual==#{dataset.length}"
       end
+
+      # the buffers belong to the pending async run until it is done
+      @pending&.wait
+      @pending = nil
       dataset.each do |input|
-        if !input[:data].instance_of?(Array) || input[:data].empty?
+        # Array or an object exporting MemoryView such as Numo::NArray
+        data = input[:data]
+        if data.nil? || (data.instance_of?(Array) && data.empty?)
           raise "Invalid dataset for layer #{input[:name]}"
         end
         set_data(input[:name], input[:data])
       end
+    end
 
-      # run
-      native_run
+    # Normalizes the ':external_buffers' option into [name, buffer] pairs.
+    # A buffer is either a binary String owned by the caller or :arena for
+    # aligned native memory owned by the model. Caller Strings cannot be
+    # modified while a run uses them.
+    def external_buffer_list(option)
+      buffers = option[:external_buffers]
+      return nil if buffers.nil?
 
-      # reshape result
-      results = @option[:output_layers].map do |name|
-        buffer = get_data(name)
-        shape = get_shape(name)
-        { name: name, shape: shape, data: Util.reshape(buffer, shape) }
+      if buffers == :arena
+        names = option[:input_layers].map { |l| l[:name] } + option[:output_layers]
+        return names.map { |name| [name, :arena] }
       end
+      raise "Invalid ':external_buffers'" unless buffers.is_a?(Hash)
 
-      yield results if block_given?
-      results
+      buffers.map do |name, buffer|
+        unless buffer.is_a?(String) || buffer == :arena
+          raise "Invalid external buffer for #{name}"
+        end
+
+        [name.to_s, buffer]
+      end
     end
   end
 
   module Util
+    # constants hold only shareable values so that Ractors can read them
+    NUMO_CLASS_NAMES = {
+      float32: :SFloat,
+      float64: :DFloat,
+      int8: :Int8,
+      int16: :Int16,
+      int32: :Int32,
+      int64: :Int64
+    }.freeze
+
+    # String#unpack directives of each dtype in native byte order
+    PACK_DIRECTIVES = {
+      float32: 'f*'.freeze,
+      float64: 'd*'.freeze,
+      int8: 'c*'.freeze,
+      int16: 's*'.freeze,
+      int32: 'l*'.freeze,
+      int64: 'q*'.freeze
+    }.freeze
+
+    def self.numo_class(dtype)
+      raise 'Numo::NArray is not loaded' unless defined?(::Numo::NArray)
+      raise "Unsupported dtype for Numo::NArray : #{dtype}" unless NUMO_CLASS_NAMES.key?(dtype)
+
+      ::Numo.const_get(NUMO_CLASS_NAMES[dtype])
+    end
+
+    # Nested Arrays of a tensor in the format of Util.reshape
+    def self.nested_data(tensor)
+      # Util.reshape splits a 1-D buffer into one-element Arrays
+      return reshape(tensor.to_flat_a, tensor.shape) if tensor.ndim < 2
+
+      tensor.to_a
+    end
+
     def self.reshape(buffer, shape)
       sliced_buffer = buffer.each_slice(buffer.length / shape[0]).to_a
       if shape.length > 2
@@ -0,0 +1,24 @@
+module Menoh
+  # Bounded admission in front of one model or a pool of models.
+  #
+  # At most `concurrency` blocks passed to #enter run at once, and at most
+  # `capacity` requests (unbounded if nil) wait for their turn. A request
+  # with a deadline, a Float of Process.clock_gettime(Process::CLOCK_MONOTONIC),
+  # is rejected with Menoh::DeadlineExceeded instead of waiting when it
+  # cannot start in time, so an overloaded model sheds work before spending
+  # CPU on it. #stats reports the queue depth and the shed requests.
+  #
+  #   deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.05
+  #   model.run(dataset, deadline: deadline)
+  class AdmissionQueue
+    def initialize(concurrency: 1, capacity: nil)
+      native_init concurrency, capacity
+      yield self if block_given?
+    end
+
+    # Absolute deadline `timeout` seconds from now, or nil
+    def self.deadline(timeout)
+      timeout && Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout
+    end
+  end
+end
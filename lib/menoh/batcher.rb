@@ -0,0 +1,18 @@
+module Menoh
+  # Dynamic micro-batching over the batch dimension of one model.
+  #
+  # The model must be built with dims[0] = max batch size for every input and
+  # output. Batcher#run takes one sample per input as a binary String and
+  # blocks until the batch holding it has been run, which happens when the
+  # batch is full or max_latency_us after its first sample arrived.
+  #
+  # The model must not be used by other code while a batcher serves it.
+  class Batcher
+    def initialize(model, max_latency_us: 1000)
+      raise 'Invalid model' unless model.instance_of?(MenohModel)
+
+      native_init model, max_latency_us
+      yield self if block_given?
+    end
+  end
+end
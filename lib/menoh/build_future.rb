@@ -0,0 +1,80 @@
+module Menoh
+  # The pending result of Menoh::Menoh.load_async and
+  # Menoh::Menoh#make_model_async.
+  #
+  # The work runs on a Ruby thread. Parsing, optimizing and building a model
+  # release the GVL, so the other threads keep serving meanwhile.
+  class BuildFuture
+    class TimeoutError < Error; end
+
+    def initialize
+      @mutex = Mutex.new
+      @cond = ConditionVariable.new
+      @done = false
+      @callbacks = []
+      @thread = Thread.new do
+        @value = yield
+      rescue Exception => e
+        @error = e
+      ensure
+        complete
+      end
+    end
+
+    def done?
+      @mutex.synchronize { @done }
+    end
+
+    # Waits up to `timeout` seconds (forever if nil) for the work.
+    # Returns self, or nil on timeout.
+    def wait(timeout = nil)
+      deadline = timeout && Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout
+      @mutex.synchronize do
+        until @done
+          if deadline
+            remaining = deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+            return nil if remaining <= 0
+
+            @cond.wait(@mutex, remaining)
+          else
+            @cond.wait(@mutex)
+          end
+        end
+      end
+      self
+    end
+
+    # The Menoh::Menoh or MenohModel built. Raises the error of the build, or
+    # BuildFuture::TimeoutError when it is not done in time.
+    def value(timeout = nil)
+      raise TimeoutError, "The build is not done in #{timeout} seconds" unless wait(timeout)
+      raise @error if @error
+
+      @value
+    end
+
+    # Calls the block with this future once the work is done. The block runs
+    # on the building thread, or right away if it is done already.
+    def on_complete(&block)
+      raise ArgumentError, 'No block given' unless block
+
+      done = @mutex.synchronize do
+        @callbacks.push(block) unless @done
+        @done
+      end
+      block.call(self) if done
+      self
+    end
+
+    private
+
+    def complete
+      callbacks = @mutex.synchronize do
+        @done = true
+        @cond.broadcast
+        @callbacks.slice!(0..)
+      end
+      callbacks.each { |callback| callback.call(self) }
+    end
+  end
+end
@@ -0,0 +1,116 @@
+require 'io/wait'
+
+module Menoh
+  # The pending result of MenohModel#run_async.
+  #
+  # The run happens on a native worker thread. Waiting blocks on a pipe the
+  # worker writes to when it is done, so under a Fiber.scheduler only the
+  # waiting fiber is suspended.
+  class Future
+    class TimeoutError < Error; end
+
+    # `previous` is the future of the run submitted before on the same model.
+    # Runs of one model signal the shared pipe in submission order, so the
+    # previous run must be consumed before this one.
+    def initialize(job, reader, output_layers, output_offset, previous = nil)
+      @job = job
+      @previous = previous
+      @reader = reader
+      @output_layers = output_layers
+      @output_offset = output_offset
+      @mutex = Mutex.new
+      @resolved = false
+      @callbacks = []
+      @watcher = nil
+    end
+
+    def done?
+      @job.done?
+    end
+
+    # Waits up to `timeout` seconds (forever if nil) for the run.
+    # Returns self, or nil on timeout.
+    def wait(timeout = nil)
+      deadline = timeout && Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout
+      callbacks = @mutex.synchronize do
+        unless @resolved
+          return nil if @previous && !@previous.wait(remaining(deadline))
+
+          @previous = nil
+          return nil unless @reader.wait_readable(remaining(deadline))
+
+          @reader.read_nonblock(1)
+          @job.finish
+          @resolved = true
+        end
+        @callbacks.slice!(0..)
+      end
+      callbacks.each { |callback| callback.call(self) }
+      self
+    end
+
+    # Results in the same format as MenohModel#run. Raises Menoh::Error when
+    # the run failed and Future::TimeoutError when it is not done in time.
+    def value(timeout = nil, tensors: false)
+      raise TimeoutError, "The run is not done in #{timeout} seconds" unless wait(timeout)
+
+      @values ||= {}
+      @values[tensors] ||= build_results(@job.result, tensors)
+    end
+
+    # Calls the block with this future once the run is done. The block runs
+    # on the thread that observed completion.
+    def on_complete(&block)
+      raise ArgumentError, 'No block given' unless block
+
+      resolved = @mutex.synchronize do
+        @callbacks.push(block) unless @resolved
+        @watcher ||= Thread.new { wait } unless @resolved
+        @resolved
+      end
+      block.call(self) if resolved
+      self
+    end
+
+    # Resolves, without blocking, the finished runs this one is queued
+    # behind. Runs of a model finish in submission order, so they are the
+    # oldest of the chain; dropping them lets them and their output Strings
+    # be collected while nobody waits for the newer runs.
+    def release_finished
+      link = self
+      while (previous = link.previous_future)
+        if previous.done?
+          link.drop_previous if previous.wait(0)
+          break
+        end
+        link = previous
+      end
+      self
+    end
+
+    protected
+
+    def previous_future
+      @mutex.synchronize { @previous }
+    end
+
+    def drop_previous
+      @mutex.synchronize { @previous = nil }
+    end
+
+    private
+
+    def remaining(deadline)
+      deadline && [deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC), 0].max
+    end
+
+    def build_results(buffers, tensors)
+      model = @job.model
+      @output_layers.each_with_index.map do |name, i|
+        shape = model.get_shape(@output_offset + i)
+        tensor = Tensor.new(buffers[i], shape, model.get_dtype(@output_offset + i))
+        { name: name, shape: shape, data: tensors ? tensor : model.__send__(:timed_nested_data, tensor) }
+      end
+    end
+  end
+end
@@ -0,0 +1,89 @@
+module Menoh
+  # A fixed set of MenohModel instances built from one Menoh::Menoh with the
+  # same option. Each model has its own variable buffers, so up to `size`
+  # inferences can run concurrently (MenohModel#run releases the GVL).
+  # Runs beyond that wait in a Menoh::AdmissionQueue of at most `capacity`
+  # requests (unbounded if nil).
+  class ModelPool
+    class TimeoutError < Error; end
+
+    attr_reader :size, :admission
+
+    def initialize(menoh, option, size:, capacity: nil)
+      raise "Invalid pool size : #{size}" unless size.is_a?(Integer) && size > 0
+
+      @size = size
+      @models = Array.new(size) do |i|
+        MenohModel.new(menoh, option.merge(placement: Placement.for_model(option[:placement], i)))
+      end
+      @available = @models.dup
+      @admission = AdmissionQueue.new(concurrency: size, capacity: capacity)
+      @mutex = Mutex.new
+      @cond = ConditionVariable.new
+      yield self if block_given?
+    end
+
+    # MenohModel#warmup_latency of each model, built with the ':warmup' option
+    def warmup_latency
+      @models.map(&:warmup_latency)
+    end
+
+    def available
+      @mutex.synchronize { @available.length }
+    end
+
+    # Takes a free model, waiting up to `timeout` seconds (forever if nil).
+    def checkout(timeout: nil)
+      deadline = timeout && Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout
+      @mutex.synchronize do
+        while @available.empty?
+          if deadline
+            remaining = deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+            raise TimeoutError, "No model available in #{timeout} seconds" if remaining <= 0
+
+            @cond.wait(@mutex, remaining)
+          else
+            @cond.wait(@mutex)
+          end
+        end
+        @available.pop
+      end
+    end
+
+    def checkin(model)
+      raise 'The model does not belong to this pool' unless @models.any? { |m| m.equal?(model) }
+
+      @mutex.synchronize do
+        raise 'The model is already checked in' if @available.any? { |m| m.equal?(model) }
+
+        @available.push(model)
+        @cond.signal
+      end
+      nil
+    end
+
+    def with(timeout: nil)
+      model = checkout(timeout: timeout)
+      begin
+        yield model
+      ensure
+        checkin(model)
+      end
+    end
+
+    # Runs on a free model. Raises Menoh::DeadlineExceeded when the run cannot
+    # start within `timeout` seconds or before `deadline` (see
+    # Menoh::AdmissionQueue).
+    def run(dataset, timeout: nil, deadline: nil)
+      deadline = [deadline, AdmissionQueue.deadline(timeout)].compact.min
+      results = @admission.enter(deadline) do
+        # a model is free unless one is checked out outside of run
+        with(timeout: deadline && [deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC), 0].max) do |model|
+          model.run(dataset)
+        end
+      end
+      yield results if block_given?
+      results
+    end
+  end
+end
@@ -0,0 +1,88 @@
+module Menoh
+  # Double (or deeper) buffered inputs for one MenohModel.
+  #
+  # Each stage is a set of binary input buffers. While the model computes on
+  # one stage, the caller fills the next; the worker copies a stage into the
+  # model right before its run. A stage is handed out again once the run
+  # that used it is done.
+  #
+  #   pipeline = model.pipeline(depth: 2)
+  #   futures = images.map { |image| pipeline.run([{ name: 'x', data: preprocess(image) }]) }
+  #   futures.each { |future| p future.value }
+  class Pipeline
+    # A set of staging buffers, one binary String per input variable.
+    class Stage
+      attr_reader :buffers
+      attr_accessor :future
+
+      def initialize(model)
+        @names = model.input_layers
+        @directives = @names.map { |name| Util::PACK_DIRECTIVES.fetch(model.get_dtype(name)) }
+        @buffers = @names.map { |name| String.new(capacity: model.get_data_str(name).bytesize) }
+        @future = nil
+      end
+
+      # `data` is an Array, a binary String, or an object responding to
+      # to_binary such as Numo::NArray.
+      def set_data(name, data)
+        i = @names.index(name)
+        raise "Invalid input name : #{name}" if i.nil?
+
+        buffer = @buffers[i].clear
+        if data.is_a?(Array)
+          data.pack(@directives[i], buffer: buffer)
+        elsif data.is_a?(String)
+          buffer << data
+        elsif data.respond_to?(:to_binary)
+          buffer << data.to_binary
+        else
+          raise "Invalid dataset for layer #{name}"
+        end
+        self
+      end
+    end
+
+    attr_reader :model, :depth
+
+    def initialize(model, depth: 2)
+      raise 'Invalid model' unless model.instance_of?(MenohModel)
+      raise "Invalid pipeline depth : #{depth}" unless depth.is_a?(Integer) && depth >= 2
+
+      @model = model
+      @depth = depth
+      @stages = Array.new(depth) { Stage.new(model) }
+      @next = 0
+      @mutex = Mutex.new
+      yield self if block_given?
+    end
+
+    # Returns the next stage to fill, waiting for the run that used it.
+    def stage
+      stage = @mutex.synchronize do
+        s = @stages[@next]
+        @next = (@next + 1) % @depth
+        s
+      end
+      stage.future&.wait
+      stage.future = nil
+      stage
+    end
+
+    # Queues the run of a filled stage and returns its Menoh::Future.
+    def submit(stage)
+      raise 'The stage does not belong to this pipeline' unless @stages.any? { |s| s.equal?(stage) }
+
+      @mutex.synchronize do
+        stage.future = @model.run_staged_async(stage.buffers)
+      end
+    end
+
+    # Fills the next stage with `dataset` in the format of MenohModel#run and
+    # submits it.
+    def run(dataset)
+      stage = self.stage
+      dataset.each { |input| stage.set_data(input[:name], input[:data]) }
+      submit(stage)
+    end
+  end
+end
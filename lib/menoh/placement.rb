@@ -0,0 +1,68 @@
+module Menoh
+  # The ':placement' option of make_model pins a model to a set of CPUs:
+  #
+  #   onnx.make_model(option.merge(placement: { cpus: 0..7 }))
+  #   onnx.make_model(option.merge(placement: { numa_node: 1 }))
+  #
+  # The thread that builds or runs the model is pinned to those CPUs for
+  # the call. Memory is placed on first touch, so what that thread
+  # allocates and touches usually lands on their NUMA node; no memory
+  # policy is applied, and backend threads (e.g. a shared OpenMP pool) are
+  # not pinned. ':numa_node' only selects the CPUs of the node.
+  # A pool takes one placement for all models, an Array of placements
+  # cycled over the models, or :numa to spread the models over the nodes.
+  module Placement
+    NODE_DIR = '/sys/devices/system/node'.freeze
+
+    # CPUs of each NUMA node, e.g. { 0 => [0, 1, 2, 3], 1 => [4, 5, 6, 7] },
+    # or an empty Hash where the topology is unknown.
+    def self.numa_nodes
+      Dir.glob(File.join(NODE_DIR, 'node[0-9]*')).to_h do |dir|
+        [File.basename(dir).delete_prefix('node').to_i,
+         parse_cpu_list(File.read(File.join(dir, 'cpulist')))]
+      end.reject { |_, cpus| cpus.empty? }.sort.to_h
+    end
+
+    # "0-3,8-11" style lists of the kernel
+    def self.parse_cpu_list(list)
+      list.strip.split(',').flat_map do |range|
+        first, last = range.split('-').map { |cpu| Integer(cpu, 10) }
+        (first..(last || first)).to_a
+      end
+    end
+
+    # Normalizes a placement Hash into { cpus: [...], numa_node: n or nil }.
+    def self.resolve(placement)
+      raise "Invalid placement : #{placement}" unless placement.is_a?(Hash)
+
+      node = placement[:numa_node]
+      cpus = placement[:cpus]
+      if cpus.nil?
+        raise "Required ':cpus' or ':numa_node' for placement" if node.nil?
+
+        cpus = numa_nodes.fetch(node) { raise "Unknown NUMA node : #{node}" }
+      end
+      cpus = cpus.to_a
+      if cpus.empty? || !cpus.all? { |cpu| cpu.is_a?(Integer) && cpu >= 0 }
+        raise "Invalid cpus for placement : #{placement[:cpus]}"
+      end
+
+      { cpus: cpus, numa_node: node }
+    end
+
+    # The placement of the index-th model of a pool
+    def self.for_model(placement, index)
+      case placement
+      when :numa
+        nodes = numa_nodes.keys
+        raise 'NUMA topology is not available' if nodes.empty?
+
+        { numa_node: nodes[index % nodes.length] }
+      when Array
+        placement[index % placement.length]
+      else
+        placement
+      end
+    end
+  end
+end
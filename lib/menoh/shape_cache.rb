@@ -0,0 +1,170 @@
+module Menoh
+  # Lazily builds and memoizes one MenohModel per distinct set of input dims
+  # from a single parsed ONNX model.
+  #
+  #   cache = Menoh::ShapeCache.new('model.onnx',
+  #                                 backend: 'mkldnn',
+  #                                 input_layers: [{ name: 'in' }],
+  #                                 output_layers: ['out'],
+  #                                 capacity: 4,
+  #                                 batch_buckets: [1, 2, 4, 8])
+  #   cache.run([{ name: 'in', dims: [3, 1, 28, 28], data: data }])
+  #
+  # The batch dimension (dims[0]) is rounded up to the smallest bucket that
+  # fits; Array inputs are zero-padded and outputs are cut back to the
+  # requested batch size. Least recently used models are evicted once more
+  # than `capacity` shapes are cached. Models are built outside the cache
+  # lock; concurrent misses for the same shape wait for the one build.
+  class ShapeCache
+    Entry = Struct.new(:model, :mutex, :error)
+
+    attr_reader :capacity, :batch_buckets, :hits, :misses, :evictions
+
+    def initialize(onnx, option)
+      option = option.dup
+      @capacity = option.delete(:capacity) || 8
+      @batch_buckets = (option.delete(:batch_buckets) || []).sort
+      prewarm_shapes = option.delete(:prewarm) || []
+      raise "Invalid capacity : #{@capacity}" unless @capacity.is_a?(Integer) && @capacity > 0
+      raise "Required ':backend' : #{option[:backend]}" if option[:backend].nil?
+      if option[:input_layers].nil? || option[:input_layers].empty?
+        raise "Required ':input_layers'"
+      end
+
+      @menoh = onnx.is_a?(Menoh) ? onnx : Menoh.new(onnx)
+      @option = option
+      @entries = {}
+      @mutex = Mutex.new
+      @built = ConditionVariable.new
+      @hits = 0
+      @misses = 0
+      @evictions = 0
+      prewarm(prewarm_shapes)
+      yield self if block_given?
+    end
+
+    def size
+      @mutex.synchronize { @entries.size }
+    end
+
+    # dims of each input layer of the cached models, least recently used first
+    def shapes
+      @mutex.synchronize { @entries.keys }
+    end
+
+    # Builds the models for a list of input dims lists ahead of time.
+    def prewarm(shapes)
+      shapes.each { |dims_list| model_for(dims_list) }
+      self
+    end
+
+    # Returns the model for a list of input dims (one per input layer, in the
+    # order of ':input_layers') after rounding the batch dimension.
+    def model_for(dims_list)
+      entry_for(bucket_dims_list(dims_list)).model
+    end
+
+    def run(dataset)
+      raise 'Invalid dataset' if !dataset.instance_of?(Array) || dataset.empty?
+
+      inputs = @option[:input_layers].map do |layer|
+        input = dataset.find { |x| x[:name] == layer[:name] }
+        raise "Missing input for layer #{layer[:name]}" if input.nil?
+        raise "Invalid dims for layer #{layer[:name]}" unless input[:dims].instance_of?(Array)
+
+        input
+      end
+      dims_list = inputs.map { |input| input[:dims] }
+      bucketed = bucket_dims_list(dims_list)
+      batch_size = dims_list.first.first
+
+      padded = inputs.zip(dims_list, bucketed).map do |input, dims, bucket_dims|
+        { name: input[:name], data: pad(input[:data], dims, bucket_dims) }
+      end
+
+      entry = entry_for(bucketed)
+      results = entry.mutex.synchronize { entry.model.run(padded) }
+      if batch_size != bucketed.first.first
+        results = results.map do |result|
+          shape = [batch_size] + result[:shape].drop(1)
+          { name: result[:name], shape: shape, data: result[:data].first(batch_size) }
+        end
+      end
+
+      yield results if block_given?
+      results
+    end
+
+    private
+
+    def bucket_dims_list(dims_list)
+      unless dims_list.instance_of?(Array) && dims_list.length == @option[:input_layers].length
+        raise "Invalid dims list: expected #{@option[:input_layers].length} dims"
+      end
+
+      batch_size = dims_list.first.first
+      bucket = @batch_buckets.find { |b| b >= batch_size } || batch_size
+      dims_list.map { |dims| [bucket] + dims.drop(1) }
+    end
+
+    def pad(data, dims, bucket_dims)
+      return data if dims == bucket_dims
+      raise 'Padding the batch dimension requires Array data' unless data.instance_of?(Array)
+
+      length = bucket_dims.inject(:*)
+      data + Array.new(length - data.length, 0)
+    end
+
+    def entry_for(dims_list)
+      entry, owner = reserve_entry(dims_list)
+      if owner
+        begin
+          entry.model = build_model(dims_list)
+        ensure
+          @mutex.synchronize do
+            if entry.model.nil?
+              # the build failed: forget the shape and let the waiters raise
+              @entries.delete(dims_list) if @entries[dims_list].equal?(entry)
+              entry.error = $! || RuntimeError.new("Failed to build model for #{dims_list}")
+            end
+            @built.broadcast
+          end
+        end
+      else
+        @mutex.synchronize do
+          @built.wait(@mutex) while entry.model.nil? && entry.error.nil?
+        end
+        raise entry.error if entry.error
+      end
+      entry
+    end
+
+    # Looks the shape up under the cache lock. A miss inserts a placeholder
+    # entry that the caller (the owner) builds the model for.
+    def reserve_entry(dims_list)
+      @mutex.synchronize do
+        entry = @entries.delete(dims_list)
+        owner = entry.nil?
+        if owner
+          @misses += 1
+          entry = Entry.new(nil, Mutex.new, nil)
+        else
+          @hits += 1
+        end
+        @entries[dims_list] = entry
+        while @entries.size > @capacity
+          @entries.delete(@entries.keys.first)
+          @evictions += 1
+        end
+        [entry, owner]
+      end
+    end
+
+    def build_model(dims_list)
+      input_layers = @option[:input_layers].zip(dims_list).map do |layer, dims|
+        layer.merge(dims: dims)
+      end
+      @menoh.make_model(@option.merge(input_layers: input_layers))
+    end
+  end
+end
@@ -0,0 +1,33 @@
+module Menoh
+  # An output of MenohModel#run(dataset, tensors: true) or
+  # MenohModel#get_tensor. The elements stay in a binary String until they
+  # are read, and tensor[i] returns the i-th batch row without copying.
+  class Tensor
+    include Enumerable
+
+    def length
+      shape.first || 0
+    end
+
+    # Yields the rows of the first dimension, or the elements of a 1-D tensor.
+    def each
+      return to_enum(:each) { length } unless block_given?
+
+      length.times { |i| yield self[i] }
+      self
+    end
+
+    # Returns the tensor as Numo::NArray. Numo must be loaded by the caller.
+    def to_narray
+      Util.numo_class(dtype).from_binary(to_s, shape)
+    end
+
+    def ==(other)
+      other.is_a?(Tensor) && dtype == other.dtype && shape == other.shape && to_s == other.to_s
+    end
+
+    def inspect
+      "#<#{self.class} #{dtype} #{shape}>"
+    end
+  end
+end
@@ -1,4 +1,7 @@
 require 'test_helper'
+require 'fiddle'
+require 'timeout'
+require 'tmpdir'
 
 MNIST_ONNX_FILE = 'example/data/mnist.onnx'.freeze
 MNIST_IN_NAME = '139900320569040'.freeze
@@ -70,6 +73,1145 @@ class MenohTest < Minitest::Test
     end
   end
 
+  def test_menoh_external_buffers
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    batch_size = 3
+    input_data = (0..(batch_size * 1 * 28 * 28 - 1)).map { |i| i % 256 }
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [
+        {
+          name: MNIST_IN_NAME,
+          dims: [batch_size, 1, 28, 28]
+        }
+      ],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    expected = onnx.make_model(model_opt).run([{ name: MNIST_IN_NAME, data: input_data }])
+
+    # caller-owned Strings
+    input_buffer = input_data.pack('e*')
+    output_buffer = "\0".b * (batch_size * 10 * 4)
+    model = onnx.make_model(model_opt.merge(external_buffers: {
+                                              MNIST_IN_NAME => input_buffer,
+                                              MNIST_OUT_NAME => output_buffer
+                                            }))
+    model.send(:native_run)
+    assert_equal(model.get_data_str(MNIST_OUT_NAME), output_buffer)
+    assert_equal(expected.first[:data].flatten, output_buffer.unpack('e*'))
+
+    # locked only while a run uses them
+    model.run([{ name: MNIST_IN_NAME, data: input_data }])
+    input_buffer.setbyte(0, input_buffer.getbyte(0))
+    output_buffer.setbyte(0, output_buffer.getbyte(0))
+
+    # and until an async job is finished
+    future = model.run_async([{ name: MNIST_IN_NAME, data: input_data }])
+    assert_raises(RuntimeError) { output_buffer << 'invalid' }
+    assert_raises(RuntimeError) { input_buffer.replace("\0".b * input_buffer.bytesize) }
+    assert_equal(expected, future.value(10))
+    input_buffer.setbyte(0, input_buffer.getbyte(0))
+    output_buffer.setbyte(0, output_buffer.getbyte(0))
+
+    # arenas owned by the model
+    model = onnx.make_model(model_opt.merge(external_buffers: :arena))
+    results = model.run([{ name: MNIST_IN_NAME, data: input_data }])
+    assert_equal(expected.first[:data], results.first[:data])
+
+    # wrong size
+    assert_raises do
+      onnx.make_model(model_opt.merge(external_buffers: { MNIST_IN_NAME => 'invalid' }))
+    end
+
+    # reallocated after build
+    model = onnx.make_model(model_opt.merge(external_buffers: { MNIST_OUT_NAME => output_buffer }))
+    output_buffer << 'invalid'
+    assert_raises(Menoh::Error) { model.get_data_str(MNIST_OUT_NAME) }
+  end
+
+  def test_menoh_memory_view
+    skip 'MemoryView is not supported' unless defined?(Fiddle::MemoryView)
+
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    batch_size = 3
+    input_data = (0..(batch_size * 1 * 28 * 28 - 1)).map { |i| i % 256 }
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [
+        {
+          name: MNIST_IN_NAME,
+          dims: [batch_size, 1, 28, 28]
+        }
+      ],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    expected = onnx.make_model(model_opt).run([{ name: MNIST_IN_NAME, data: input_data }])
+
+    # uint8 bytes are converted into float
+    model = onnx.make_model(model_opt)
+    pixels = Fiddle::Pointer[input_data.pack('C*')]
+    results = model.run([{ name: MNIST_IN_NAME, data: pixels }])
+    assert_equal(expected.first[:data], results.first[:data])
+
+    # output view
+    view = model.get_data_view(MNIST_OUT_NAME)
+    assert_equal([batch_size, 10], view.shape)
+    assert_equal(:float32, view.dtype)
+    assert_equal(model.get_data_str(MNIST_OUT_NAME), view.to_s)
+    memory_view = Fiddle::MemoryView.new(view)
+    assert_equal('f', memory_view.format)
+    assert_equal([batch_size, 10], memory_view.shape)
+    assert_equal(view.to_s, memory_view.to_s)
+    memory_view.release
+
+    # a view can be an input of another model
+    other = onnx.make_model(model_opt)
+    other.set_data(MNIST_IN_NAME, model.get_data_view(MNIST_IN_NAME))
+    assert_equal(model.get_data_str(MNIST_IN_NAME), other.get_data_str(MNIST_IN_NAME))
+
+    # wrong length
+    assert_raises { model.set_data(MNIST_IN_NAME, Fiddle::Pointer['invalid']) }
+  end
+
+  def test_menoh_model_pool
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    batch_size = 3
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [
+        {
+          name: MNIST_IN_NAME,
+          dims: [batch_size, 1, 28, 28]
+        }
+      ],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    pool = onnx.make_model_pool(model_opt, size: 2)
+    assert_instance_of(Menoh::ModelPool, pool)
+    assert_equal(2, pool.size)
+    assert_equal(2, pool.available)
+
+    threads = (0..3).map do |n|
+      Thread.new do
+        imageset = [
+          {
+            name: MNIST_IN_NAME,
+            data: Array.new(batch_size * 1 * 28 * 28, n)
+          }
+        ]
+        [n, pool.run(imageset, timeout: 10)]
+      end
+    end
+    single = onnx.make_model(model_opt)
+    threads.map(&:value).each do |n, results|
+      expected = single.run([{ name: MNIST_IN_NAME, data: Array.new(batch_size * 1 * 28 * 28, n) }])
+      assert_equal(expected.first[:data], results.first[:data])
+    end
+    assert_equal(2, pool.available)
+
+    models = [pool.checkout, pool.checkout]
+    assert_raises(Menoh::ModelPool::TimeoutError) { pool.checkout(timeout: 0.01) }
+    models.each { |model| pool.checkin(model) }
+    assert_raises { pool.checkin(single) }
+  end
+
+  def test_menoh_variable_index
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    batch_size = 3
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [
+        {
+          name: MNIST_IN_NAME,
+          dims: [batch_size, 1, 28, 28]
+        }
+      ],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    model = onnx.make_model(model_opt)
+    assert_equal(0, model.variable_index(MNIST_IN_NAME))
+    assert_equal(1, model.variable_index(MNIST_OUT_NAME))
+    assert_equal(model.get_shape(MNIST_IN_NAME), model.get_shape(0))
+    assert_equal([batch_size, 10], model.get_shape(1))
+    assert_equal(:float32, model.get_dtype(1))
+
+    model.set_data(0, Array.new(batch_size * 1 * 28 * 28, 1))
+    model.send(:native_run)
+    assert_equal(model.get_data(MNIST_OUT_NAME), model.get_data(1))
+
+    assert_raises(Menoh::IndexOutOfRange) { model.get_data(2) }
+    assert_raises(Menoh::VariableNotFound) { model.get_data('invalid') }
+  end
+
+  def test_menoh_run_raw
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    batch_size = 3
+    input_data = (0..(batch_size * 1 * 28 * 28 - 1)).map { |i| i % 256 }
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [
+        {
+          name: MNIST_IN_NAME,
+          dims: [batch_size, 1, 28, 28]
+        }
+      ],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    model = onnx.make_model(model_opt)
+    expected = model.run([{ name: MNIST_IN_NAME, data: input_data }])
+
+    input = input_data.pack('e*')
+    results = model.run_raw(MNIST_IN_NAME => input)
+    assert(results.frozen?)
+    assert_equal([MNIST_OUT_NAME], results.keys)
+    assert_equal(Encoding::ASCII_8BIT, results[MNIST_OUT_NAME].encoding)
+    assert_equal(expected.first[:data].flatten, results[MNIST_OUT_NAME].unpack('e*'))
+
+    # the input String is unlocked again
+    input << 'x'
+
+    assert_raises(ArgumentError) { model.run_raw(MNIST_IN_NAME => 'invalid') }
+    assert_raises(ArgumentError) { model.run_raw(MNIST_OUT_NAME => results[MNIST_OUT_NAME]) }
+    assert_raises(Menoh::VariableNotFound) { model.run_raw('invalid' => input) }
+
+    # a pending run_async is waited for, and deadlines apply as for run
+    input = input_data.pack('e*')
+    future = model.run_async([{ name: MNIST_IN_NAME, data: Array.new(input_data.length, 0) }])
+    assert_equal(expected.first[:data].flatten, model.run_raw(MNIST_IN_NAME => input)[MNIST_OUT_NAME].unpack('e*'))
+    assert(future.done?)
+    past = Process.clock_gettime(Process::CLOCK_MONOTONIC) - 1
+    assert_raises(Menoh::DeadlineExceeded) { model.run_raw({ MNIST_IN_NAME => input }, deadline: past) }
+    admitted = onnx.make_model(model_opt.merge(admission: true))
+    admitted.run_raw(MNIST_IN_NAME => input)
+    assert_equal(1, admitted.admission.stats[:admitted])
+  end
+
+  def test_menoh_batcher
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    batch_size = 4
+    sample_length = 1 * 28 * 28
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [
+        {
+          name: MNIST_IN_NAME,
+          dims: [batch_size, 1, 28, 28]
+        }
+      ],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    single = onnx.make_model(model_opt)
+    batcher = Menoh::Batcher.new(onnx.make_model(model_opt), max_latency_us: 2000)
+    assert_equal(batch_size, batcher.max_batch)
+    assert_equal(2000, batcher.max_latency_us)
+
+    # more requests than one batch, including a partial batch
+    threads = (0..6).map do |n|
+      Thread.new do
+        [n, batcher.run(MNIST_IN_NAME => Array.new(sample_length, n).pack('e*'))]
+      end
+    end
+    threads.map(&:value).each do |n, results|
+      assert(results.frozen?)
+      expected = single.run([{ name: MNIST_IN_NAME, data: Array.new(batch_size * sample_length, n) }])
+      assert_equal(expected.first[:data].first, results[MNIST_OUT_NAME].unpack('e*'))
+    end
+
+    assert_raises(ArgumentError) { batcher.run(MNIST_IN_NAME => 'invalid') }
+    assert_raises(ArgumentError) { batcher.run({}) }
+
+    # an interrupted request runs its partial batch instead of waiting for
+    # max_latency_us, and the batcher stays usable
+    slow = Menoh::Batcher.new(onnx.make_model(model_opt), max_latency_us: 60_000_000)
+    sample = Array.new(sample_length, 1).pack('e*')
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    2.times do
+      assert_raises(Timeout::Error) { Timeout.timeout(0.1) { slow.run(MNIST_IN_NAME => sample) } }
+    end
+    assert_operator(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started, :<, 10)
+    thread = Thread.new { slow.run(MNIST_IN_NAME => sample) }
+    sleep 0.1
+    thread.kill
+    assert(thread.join(10))
+
+    # a signal handler interrupts the request without raising; it comes back
+    # and its batch still runs on time
+    batcher = Menoh::Batcher.new(onnx.make_model(model_opt), max_latency_us: 200_000)
+    previous = trap(:USR2) {}
+    begin
+      Thread.new { sleep 0.05; Process.kill(:USR2, Process.pid) }
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      results = Timeout.timeout(10) { batcher.run(MNIST_IN_NAME => sample) }
+      assert_operator(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started, :<, 5)
+      assert_equal(batcher.run(MNIST_IN_NAME => sample), results)
+    ensure
+      trap(:USR2, previous)
+    end
+  end
+
+  def test_menoh_run_async
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    batch_size = 3
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [
+        {
+          name: MNIST_IN_NAME,
+          dims: [batch_size, 1, 28, 28]
+        }
+      ],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    model = onnx.make_model(model_opt)
+    dataset = [{ name: MNIST_IN_NAME, data: Array.new(batch_size * 1 * 28 * 28, 0.5) }]
+    expected = model.run(dataset)
+
+    future = model.run_async(dataset)
+    assert_instance_of(Menoh::Future, future)
+    completed = Queue.new
+    future.on_complete { |f| completed.push(f) }
+    assert_same(future, future.wait(10))
+    assert(future.done?)
+    assert_equal(expected, future.value)
+    assert_same(future, completed.pop)
+
+    # a callback registered after completion runs right away
+    called = nil
+    future.on_complete { |f| called = f }
+    assert_same(future, called)
+
+    # successive submissions on one model are serialized
+    futures = (0..3).map { model.run_async(dataset) }
+    futures.each { |f| assert_equal(expected, f.value) }
+    assert_equal(expected, model.run(dataset))
+
+    # finished runs leave the chain of futures even when nobody waits
+    input = dataset.first[:data].pack('e*')
+    futures = Array.new(4) { model.run_staged_async([input]) }
+    Timeout.timeout(10) { sleep 0.01 until futures.last.done? }
+    newest = model.run_staged_async([input])
+    assert_nil(newest.send(:previous_future))
+    futures.each { |f| assert_same(f, f.wait(0)) }
+    assert_equal(expected, newest.value(10))
+
+    # models run concurrently on the worker pool
+    models = Array.new(2) { onnx.make_model(model_opt) }
+    futures = models.map { |m| m.run_async(dataset) }
+    futures.each { |f| assert_equal(expected, f.value(10)) }
+  end
+
+  def test_menoh_run_async_compaction
+    skip 'GC.compact is not supported' unless GC.respond_to?(:compact)
+
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    model = onnx.make_model(
+      backend: 'mkldnn',
+      input_layers: [{ name: MNIST_IN_NAME, dims: [1, 1, 28, 28] }],
+      output_layers: [MNIST_OUT_NAME]
+    )
+    data = Array.new(28 * 28) { |i| (i % 7) * 0.125 }
+    expected = model.run([{ name: MNIST_IN_NAME, data: data }])
+
+    # the 40-byte outputs are embedded Strings, which compaction would move
+    # away from the workers writing into them unless they are pinned
+    input = data.pack('e*')
+    futures = Array.new(16) { model.run_staged_async([input.dup]) }
+    GC.compact
+    futures.each { |f| assert_equal(expected, f.value(10)) }
+  end
+
+  def test_menoh_pipeline
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    batch_size = 2
+    input_length = batch_size * 1 * 28 * 28
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [
+        {
+          name: MNIST_IN_NAME,
+          dims: [batch_size, 1, 28, 28]
+        }
+      ],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    single = onnx.make_model(model_opt)
+    model = onnx.make_model(model_opt)
+    assert_equal([MNIST_IN_NAME], model.input_layers)
+    assert_equal([MNIST_OUT_NAME], model.output_layers)
+
+    pipeline = model.pipeline(depth: 2)
+    assert_equal(2, pipeline.depth)
+    futures = (0..4).map do |n|
+      data = n.even? ? Array.new(input_length, n) : Array.new(input_length, n).pack('f*')
+      pipeline.run([{ name: MNIST_IN_NAME, data: data }])
+    end
+    # wait out of order; runs of one model still finish in submission order
+    futures.reverse.each(&:wait)
+    futures.each_with_index do |future, n|
+      expected = single.run([{ name: MNIST_IN_NAME, data: Array.new(input_length, n) }])
+      assert_equal(expected, future.value)
+    end
+
+    stage = pipeline.stage
+    assert_raises(RuntimeError) { stage.set_data('invalid', []) }
+    stage.set_data(MNIST_IN_NAME, 'invalid')
+    assert_raises(ArgumentError) { pipeline.submit(stage) }
+    assert_raises(RuntimeError) { Menoh::Pipeline.new(model, depth: 1) }
+  end
+
+  def test_menoh_shape_cache
+    cache = Menoh::ShapeCache.new(MNIST_ONNX_FILE,
+                                  backend: 'mkldnn',
+                                  input_layers: [{ name: MNIST_IN_NAME }],
+                                  output_layers: [MNIST_OUT_NAME],
+                                  capacity: 2,
+                                  batch_buckets: [2, 4],
+                                  prewarm: [[[2, 1, 28, 28]]])
+    assert_equal(1, cache.size)
+    assert_equal([[[2, 1, 28, 28]]], cache.shapes)
+
+    # batch 3 is padded to the bucket 4
+    batch_size = 3
+    data = (0..(batch_size * 1 * 28 * 28 - 1)).map { |i| i % 256 }
+    results = cache.run([{ name: MNIST_IN_NAME, dims: [batch_size, 1, 28, 28], data: data }])
+    model = Menoh::Menoh.new(MNIST_ONNX_FILE).make_model(
+      backend: 'mkldnn',
+      input_layers: [{ name: MNIST_IN_NAME, dims: [batch_size, 1, 28, 28] }],
+      output_layers: [MNIST_OUT_NAME]
+    )
+    expected = model.run([{ name: MNIST_IN_NAME, data: data }])
+    assert_equal(expected.first[:shape], results.first[:shape])
+    assert_equal(expected.first[:data], results.first[:data])
+    assert_equal([[[2, 1, 28, 28]], [[4, 1, 28, 28]]], cache.shapes)
+
+    # hit moves the shape to the most recently used end
+    cache.model_for([[2, 1, 28, 28]])
+    assert_equal([[[4, 1, 28, 28]], [[2, 1, 28, 28]]], cache.shapes)
+    assert_equal(1, cache.hits)
+    assert_equal(2, cache.misses)
+
+    # larger than every bucket: exact shape, evicts the least recently used
+    cache.model_for([[5, 1, 28, 28]])
+    assert_equal([[[2, 1, 28, 28]], [[5, 1, 28, 28]]], cache.shapes)
+    assert_equal(1, cache.evictions)
+
+    # a build does not hold the cache lock; misses for the same shape wait for it
+    builds = Queue.new
+    release = Queue.new
+    cache.define_singleton_method(:build_model) do |dims_list|
+      builds << dims_list
+      release.pop
+      super(dims_list)
+    end
+    waiters = Array.new(3) { Thread.new { cache.model_for([[6, 1, 28, 28]]) } }
+    assert_equal([[6, 1, 28, 28]], builds.pop)
+    assert_equal(2, cache.size)
+    cache.model_for([[5, 1, 28, 28]])
+    release << true
+    models = waiters.map(&:value)
+    assert_equal(1, models.uniq.length)
+    assert(builds.empty?)
+    assert_equal(4, cache.misses)
+
+    # a failed build is not cached and reaches every waiter
+    cache.define_singleton_method(:build_model) do |_dims_list|
+      release.pop
+      raise 'build failed'
+    end
+    waiters = Array.new(2) do
+      Thread.new do
+        Thread.current.report_on_exception = false
+        cache.model_for([[7, 1, 28, 28]])
+      end
+    end
+    Thread.pass until waiters.all? { |t| t.status == 'sleep' }
+    release << true
+    waiters.each { |t| assert_raises(RuntimeError) { t.join } }
+    refute_includes(cache.shapes, [[7, 1, 28, 28]])
+  end
+
+  def test_menoh_typed_data_str
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    batch_size = 32
+    input_length = batch_size * 1 * 28 * 28
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [
+        {
+          name: MNIST_IN_NAME,
+          dims: [batch_size, 1, 28, 28]
+        }
+      ],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    model = onnx.make_model(model_opt)
+
+    pixels = Array.new(input_length) { |i| i % 256 }
+    model.set_data_str(MNIST_IN_NAME, pixels.pack('C*'), :uint8)
+    assert_equal(pixels.map(&:to_f), model.get_data(MNIST_IN_NAME))
+
+    # large enough to convert without the GVL
+    values = Array.new(input_length) { |i| (i % 100) * 0.25 - 10 }
+    model.set_data_str(MNIST_IN_NAME, values.pack('d*'), :float64)
+    assert_equal(values, model.get_data(MNIST_IN_NAME))
+    assert_equal(values.map(&:to_i), model.get_data_str(MNIST_IN_NAME, :int16).unpack('s*'))
+
+    # float16 bits: 1.0, 0.5, -2.0, 65504.0, the smallest subnormal, inf
+    halves = [0x3c00, 0x3800, 0xc000, 0x7bff, 0x0001, 0x7c00]
+    floats = [1.0, 0.5, -2.0, 65_504.0, 2.0**-24, Float::INFINITY]
+    data = (halves * (input_length / halves.length + 1)).take(input_length)
+    model.set_data_str(MNIST_IN_NAME, data.pack('S*'), :float16)
+    assert_equal(floats, model.get_data(MNIST_IN_NAME).take(floats.length))
+    assert_equal(data, model.get_data_str(MNIST_IN_NAME, :float16).unpack('S*'))
+
+    # floats out of the integer range are clamped and NaN becomes 0
+    values = [300.0, -300.0, Float::NAN, 1e30, -1e30, 1e10, 42.9, -42.9]
+    data = values + Array.new(input_length - values.length, 0.0)
+    model.set_data_str(MNIST_IN_NAME, data.pack('d*'), :float64)
+    int32_max = 2**31 - 1
+    int64_max = 2**63 - 1
+    clamped = {
+      uint8: ['C*', [255, 0, 0, 255, 0, 255, 42, 0]],
+      int8: ['c*', [127, -128, 0, 127, -128, 127, 42, -42]],
+      int16: ['s*', [300, -300, 0, 32_767, -32_768, 32_767, 42, -42]],
+      int32: ['l*', [300, -300, 0, int32_max, -int32_max - 1, int32_max, 42, -42]],
+      int64: ['q*', [300, -300, 0, int64_max, -int64_max - 1, 10_000_000_000, 42, -42]]
+    }
+    clamped.each do |dtype, (format, expected)|
+      assert_equal(expected, model.get_data_str(MNIST_IN_NAME, dtype).unpack(format).take(values.length))
+    end
+
+    # narrowing integer conversions clamp the same way, where the backend
+    # takes int8 inputs
+    int8_opt = model_opt.merge(input_layers: [model_opt[:input_layers].first.merge(dtype: :int8)])
+    int8_model = begin
+      onnx.make_model(int8_opt)
+    rescue Menoh::Error
+      nil
+    end
+    unless int8_model.nil?
+      ints = [300, -300, 127, -129, -1, 5]
+      data = ints + Array.new(input_length - ints.length, 0)
+      int8_model.set_data_str(MNIST_IN_NAME, data.pack('l*'), :int32)
+      assert_equal([127, -128, 127, -128, -1, 5],
+                   int8_model.get_data_str(MNIST_IN_NAME).unpack('c*').take(ints.length))
+      assert_equal([127, 0, 127, 0, 0, 5],
+                   int8_model.get_data_str(MNIST_IN_NAME, :uint8).unpack('C*').take(ints.length))
+    end
+
+    assert_raises(ArgumentError) { model.set_data_str(MNIST_IN_NAME, 'invalid', :uint8) }
+    assert_raises(Menoh::InvalidDType) { model.set_data_str(MNIST_IN_NAME, pixels.pack('C*'), :invalid) }
+  end
+
+  def test_menoh_set_image_data
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    n = 2
+    h = 4
+    w = 5
+    c = 3
+    pixels = Array.new(n * h * w * c) { |i| (i * 7) % 256 }
+    mean = [120.0, 110.0, 100.0]
+    std = [60.0, 50.0, 40.0]
+    scale = 2.0
+    normalized = pixels.each_with_index.map { |v, i| ((v * scale - mean[i % c]) / std[i % c]).to_f }
+    # HWC to CHW per image
+    nchw = (0...n).flat_map do |b|
+      (0...c).flat_map do |k|
+        (0...(h * w)).map { |p| normalized[(b * h * w + p) * c + k] }
+      end
+    end
+
+    model = onnx.make_model(backend: 'mkldnn',
+                            input_layers: [{ name: MNIST_IN_NAME, dims: [n, c, h, w] }],
+                            output_layers: [MNIST_OUT_NAME])
+    model.set_image_data(MNIST_IN_NAME, pixels.pack('C*'), mean: mean, std: std, scale: scale)
+    model.get_data(MNIST_IN_NAME).zip(nchw).each { |actual, expected| assert_in_delta(expected, actual, 1e-5) }
+
+    model = onnx.make_model(backend: 'mkldnn',
+                            input_layers: [{ name: MNIST_IN_NAME, dims: [n, h, w, c] }],
+                            output_layers: [MNIST_OUT_NAME])
+    model.set_image_data(MNIST_IN_NAME, pixels.pack('C*'), layout: :nhwc, mean: mean, std: std, scale: scale)
+    model.get_data(MNIST_IN_NAME).zip(normalized).each { |actual, expected| assert_in_delta(expected, actual, 1e-5) }
+    model.set_image_data(MNIST_IN_NAME, pixels.pack('C*'), layout: :nhwc)
+    assert_equal(pixels.map(&:to_f), model.get_data(MNIST_IN_NAME))
+
+    assert_raises(ArgumentError) { model.set_image_data(MNIST_IN_NAME, 'invalid', layout: :nhwc) }
+    assert_raises(ArgumentError) { model.set_image_data(MNIST_IN_NAME, pixels.pack('C*'), layout: :nhwc, mean: [1, 2]) }
+    assert_raises(RuntimeError) { model.set_image_data(MNIST_IN_NAME, pixels.pack('C*'), layout: :chw) }
+  end
+
+  def test_menoh_tensor
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    batch_size = 4
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [
+        {
+          name: MNIST_IN_NAME,
+          dims: [batch_size, 1, 28, 28]
+        }
+      ],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    model = onnx.make_model(model_opt)
+    dataset = [{ name: MNIST_IN_NAME, data: Array.new(batch_size * 1 * 28 * 28) { |i| i / 784 } }]
+    expected = model.run(dataset)
+    results = model.run(dataset, tensors: true)
+    tensor = results.first[:data]
+    assert_instance_of(Menoh::Tensor, tensor)
+    assert_equal(expected.first[:shape], results.first[:shape])
+    assert_equal(expected.first[:data], tensor.to_a)
+    assert_equal(:float32, tensor.dtype)
+    assert_equal([batch_size, 10], tensor.shape)
+    assert_equal(2, tensor.ndim)
+    assert_equal(batch_size * 10, tensor.size)
+    assert_equal(batch_size * 10 * 4, tensor.bytesize)
+    assert_equal(expected.first[:data].flatten, tensor.to_flat_a)
+
+    # rows share the data
+    row = tensor[2]
+    assert_equal([10], row.shape)
+    assert_equal(expected.first[:data][2], row.to_a)
+    assert_equal(expected.first[:data][2][3], tensor[2, 3])
+    assert_equal(expected.first[:data][-1][-1], tensor[-1, -1])
+    assert_equal(expected.first[:data], tensor.map(&:to_a))
+    assert_raises(IndexError) { tensor[batch_size] }
+    assert_raises(ArgumentError) { tensor[0, 0, 0] }
+
+    # a tensor keeps its data across runs
+    model.run([{ name: MNIST_IN_NAME, data: Array.new(batch_size * 1 * 28 * 28, 100) }])
+    assert_equal(expected.first[:data], tensor.to_a)
+
+    copy = Menoh::Tensor.new(tensor.to_s, [batch_size, 10], :float32)
+    assert_equal(tensor, copy)
+    assert_raises(ArgumentError) { Menoh::Tensor.new('invalid', [batch_size, 10]) }
+  end
+
+  def test_menoh_postprocess
+    scores = [
+      [0.1, 0.7, 0.05, 0.7, -1.0],
+      [3.0, 1.0, 2.0, 0.0, 4.0]
+    ]
+    tensor = Menoh::Tensor.new(scores.flatten.pack('f*'), [2, 5])
+    rounded = ->(pairs) { pairs.map { |i, v| [i, v.round(5)] } }
+
+    assert_equal([1, 4], tensor.argmax)
+    assert_equal(1, tensor[0].argmax)
+    # ties rank the lower index first
+    assert_equal([[1, 0.7], [3, 0.7], [0, 0.1]], rounded.call(tensor[0].topk(3)))
+    assert_equal([[4, 4.0], [0, 3.0]], rounded.call(tensor.topk(2)[1]))
+    assert_equal(5, tensor.topk(10)[1].length)
+    assert_equal([[], []], tensor.topk(0))
+    assert_equal([[[1, 0.7], [3, 0.7]], [[4, 4.0], [0, 3.0], [2, 2.0], [1, 1.0]]],
+                 tensor.threshold(0.5).map(&rounded))
+
+    softmax = tensor.softmax
+    assert_equal([2, 5], softmax.shape)
+    scores.each_with_index do |row, r|
+      exps = row.map { |v| Math.exp(v - row.max) }
+      expected = exps.map { |e| e / exps.sum }
+      softmax[r].to_a.zip(expected).each { |actual, e| assert_in_delta(e, actual, 1e-6) }
+      tensor.log_softmax[r].to_a.zip(expected).each { |actual, e| assert_in_delta(Math.log(e), actual, 1e-5) }
+    end
+    assert_raises(ArgumentError) { tensor.topk(-1) }
+
+    # straight from an output buffer
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    model = onnx.make_model(backend: 'mkldnn',
+                            input_layers: [{ name: MNIST_IN_NAME, dims: [2, 1, 28, 28] }],
+                            output_layers: [MNIST_OUT_NAME])
+    results = model.run([{ name: MNIST_IN_NAME, data: Array.new(2 * 1 * 28 * 28) { |i| i / 784 } }], tensors: true)
+    output = results.first[:data]
+    assert_equal(output.argmax, model.argmax(MNIST_OUT_NAME))
+    assert_equal(output.topk(5), model.topk(MNIST_OUT_NAME, 5))
+    assert_equal(output.threshold(5), model.threshold(MNIST_OUT_NAME, 5))
+    assert_equal(output.softmax, model.softmax(MNIST_OUT_NAME))
+    assert_equal(output.log_softmax, model.log_softmax(MNIST_OUT_NAME))
+  end
+
+  def test_menoh_stats
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    model = onnx.make_model(backend: 'mkldnn',
+                            input_layers: [{ name: MNIST_IN_NAME, dims: [2, 1, 28, 28] }],
+                            output_layers: [MNIST_OUT_NAME])
+    input = Array.new(2 * 1 * 28 * 28) { |i| i % 256 }
+    stages = %i[input run output reshape]
+    assert_equal(stages, model.stats.keys)
+    assert(model.stats.values.all? { |s| s[:count].zero? && s[:histogram].empty? })
+
+    events = []
+    Menoh.reset_stats
+    Menoh.stats_subscriber = ->(m, stage, seconds, bytes) { events << [m, stage, seconds, bytes] }
+    begin
+      model.run([{ name: MNIST_IN_NAME, data: input }])
+      model.run_raw(MNIST_IN_NAME => input.pack('f*'))
+      model.run_async([{ name: MNIST_IN_NAME, data: input }]).value
+    ensure
+      Menoh.stats_subscriber = nil
+    end
+
+    stats = model.stats
+    assert_equal([3, 3, 3, 2], stages.map { |s| stats[s][:count] })
+    assert_equal(3 * 2 * 28 * 28 * 4, stats[:input][:bytes])
+    assert_equal(3 * 2 * 10 * 4, stats[:output][:bytes])
+    stages.each do |stage|
+      s = stats[stage]
+      assert_operator(s[:max_time], :<=, s[:time])
+      assert_equal(s[:count], s[:histogram].sum { |_, n| n })
+      assert(s[:histogram].each_cons(2).all? { |(a, _), (b, _)| a < b })
+    end
+    assert_equal(stats, Menoh.stats)
+    assert_equal(11, events.length)
+    assert(events.all? { |m, _, seconds, bytes| m.equal?(model) && seconds >= 0 && bytes >= 0 })
+    assert_equal(%i[input run output reshape], events.first(4).map { |e| e[1] })
+
+    # a failing subscriber only warns
+    Menoh.stats_subscriber = ->(*) { raise 'broken exporter' }
+    begin
+      _, err = capture_io { model.set_data(MNIST_IN_NAME, input) }
+      assert_match(/broken exporter/, err)
+      # only StandardError is swallowed
+      Menoh.stats_subscriber = ->(*) { raise Interrupt }
+      assert_raises(Interrupt) { model.set_data(MNIST_IN_NAME, input) }
+      Menoh.stats_subscriber = ->(*) { throw :stop, :thrown }
+      assert_equal(:thrown, catch(:stop) { model.set_data(MNIST_IN_NAME, input) })
+    ensure
+      Menoh.stats_subscriber = nil
+    end
+    assert_raises(ArgumentError) { Menoh.stats_subscriber = 1 }
+
+    model.reset_stats
+    assert(model.stats.values.all? { |s| s[:count].zero? && s[:bytes].zero? })
+    refute(Menoh.stats[:run][:count].zero?)
+  end
+
+  def test_menoh_ractor
+    skip 'Ractor is not available' unless defined?(Ractor)
+
+    experimental = Warning[:experimental]
+    Warning[:experimental] = false
+    onnx = Ractor.make_shareable(Menoh::Menoh.new(MNIST_ONNX_FILE))
+    assert(Ractor.shareable?(onnx))
+
+    ractors = Array.new(3) do |i|
+      Ractor.new(onnx, i, MNIST_IN_NAME, MNIST_OUT_NAME) do |onnx, i, in_name, out_name|
+        model = onnx.make_model(backend: 'mkldnn', backend_config: { cpu_id: '0' },
+                                input_layers: [{ name: in_name, dims: [1, 1, 28, 28] }],
+                                output_layers: [out_name])
+        input = Array.new(28 * 28) { i }
+        stages = []
+        Menoh.stats_subscriber = ->(_, stage, _, _) { stages << stage }
+        results = model.run([{ name: in_name, data: input }])
+        future = model.run_async([{ name: in_name, data: input }])
+        tensor = model.run([{ name: in_name, data: input }], tensors: true).first[:data]
+        [results.first[:data], future.value.first[:data], Ractor.make_shareable(tensor), stages.length]
+      end
+    end
+
+    main = onnx.make_model(backend: 'mkldnn', backend_config: { cpu_id: '0' },
+                           input_layers: [{ name: MNIST_IN_NAME, dims: [1, 1, 28, 28] }],
+                           output_layers: [MNIST_OUT_NAME])
+    ractors.each_with_index do |ractor, i|
+      array, async, tensor, stage_count = ractor.take
+      expected = main.run([{ name: MNIST_IN_NAME, data: Array.new(28 * 28) { i } }]).first[:data]
+      assert_equal(expected, array)
+      assert_equal(expected, async)
+      assert_equal(expected, tensor.to_a)
+      assert(Ractor.shareable?(tensor))
+      assert_operator(stage_count, :>=, 10)
+    end
+  ensure
+    Warning[:experimental] = experimental unless experimental.nil?
+  end
+
+  def test_menoh_release_and_memory_usage
+    require 'objspace'
+
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [{ name: MNIST_IN_NAME, dims: [2, 1, 28, 28] }],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    dataset = [{ name: MNIST_IN_NAME, data: Array.new(2 * 28 * 28, 0.5) }]
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    onnx_size = File.size(MNIST_ONNX_FILE)
+    assert_operator(ObjectSpace.memsize_of(onnx), :>=, onnx_size)
+
+    model = onnx.make_model(model_opt)
+    usage = model.memory_usage
+    assert_equal(onnx_size, usage[:weights])
+    assert_equal(2 * 28 * 28 * 4 + 2 * 10 * 4, usage[:buffers])
+    assert_equal(0, usage[:arenas])
+    assert_equal(0, usage[:external])
+    assert_equal(usage.values_at(:weights, :buffers, :arenas, :bookkeeping).sum, usage[:total])
+    assert_operator(ObjectSpace.memsize_of(model), :>=, usage[:total])
+
+    output = "\0".b * (2 * 10 * 4)
+    usage = onnx.make_model(model_opt.merge(external_buffers: { MNIST_IN_NAME => :arena,
+                                                                MNIST_OUT_NAME => output })).memory_usage
+    assert_equal(0, usage[:buffers])
+    assert_equal(2 * 28 * 28 * 4, usage[:arenas])
+    assert_equal(output.bytesize, usage[:external])
+
+    expected = model.run(dataset)
+    refute(onnx.released?)
+    memsize = ObjectSpace.memsize_of(onnx)
+    onnx.release
+    assert(onnx.released?)
+    assert_equal(memsize - onnx_size, ObjectSpace.memsize_of(onnx))
+    assert_raises(Menoh::Error) { onnx.make_model(model_opt) }
+    assert_equal(expected, model.run(dataset))
+    onnx.release
+
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE, release_after_build: true)
+    pool = onnx.make_model_pool(model_opt, size: 2)
+    assert(onnx.released?)
+    assert_equal(expected, pool.run(dataset))
+  end
+
+  def test_menoh_get_data_into
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [{ name: MNIST_IN_NAME, dims: [2, 1, 28, 28] }],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    dataset = [{ name: MNIST_IN_NAME, data: Array.new(2 * 28 * 28, 0.5) }]
+    model = onnx.make_model(model_opt)
+    expected = model.run(dataset)
+
+    buffer = String.new
+    assert_same(buffer, model.get_data_into(MNIST_OUT_NAME, buffer))
+    assert_equal(model.get_data_str(MNIST_OUT_NAME), buffer)
+    array = Array.new(100, 0)
+    assert_same(array, model.get_data_into(MNIST_OUT_NAME, array))
+    assert_equal(expected.first[:data].flatten, array)
+    assert_raises(TypeError) { model.get_data_into(MNIST_OUT_NAME, {}) }
+    assert_raises(FrozenError) { model.get_data_into(MNIST_OUT_NAME, [].freeze) }
+
+    slots = model.output_slots
+    assert_equal([MNIST_OUT_NAME], slots.map { |slot| slot[:name] })
+    assert_equal([2, 10], slots.first[:shape])
+    array_slots = model.output_slots(format: :array)
+    data = array_slots.first[:data]
+    dataset = [{ name: MNIST_IN_NAME, data: Array.new(2 * 28 * 28, 0.25) }]
+    expected = onnx.make_model(model_opt).run(dataset).first[:data].flatten
+    assert_same(slots, model.run(dataset, into: slots))
+    assert_equal(expected, slots.first[:data].unpack('e*'))
+    model.run(dataset, into: array_slots)
+    assert_same(data, array_slots.first[:data])
+    assert_equal(expected, data)
+
+    # a steady-state loop allocates nothing per run on the Ruby heap
+    3.times { model.run(dataset, into: slots) }
+    allocated = GC.stat(:total_allocated_objects)
+    100.times { model.run(dataset, into: slots) }
+    assert_operator(GC.stat(:total_allocated_objects) - allocated, :<, 10)
+  end
+
+  def test_menoh_get_data_slice
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    model = onnx.make_model(
+      backend: 'mkldnn',
+      input_layers: [{ name: MNIST_IN_NAME, dims: [4, 1, 28, 28] }],
+      output_layers: [MNIST_OUT_NAME]
+    )
+    # every pixel of sample b is b
+    rows = (0...4).map { |b| Array.new(28 * 28, b.to_f) }
+    expected = model.run([{ name: MNIST_IN_NAME, data: rows.flatten }]).first[:data]
+
+    assert_equal(expected[3], model.get_data_slice(MNIST_OUT_NAME, [3]))
+    assert_equal(expected[-1], model.get_data_slice(MNIST_OUT_NAME, [-1, nil]))
+    assert_equal(expected[1..2].flatten, model.get_data_slice(MNIST_OUT_NAME, [1..2]))
+    assert_equal(expected[3], model.get_data_slice(MNIST_OUT_NAME, [3..9]))
+    assert_equal(expected.map { |row| row[2...5] }.flatten,
+                 model.get_data_slice(MNIST_OUT_NAME, [nil, 2...5]))
+    assert_equal(expected.flatten, model.get_data_slice(MNIST_OUT_NAME, []))
+    assert_equal([], model.get_data_slice(MNIST_OUT_NAME, [1...1]))
+    assert_equal(expected[3].pack('e*'), model.get_data_slice_str(MNIST_OUT_NAME, [3]))
+    assert_equal(expected[0].values_at(0, 4, 8).map { |v| v.clamp(0, 255).to_i }.pack('C*'),
+                 model.get_data_slice_str(MNIST_OUT_NAME, [0, (0..).step(4)], :uint8))
+
+    # strided regions of the 4-d input, whose elements are their flat index
+    model.set_data(MNIST_IN_NAME, Array.new(4 * 28 * 28) { |i| i.to_f })
+    indices = [1, 2].product([3, 6, 9]).map { |b, h| (b * 28 * 28) + (h * 28) + 27 }
+    assert_equal(indices.map(&:to_f),
+                 model.get_data_slice(MNIST_IN_NAME, [1..2, 0, (3..10).step(3), -1]))
+    assert_equal(indices.pack('e*'),
+                 model.get_data_slice_str(MNIST_IN_NAME, [1..2, 0, (3..10).step(3), 27]))
+
+    assert_raises(IndexError) { model.get_data_slice(MNIST_OUT_NAME, [4]) }
+    assert_raises(RangeError) { model.get_data_slice(MNIST_OUT_NAME, [5..6]) }
+    assert_raises(ArgumentError) { model.get_data_slice(MNIST_OUT_NAME, [0, 0, 0]) }
+    assert_raises(TypeError) { model.get_data_slice(MNIST_OUT_NAME, ['0']) }
+  end
+
+  def test_menoh_warmup
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [{ name: MNIST_IN_NAME, dims: [2, 1, 28, 28] }],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    assert_nil(onnx.make_model(model_opt).warmup_latency)
+
+    model = onnx.make_model(model_opt.merge(warmup: 3))
+    latency = model.warmup_latency
+    assert_equal(3, latency[:runs])
+    assert_kind_of(Float, latency[:cold])
+    assert_kind_of(Float, latency[:warm])
+    # warmup runs on zeroed inputs and is not counted in the stats
+    warmed_up = model.get_data(MNIST_OUT_NAME)
+    zeros = onnx.make_model(model_opt).run([{ name: MNIST_IN_NAME, data: Array.new(2 * 28 * 28, 0.0) }])
+    assert_equal(zeros.first[:data].flatten, warmed_up)
+    assert_equal(0, model.stats[:run][:count])
+
+    assert_nil(model.warmup(1)[:warm])
+    assert_same(model.warmup_latency, model.warmup(0))
+    assert_raises(RuntimeError) { model.warmup(-1) }
+    assert_raises(RuntimeError) { onnx.make_model(model_opt.merge(warmup: 'x')) }
+
+    pool = onnx.make_model_pool(model_opt.merge(warmup: 2), size: 2)
+    assert_equal([2, 2], pool.warmup_latency.map { |l| l[:runs] })
+  end
+
+  def test_menoh_load_async
+    future = Menoh::Menoh.load_async(MNIST_ONNX_FILE)
+    assert_same(future, future.wait(10))
+    assert(future.done?)
+    onnx = future.value
+    assert_kind_of(Menoh::Menoh, onnx)
+
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [{ name: MNIST_IN_NAME, dims: [1, 1, 28, 28] }],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    completed = Queue.new
+    future = onnx.make_model_async(model_opt.merge(warmup: 1))
+    future.on_complete { |f| completed << f }
+    model = future.value(10)
+    assert_same(future, completed.pop)
+    assert_equal(1, model.warmup_latency[:runs])
+    dataset = [{ name: MNIST_IN_NAME, data: Array.new(28 * 28, 1.0) }]
+    assert_equal(onnx.make_model(model_opt).run(dataset), model.run(dataset))
+
+    # models load and build from memory and mmap the same way
+    data = File.binread(MNIST_ONNX_FILE)
+    assert_kind_of(Menoh::Menoh, Menoh::Menoh.load_async(data: data).value)
+    assert_kind_of(Menoh::Menoh, Menoh::Menoh.load_async(MNIST_ONNX_FILE, mmap: true).value)
+
+    # errors are raised by value
+    assert_raises(RuntimeError) { Menoh::Menoh.load_async('invalid.onnx').value }
+    future = onnx.make_model_async(model_opt.merge(output_layers: ['invalid']))
+    assert_raises(Menoh::Error) { future.value }
+    onnx.release
+    assert_raises(Menoh::Error) { onnx.make_model_async(model_opt).value }
+  end
+
+  def test_menoh_each_batch
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    model = onnx.make_model(
+      backend: 'mkldnn',
+      input_layers: [{ name: MNIST_IN_NAME, dims: [2, 1, 28, 28] }],
+      output_layers: [MNIST_OUT_NAME]
+    )
+    skip 'mmap is not supported' unless model.respond_to?(:native_each_batch, true)
+
+    # 5 uint8 records after a 16-byte header, the pixels of record i are i
+    records = (0...5).map { |i| [i].pack('C') * (28 * 28) }.join
+    # the rows of the same records run two at a time, the last one with zeros
+    expected = (0...5).each_slice(2).flat_map do |ids|
+      data = ids.flat_map { |i| [i.to_f] * (28 * 28) } + ([0.0] * ((2 - ids.length) * 28 * 28))
+      model.run([{ name: MNIST_IN_NAME, data: data }]).first[:data].first(ids.length)
+    end
+    layout = { MNIST_IN_NAME => :uint8 }
+    Dir.mktmpdir do |dir|
+      input = File.join(dir, 'records.bin')
+      File.binwrite(input, ('h' * 16) + records)
+
+      output = File.join(dir, 'scores.bin')
+      assert_equal(5, model.each_batch(input, record_layout: layout, offset: 16, output: output))
+      assert_equal(expected.flatten, File.binread(output).unpack('e*'))
+
+      batches = File.open(input, 'rb') do |file|
+        model.each_batch(file, record_layout: layout, offset: 16).map do |slots, range|
+          [range, slots.first[:shape], slots.first[:data].unpack('e*')]
+        end
+      end
+      assert_equal([0...2, 2...4, 4...5], batches.map(&:first))
+      assert_equal([[2, 10], [2, 10], [1, 10]], batches.map { |batch| batch[1] })
+      assert_equal(expected.flatten, batches.flat_map(&:last))
+      # the short last batch is padded with zeros
+      assert_equal(([4.0] * 28 * 28) + ([0.0] * 28 * 28), model.get_data(MNIST_IN_NAME))
+
+      # float32 records of the model's own dtype
+      File.binwrite(input, records.unpack('C*').pack('e*'))
+      File.open(output, 'wb') do |out|
+        model.each_batch(input, record_layout: { MNIST_IN_NAME => nil }, output: out)
+      end
+      assert_equal(expected.flatten, File.binread(output).unpack('e*'))
+
+      File.binwrite(input, records + 'x')
+      assert_raises(ArgumentError) { model.each_batch(input, record_layout: layout) { flunk } }
+      assert_raises { model.each_batch(input, record_layout: { 'unknown' => :uint8 }) { flunk } }
+    end
+  end
+
+  def test_menoh_admission_queue
+    now = -> { Process.clock_gettime(Process::CLOCK_MONOTONIC) }
+    queue = Menoh::AdmissionQueue.new(concurrency: 1, capacity: 2)
+    assert_equal(:ok, queue.enter { :ok })
+    assert_raises(Menoh::DeadlineExceeded) { queue.enter(now.call - 1) { flunk } }
+
+    holding = Queue.new
+    release = Queue.new
+    holder = Thread.new { queue.enter { holding << true; release.pop } }
+    holding.pop
+    waiter = Thread.new { queue.enter(now.call + 10) { :waited } }
+    Thread.pass until queue.depth == 1
+    # expires while it waits
+    assert_raises(Menoh::DeadlineExceeded) { queue.enter(now.call + 0.05) { flunk } }
+    interrupted = Thread.new { queue.enter { flunk } }
+    Thread.pass until queue.depth == 2
+    assert_raises(Menoh::DeadlineExceeded) { queue.enter { flunk } }
+    interrupted.kill.join
+    assert_equal(1, queue.depth)
+    release << true
+    holder.join
+    assert_equal(:waited, waiter.value)
+
+    stats = queue.stats
+    assert_equal(0, stats[:running])
+    assert_equal(0, stats[:depth])
+    assert_equal(2, stats[:max_depth])
+    assert_equal(3, stats[:admitted])
+    assert_equal({ expired: 2, late: 0, full: 1 }, stats[:shed])
+    assert_operator(stats[:service_time], :>, 0)
+
+    # the average service time rules out requests that cannot start in time
+    queue = Menoh::AdmissionQueue.new
+    queue.enter { sleep 0.2 }
+    holder = Thread.new { queue.enter { holding << true; release.pop } }
+    holding.pop
+    assert_raises(Menoh::DeadlineExceeded) { queue.enter(now.call + 0.05) { flunk } }
+    assert_equal(1, queue.stats[:shed][:late])
+    release << true
+    holder.join
+    assert_raises(ArgumentError) { Menoh::AdmissionQueue.new(concurrency: 0) }
+
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [{ name: MNIST_IN_NAME, dims: [1, 1, 28, 28] }],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    dataset = [{ name: MNIST_IN_NAME, data: Array.new(28 * 28, 0.5) }]
+    model = onnx.make_model(model_opt)
+    expected = model.run(dataset)
+    assert_nil(model.admission)
+    assert_raises(Menoh::DeadlineExceeded) { model.run(dataset, deadline: now.call - 1) }
+
+    model = onnx.make_model(model_opt.merge(admission: { capacity: 4 }))
+    assert_equal(4, model.admission.capacity)
+    assert_equal(expected, model.run(dataset, deadline: now.call + 10))
+    assert_raises(Menoh::DeadlineExceeded) { model.run(dataset, deadline: now.call - 1) }
+    threads = Array.new(4) { Thread.new { model.run(dataset) } }
+    threads.each { |thread| assert_equal(expected, thread.value) }
+    assert_equal(5, model.admission.stats[:admitted])
+    assert_equal(1, model.admission.stats[:shed][:expired])
+
+    pool = onnx.make_model_pool(model_opt, size: 2, capacity: 1)
+    assert_equal(2, pool.admission.concurrency)
+    assert_equal(expected, pool.run(dataset, timeout: 10))
+    assert_raises(Menoh::DeadlineExceeded) { pool.run(dataset, deadline: now.call - 1) }
+  end
+
+  def test_menoh_placement
+    skip 'CPU placement is not supported' unless RUBY_PLATFORM.include?('linux')
+
+    assert_equal([0, 1, 2, 3, 8, 10, 11], Menoh::Placement.parse_cpu_list("0-3,8,10-11\n"))
+    assert_equal({ cpus: [0, 1], numa_node: nil }, Menoh::Placement.resolve(cpus: 0..1))
+    assert_raises { Menoh::Placement.resolve(numa_node: nil) }
+    assert_raises { Menoh::Placement.resolve(cpus: []) }
+    assert_raises { Menoh::Placement.resolve(cpus: [-1]) }
+    assert_equal({ cpus: [1] }, Menoh::Placement.for_model([{ cpus: [0] }, { cpus: [1] }], 3))
+
+    onnx = Menoh::Menoh.new(MNIST_ONNX_FILE)
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [{ name: MNIST_IN_NAME, dims: [1, 1, 28, 28] }],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    dataset = [{ name: MNIST_IN_NAME, data: Array.new(28 * 28, 0.5) }]
+    expected = onnx.make_model(model_opt).run(dataset)
+    affinity = File.read('/proc/self/status')[/^Cpus_allowed_list:\s*(.*)$/, 1]
+
+    model = onnx.make_model(model_opt.merge(placement: { cpus: [0] }))
+    assert_equal({ cpus: [0], numa_node: nil }, model.placement)
+    assert_equal(expected, model.run(dataset))
+    assert_nil(onnx.make_model(model_opt).placement)
+    assert_raises(ArgumentError) { onnx.make_model(model_opt.merge(placement: { cpus: [1 << 20] })) }
+    # the calling thread gets its CPUs back
+    assert_equal(affinity, File.read('/proc/self/status')[/^Cpus_allowed_list:\s*(.*)$/, 1])
+
+    nodes = Menoh::Placement.numa_nodes
+    unless nodes.empty?
+      node, cpus = nodes.first
+      model = onnx.make_model(model_opt.merge(placement: { numa_node: node }))
+      assert_equal(node, model.placement[:numa_node])
+      assert((model.placement[:cpus] - cpus).empty?)
+      assert_raises { onnx.make_model(model_opt.merge(placement: { numa_node: nodes.keys.max + 1 })) }
+
+      pool = onnx.make_model_pool(model_opt.merge(placement: :numa), size: 2)
+      pool.with do |pooled|
+        assert(nodes.key?(pooled.placement[:numa_node]))
+        assert_equal(expected, pooled.run(dataset))
+      end
+    end
+  end
+
+  def test_menoh_load_from_memory
+    batch_size = 2
+    model_opt = {
+      backend: 'mkldnn',
+      input_layers: [
+        {
+          name: MNIST_IN_NAME,
+          dims: [batch_size, 1, 28, 28]
+        }
+      ],
+      output_layers: [MNIST_OUT_NAME]
+    }
+    dataset = [{ name: MNIST_IN_NAME, data: Array.new(batch_size * 1 * 28 * 28, 0.25) }]
+    expected = Menoh::Menoh.new(MNIST_ONNX_FILE).make_model(model_opt).run(dataset)
+
+    from_data = Menoh::Menoh.new(data: File.binread(MNIST_ONNX_FILE))
+    assert_equal(expected, from_data.make_model(model_opt).run(dataset))
+    from_mmap = Menoh::Menoh.new(MNIST_ONNX_FILE, mmap: true)
+    assert_equal(expected, from_mmap.make_model(model_opt).run(dataset))
+
+    assert_raises(Menoh::ONNXParseError) { Menoh::Menoh.new(data: '') }
+    assert_raises { Menoh::Menoh.new(MNIST_ONNX_FILE, data: '') }
+    assert_raises { Menoh::Menoh.new('invalid path', mmap: true) }
+
+    # a model made before fork runs in the child
+    if Process.respond_to?(:fork)
+      model = from_mmap.make_model(model_opt)
+      reader, writer = IO.pipe
+      pid = fork do
+        reader.close
+        writer.write(Marshal.dump(model.run(dataset)))
+        writer.close
+        exit!(0)
+      end
+      writer.close
+      result = Marshal.load(reader.read)
+      Process.wait(pid)
+      assert_equal(expected, result)
+    end
+  end
+
   def test_menoh_new_should_throw_when_the_path_value_is_invalid
     assert_raises { Menoh::Menoh.new('invalid path') }
   end